@@ -4,14 +4,18 @@
 #include <GLFW/glfw3.h>
 // clang-format on
 
+#include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "fireworks_gl.h"
+#include "fireworks_gl_calibrate.h"
 #include "fireworks_gl_process.h"
 #include "fireworks_gl_shaders.h"
+#include "fireworks_gl_snapshot.h"
 
 const float circleVertices[] = {
     1.000f,  0.000f,  0.0f, 0.866f,  0.500f,  0.0f,
@@ -36,6 +40,67 @@ const int circleIndices[] = {
     //
     0, 4, 8, 8, 12, 0};
 
+// Cheaper polygons for smaller particles, a little bigger than the unit
+// circle so they cover the same area as it
+const float octagonVertices[] = {
+    1.054f,  0.000f,  0.0f, 0.745f,  0.745f,  0.0f,
+    0.000f,  1.054f,  0.0f, -0.745f, 0.745f,  0.0f,
+    -1.054f, 0.000f,  0.0f, -0.745f, -0.745f, 0.0f,
+    0.000f,  -1.054f, 0.0f, 0.745f,  -0.745f, 0.0f,
+};
+
+const int octagonIndices[] = {0, 1, 2, 2, 3, 4, 4, 5, 6,
+                              6, 7, 0, 0, 2, 4, 4, 6, 0};
+
+const float diamondVertices[] = {
+    1.253f, 0.000f, 0.0f, 0.000f,  1.253f,  0.0f,
+    -1.253f, 0.000f, 0.0f, 0.000f, -1.253f, 0.0f,
+};
+
+const int diamondIndices[] = {0, 1, 2, 2, 3, 0};
+
+// A square round the particle, cut down to an antialiased circle by
+// geometryFragmentShaderSource. Two triangles rather than the circle's 14.
+const float spriteVertices[] = {
+    -1.0f, -1.0f, 0.0f, 1.0f, -1.0f, 0.0f,
+    1.0f,  1.0f,  0.0f, -1.0f, 1.0f, 0.0f,
+};
+
+const int spriteIndices[] = {0, 1, 2, 2, 3, 0};
+
+// The smallest triangle round the unit circle, for sprites too small to be
+// worth a second one
+const float spriteTriangleVertices[] = {
+    0.000f, 2.0f, 0.0f, -1.732f, -1.0f, 0.0f, 1.732f, -1.0f, 0.0f,
+};
+
+const int spriteTriangleIndices[] = {0, 1, 2};
+
+// In the same order as enum FWGLMesh
+const struct {
+  const float *vertices;
+  size_t vertexBytes;
+  const int *indices;
+  size_t indexBytes;
+} particleMeshSources[FWGL_MESHES] = {
+    {circleVertices, sizeof(circleVertices), circleIndices,
+     sizeof(circleIndices)},
+    {octagonVertices, sizeof(octagonVertices), octagonIndices,
+     sizeof(octagonIndices)},
+    {diamondVertices, sizeof(diamondVertices), diamondIndices,
+     sizeof(diamondIndices)},
+    {spriteVertices, sizeof(spriteVertices), spriteIndices,
+     sizeof(spriteIndices)},
+    {spriteTriangleVertices, sizeof(spriteTriangleVertices),
+     spriteTriangleIndices, sizeof(spriteTriangleIndices)},
+};
+
+// Which mesh each size class gets, for sprites and then for /polygons
+const enum FWGLMesh sizeClassMeshes[2][FWGL_SIZE_CLASSES] = {
+    {FWGL_MESH_SPRITE_TRIANGLE, FWGL_MESH_SPRITE, FWGL_MESH_SPRITE},
+    {FWGL_MESH_DIAMOND, FWGL_MESH_OCTAGON, FWGL_MESH_CIRCLE},
+};
+
 float quadVertices[] = {
     // Screen position      // Texture position
     // Bottom left triangle
@@ -52,8 +117,25 @@ int main(int argc, char *argv[]) {
     FWGL_printHelp();
     return fwgl->error;
   }
+  if (fwgl->replay_path != NULL) {
+    int result = ReplayRun(fwgl->replay_path);
+    free(fwgl);
+    return result;
+  }
+  if (fwgl->timeline_name != NULL &&
+      !TimelineOpen(&(fwgl->timeline), fwgl->timeline_name)) {
+    free(fwgl);
+    return FWGL_ERROR_INIT;
+  }
 
-  FWGL_Init(fwgl, 500, 1);
+  // The pool only grows as far as it needs to, so the finale ceiling can be
+  // generous. Timelines aren't held back by maxRockets, so they need it too.
+  int maxParticles =
+      fwgl->use_finale || fwgl->timeline_name != NULL ? 200000 : 500;
+  if (fwgl->max_particles > 0) {
+    maxParticles = fwgl->max_particles;
+  }
+  FWGL_Init(fwgl, maxParticles, fwgl->use_finale ? 400 : 1);
 
   glfwInit();
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -69,14 +151,37 @@ int main(int argc, char *argv[]) {
 
   FWGL_compileShader(fwgl, &(fwgl->geometryShader), geometryVertexShaderSource,
                      geometryFragmentShaderSource);
-  FWGL_compileShader(fwgl, &(fwgl->pointsShader), pointVertexShaderSource,
-                     pointFragmentShaderSource);
-  FWGL_compileShader(fwgl, &(fwgl->screenShader), screenVertexShaderSource,
-                     screenFragmentShaderSource);
+  char *blurSource = FWGL_makeBlurSource(FWGL_BLUR_SIGMA, FWGL_BLUR_RADIUS);
   FWGL_compileShader(fwgl, &(fwgl->blurredShader), blurVertexShaderSource,
-                     blurFragmentShaderSource);
+                     blurSource);
+  free(blurSource);
+  // A wide enough blur won't fit in shared memory, so it has to stay on the
+  // fragment passes
+  if (fwgl->use_compute_blur) {
+    int sharedMemory = 0;
+    glGetIntegerv(GL_MAX_COMPUTE_SHARED_MEMORY_SIZE, &sharedMemory);
+    size_t sharedBytes = FWGL_computeBlurSharedBytes(FWGL_BLUR_RADIUS);
+    if (sharedBytes > (size_t)sharedMemory) {
+      printf("The compute blur needs %zu bytes of shared memory but only %d "
+             "are available, so using the fragment blur\n",
+             sharedBytes, sharedMemory);
+      fwgl->use_compute_blur = 0;
+    }
+  }
+  if (fwgl->use_compute_blur) {
+    blurSource = FWGL_makeComputeBlurSource(FWGL_BLUR_SIGMA, FWGL_BLUR_RADIUS);
+    FWGL_compileComputeShader(fwgl, &(fwgl->computeBlurShader), blurSource);
+    free(blurSource);
+  }
   FWGL_compileShader(fwgl, &(fwgl->bloomShader), bloomVertexShaderSource,
                      bloomFragmentShaderSource);
+  FWGL_compileShader(fwgl, &(fwgl->downsampleShader), blurVertexShaderSource,
+                     downsampleFragmentShaderSource);
+  FWGL_compileShader(fwgl, &(fwgl->upsampleShader), blurVertexShaderSource,
+                     upsampleFragmentShaderSource);
+  FWGL_compileShader(fwgl, &(fwgl->smokeShader), smokeVertexShaderSource,
+                     smokeFragmentShaderSource);
+  FWGL_findUniforms(fwgl);
 
   if (!fwgl->is_preview) {
     glfwSetInputMode(fwgl->window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -91,6 +196,30 @@ int main(int argc, char *argv[]) {
     glfwTerminate();
     return fwgl->error;
   }
+  FWGL_applyProfile(fwgl);
+
+  // Start with a sky that's already busy, preferably the one from last time.
+  // A timeline starts from the top, so it gets an empty one.
+  if (fwgl->timeline_name != NULL) {
+    SimulationSetTimeline(&(fwgl->simulation), &(fwgl->timeline));
+  }
+  if ((fwgl->resume_path == NULL ||
+       !SnapshotLoad(&(fwgl->simulation), fwgl->resume_path)) &&
+      fwgl->timeline_name == NULL) {
+    PrewarmSimulation(&(fwgl->simulation), fwgl->width, fwgl->height,
+                      fwgl->use_finale ? 20.0f : 5.0f, 0.005f);
+  }
+  if (fwgl->record_path != NULL) {
+    fwgl->recorder =
+        ReplayRecorderOpen(&(fwgl->simulation), fwgl->record_path,
+                           fwgl->timeline_name);
+  }
+  if (fwgl->trace_path != NULL) {
+    fwgl->trace = TraceWriterOpen(fwgl->trace_path);
+  }
+  if (fwgl->resume_path != NULL) {
+    fwgl->snapshots = SnapshotWriterOpen(fwgl->resume_path);
+  }
 
   // Set up timing
   long long lastEpochNano = 0;
@@ -118,6 +247,15 @@ int main(int argc, char *argv[]) {
     FWGL_process(fwgl, dSecs);
     FWGL_render(fwgl);
 
+    // Doesn't count waiting for vsync, so spikes aren't hidden by it
+    if (fwgl->trace != NULL) {
+      timespec_get(&ts, TIME_UTC);
+      float frameSecs = (float)(((long long)(ts.tv_sec * 1e9 + ts.tv_nsec) -
+                                 thisEpochNano) /
+                                1e9);
+      TraceWriterRecord(fwgl->trace, &(fwgl->simulation), dSecs, frameSecs);
+    }
+
     glfwSwapBuffers(fwgl->window);
     glfwPollEvents();
   }
@@ -143,72 +281,41 @@ enum FWGL_Error FWGL_Init(struct FWGL *fwgl, int maxParticles, int maxRockets) {
 
   struct timespec ts;
   timespec_get(&ts, TIME_UTC);
-  srand(ts.tv_nsec);
   if (fwgl->is_preview) {
     printf("Random seed is %ld\n", ts.tv_nsec);
   }
 
-  int renderDataAllocation = sizeof(struct ParticleRenderData) * maxParticles;
-  int particlesAllocation = sizeof(struct Particle) * maxParticles;
-  if (fwgl->is_preview) {
-    printf("renderData will be allocated %d bytes\n", renderDataAllocation);
-    printf("particles will be allocated %d bytes\n", renderDataAllocation);
-  }
-
   fwgl->window, fwgl->geometryShader, fwgl->circleVAO, fwgl->circleVBO,
       fwgl->dataVBO, fwgl->circleEBO = -1;
-  fwgl->renderData = malloc(renderDataAllocation);
+
+  // Until calibration says otherwise
+  fwgl->blurPasses = 2;
 
   struct FWGLSimulation simulation;
-  simulation.maxParticles = maxParticles;
-  simulation.liveParticles = 0;
+  SimulationInit(&simulation, ts.tv_nsec);
   simulation.maxRockets = maxRockets;
-  simulation.liveRockets = 0;
-  simulation.fwglIsPreview = fwgl->is_preview;
-  simulation.particles = malloc(particlesAllocation);
-  simulation.timeSinceRocketCount = 0;
+  if (fwgl->is_preview) {
+    simulation.log = FWGL_log;
+  }
+  // Starts with one chunk and grows as needed
+  ParticlePoolInit(&simulation, maxParticles);
+  if (fwgl->use_finale) {
+    LaunchSchedulerFinale(&simulation);
+  }
+  // The smoke grid needs the window size, so FWGL_prepareBuffers makes it
+  simulation.jobs = JobsCreate(JobsDefaultThreadCount());
   fwgl->simulation = simulation;
 
-  struct Particle defaultParticle;
-  defaultParticle.isAlive = 0;
-  defaultParticle.position[0] = 0;
-  defaultParticle.position[1] = 0;
-  defaultParticle.position[2] = 0;
-  defaultParticle.velocity[0] = 0;
-  defaultParticle.velocity[1] = 0;
-  defaultParticle.velocity[2] = 0;
-  defaultParticle.acceleration[0] = 0;
-  defaultParticle.acceleration[1] = 0;
-  defaultParticle.acceleration[2] = 0;
-  defaultParticle.colour[0] = 1;
-  defaultParticle.colour[1] = 1;
-  defaultParticle.colour[2] = 1;
-  defaultParticle.colour[3] = 1;
-  defaultParticle.children = 0;
-  defaultParticle.radius = 0;
-  defaultParticle.remainingLife = 0;
-  defaultParticle.timeSinceLastEmission = 0;
-  defaultParticle.type = PT_HAZE;
-
-  for (int i = 0; i < simulation.maxParticles; i++) {
-    fwgl->simulation.particles[i] = defaultParticle;
-  }
-
-  struct ParticleRenderData defaultRenderData;
-  defaultRenderData.translate[0] = 0;
-  defaultRenderData.translate[1] = 0;
-  defaultRenderData.translate[2] = 0;
-  defaultRenderData.colour[0] = 1;
-  defaultRenderData.colour[1] = 1;
-  defaultRenderData.colour[2] = 1;
-  defaultRenderData.colour[3] = 1;
-  defaultRenderData.radius = 1;
-  defaultRenderData.remainingLife = 0;
-  defaultRenderData.particleType = PT_HAZE;
-
-  for (int i = 0; i < simulation.maxParticles; i++) {
-    fwgl->renderData[i] = defaultRenderData;
+  // FWGL_prepareBuffers makes the ring once there's a context
+  fwgl->ringData = NULL;
+  fwgl->ringRegionCapacity = 0;
+  fwgl->ringRegion = 0;
+  for (int i = 0; i < FWGL_RING_REGIONS; i++) {
+    fwgl->ringFences[i] = NULL;
   }
+  fwgl->commandBuffer = 0;
+  fwgl->ringCommands = NULL;
+  fwgl->classCounts = NULL;
 
   fwgl->error = FWGL_OK;
   return FWGL_OK;
@@ -225,19 +332,59 @@ enum FWGL_Error FWGL_DeInit(struct FWGL *fwgl) {
   glDeleteVertexArrays(1, &(fwgl->circleVAO));
   glDeleteBuffers(1, &(fwgl->circleVBO));
   glDeleteBuffers(1, &(fwgl->circleEBO));
+  glDeleteBuffers(1, &(fwgl->dimensionUBO));
   glDeleteProgram(fwgl->geometryShader);
   glDeleteFramebuffers(1, &(fwgl->geometryFBO));
-  // TODO delete the rest of the buffers
+  glDeleteTextures(1, &(fwgl->geometryTexture));
+  glDeleteProgram(fwgl->blurredShader);
+  glDeleteFramebuffers(1, &(fwgl->blurredFBO1));
+  glDeleteFramebuffers(1, &(fwgl->blurredFBO2));
+  glDeleteTextures(1, &(fwgl->blurredTexture1));
+  glDeleteTextures(1, &(fwgl->blurredTexture2));
+  if (fwgl->use_compute_blur) {
+    glDeleteProgram(fwgl->computeBlurShader);
+  }
+  glDeleteProgram(fwgl->bloomShader);
+  glDeleteFramebuffers(fwgl->bloomLevels, fwgl->bloomMipFBOs);
+  glDeleteTextures(fwgl->bloomLevels, fwgl->bloomMipTextures);
+  glDeleteProgram(fwgl->downsampleShader);
+  glDeleteProgram(fwgl->upsampleShader);
+  glDeleteVertexArrays(1, &(fwgl->screenVAO));
+  glDeleteBuffers(1, &(fwgl->screenVBO));
+  // The shader is always compiled, but the texture is only made for /smoke
+  glDeleteProgram(fwgl->smokeShader);
+  if (fwgl->use_smoke) {
+    glDeleteTextures(1, &(fwgl->smokeTexture));
+  }
 
   if (fwgl->is_preview) {
     printf("Freeing memory...  ");
   }
-  free(fwgl->renderData);
-  free(fwgl->simulation.particles);
+  glFinish();
+  for (int i = 0; i < FWGL_RING_REGIONS; i++) {
+    if (fwgl->ringFences[i] != NULL) {
+      glDeleteSync(fwgl->ringFences[i]);
+    }
+  }
+  // Deleting them unmaps them too
+  glDeleteBuffers(1, &(fwgl->dataVBO));
+  glDeleteBuffers(1, &(fwgl->commandBuffer));
+  free(fwgl->classCounts);
+  ReplayRecorderClose(fwgl->recorder);
+  TraceWriterClose(fwgl->trace);
+  SnapshotWriterClose(fwgl->snapshots);
+  TimelineFree(&(fwgl->timeline));
+  SimulationFree(&(fwgl->simulation));
+  JobsDestroy(fwgl->simulation.jobs);
   free(fwgl);
   return FWGL_OK;
 }
 
+void FWGL_log(void *context, const char *message) {
+  (void)context;
+  printf("%s", message);
+}
+
 void FWGL_parseArgs(struct FWGL *fwgl, int argc, char *argv[]) {
   if (argc < 2) {
     printf("Not enough arguments!\n");
@@ -245,7 +392,12 @@ void FWGL_parseArgs(struct FWGL *fwgl, int argc, char *argv[]) {
     return;
   }
 
-  if (strcmp(argv[1], "/s") == 0) {
+  fwgl->replay_path = NULL;
+  if (strcmp(argv[1], "/replay") == 0 && argc == 3) {
+    fwgl->replay_path = argv[2];
+    fwgl->error = FWGL_OK;
+    return;
+  } else if (strcmp(argv[1], "/s") == 0) {
     fwgl->is_preview = 0;
   } else if (strcmp(argv[1], "/p") == 0) {
     fwgl->is_preview = 1;
@@ -256,6 +408,60 @@ void FWGL_parseArgs(struct FWGL *fwgl, int argc, char *argv[]) {
     return;
   }
 
+  // Optional extras after the mode
+  fwgl->use_smoke = 0;
+  fwgl->use_finale = 0;
+  fwgl->use_polygons = 0;
+  fwgl->use_full_blur = 0;
+  fwgl->use_compute_blur = 0;
+  fwgl->max_particles = 0;
+  fwgl->force_calibrate = 0;
+  fwgl->resume_path = NULL;
+  fwgl->snapshots = NULL;
+  fwgl->record_path = NULL;
+  fwgl->recorder = NULL;
+  fwgl->trace_path = NULL;
+  fwgl->trace = NULL;
+  fwgl->timeline_name = NULL;
+  memset(&(fwgl->timeline), 0, sizeof(struct FWGLTimeline));
+  fwgl->timeSinceSnapshot = 0;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "/smoke") == 0) {
+      fwgl->use_smoke = 1;
+    } else if (strcmp(argv[i], "/finale") == 0) {
+      fwgl->use_finale = 1;
+    } else if (strcmp(argv[i], "/polygons") == 0) {
+      fwgl->use_polygons = 1;
+    } else if (strcmp(argv[i], "/fullblur") == 0) {
+      fwgl->use_full_blur = 1;
+    } else if (strcmp(argv[i], "/computeblur") == 0) {
+      // The mip chain has nothing for it to do, so it means /fullblur too
+      fwgl->use_compute_blur = 1;
+      fwgl->use_full_blur = 1;
+    } else if (strcmp(argv[i], "/calibrate") == 0) {
+      fwgl->force_calibrate = 1;
+    } else if (strcmp(argv[i], "/resume") == 0 && i + 1 < argc) {
+      fwgl->resume_path = argv[++i];
+    } else if (strcmp(argv[i], "/record") == 0 && i + 1 < argc) {
+      fwgl->record_path = argv[++i];
+    } else if (strcmp(argv[i], "/timeline") == 0 && i + 1 < argc) {
+      fwgl->timeline_name = argv[++i];
+    } else if (strcmp(argv[i], "/trace") == 0 && i + 1 < argc) {
+      fwgl->trace_path = argv[++i];
+    } else if (strcmp(argv[i], "/maxparticles") == 0 && i + 1 < argc) {
+      fwgl->max_particles = atoi(argv[++i]);
+      if (fwgl->max_particles <= 0) {
+        printf("Bad particle ceiling: %s\n", argv[i]);
+        fwgl->error = FWGL_ERROR_INIT_UNKNOWNARG;
+        return;
+      }
+    } else {
+      printf("Unrecognised argument: %s\n", argv[i]);
+      fwgl->error = FWGL_ERROR_INIT_UNKNOWNARG;
+      return;
+    }
+  }
+
   fwgl->error = FWGL_OK;
 }
 
@@ -267,9 +473,31 @@ void FWGL_printHelp() {
   printf("  Options:\n");
   printf("      /s - Run in screensaver mode (fullscreen, logging disabled)\n");
   printf("      /p - Run in preview mode (small window, logging enabled)\n");
+  printf("  Extras (after /s or /p):\n");
+  printf("      /smoke - Simulate haze as a smoke grid instead of particles\n");
+  printf("      /finale - Launch salvos and finales of hundreds of rockets\n");
+  printf("      /timeline <file> - Launch rockets from a timeline file, or "
+         "sparse, steady or finale\n");
+  printf("      /maxparticles <n> - Let the particle pool grow up to n\n");
+  printf("      /polygons - Draw particles as 16-sided polygons instead of "
+         "antialiased sprites\n");
+  printf("      /fullblur - Blur the glow at full resolution instead of "
+         "down a mip chain\n");
+  printf("      /computeblur - /fullblur, with the Gaussian passes in a "
+         "compute shader rather than fragment shaders\n");
+  printf("      /calibrate - Re-measure the particle and blur budget\n");
+  printf("      /resume <file> - Save the show every second, and pick it back "
+         "up from there next time\n");
+  printf("      /record <file> - Record every frame, to check with /replay\n");
+  printf("      /trace <file> - Trace every particle and frame time, to read "
+         "with fwgl_trace\n");
+  printf("  Or, with no window:\n");
+  printf("      /replay <file> - Re-run a recording and check it still "
+         "matches\n");
   printf("  Correct usage:\n");
   printf("      FireworksGL.scr /s\n");
-  printf("      FireworksGL.scr /p\n\n");
+  printf("      FireworksGL.scr /p\n");
+  printf("      FireworksGL.scr /s /smoke\n\n");
 }
 
 void FWGL_createGLFWWindow(struct FWGL *fwgl) {
@@ -310,15 +538,19 @@ void FWGL_createGLFWWindow(struct FWGL *fwgl) {
     return;
   }
 
-  glViewport(0, 0, width, height);
+  // In pixels, which on a HiDPI screen is more than the window size
+  fwgl->window = window;
+  glfwGetFramebufferSize(window, &(fwgl->width), &(fwgl->height));
+  glViewport(0, 0, fwgl->width, fwgl->height);
+  glfwSetWindowUserPointer(window, fwgl);
   glfwSetFramebufferSizeCallback(window, FWGL_framebufferSizeCallback);
 
-  fwgl->window = window;
   fwgl->error = FWGL_OK;
 }
 
 void FWGL_framebufferSizeCallback(GLFWwindow *window, int width, int height) {
   glViewport(0, 0, width, height);
+  FWGL_updateDimensions(glfwGetWindowUserPointer(window), width, height);
 }
 
 void FWGL_process(struct FWGL *fwgl, float dSecs) {
@@ -331,10 +563,19 @@ void FWGL_process(struct FWGL *fwgl, float dSecs) {
     glfwSetWindowShouldClose(fwgl->window, GLFW_TRUE);
   }
 
-  int width;
-  int height;
-  glfwGetWindowSize(fwgl->window, &width, &height);
-  MoveParticles(&(fwgl->simulation), width, height, dSecs);
+  MoveParticles(&(fwgl->simulation), fwgl->width, fwgl->height, dSecs);
+  if (fwgl->recorder != NULL) {
+    ReplayRecord(fwgl->recorder, &(fwgl->simulation), fwgl->width,
+                 fwgl->height, dSecs);
+  }
+
+  if (fwgl->snapshots != NULL) {
+    fwgl->timeSinceSnapshot += dSecs;
+    if (fwgl->timeSinceSnapshot >= 1.0f) {
+      SnapshotWriterSave(fwgl->snapshots, &(fwgl->simulation));
+      fwgl->timeSinceSnapshot = 0;
+    }
+  }
 }
 
 void FWGL_compileShader(struct FWGL *fwgl, unsigned int *program,
@@ -384,6 +625,166 @@ void FWGL_compileShader(struct FWGL *fwgl, unsigned int *program,
   }
 }
 
+void FWGL_compileComputeShader(struct FWGL *fwgl, unsigned int *program,
+                               const char *source) {
+  int success;
+  char log[512];
+
+  if (fwgl->is_preview) {
+    printf("Compute Shader:\n%s\n", source);
+  }
+
+  unsigned int shader = glCreateShader(GL_COMPUTE_SHADER);
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+  if (!success) {
+    glGetShaderInfoLog(shader, 512, NULL, log);
+    printf("Failed to compile compute shader: %s", log);
+  }
+
+  *program = glCreateProgram();
+  glAttachShader(*program, shader);
+  glLinkProgram(*program);
+  glGetProgramiv(*program, GL_LINK_STATUS, &success);
+  if (!success) {
+    glGetProgramInfoLog(*program, 512, NULL, log);
+    printf("Failed to link compute shader program: %s", log);
+  }
+
+  glDeleteShader(shader);
+  if (fwgl->is_preview) {
+    printf("Successfully compiled and linked compute shader!\n");
+  }
+}
+
+// One side of a Gaussian of sigma texels, from the middle out to radius,
+// scaled so both sides add up to 1
+void FWGL_blurKernel(float sigma, int radius, double *kernel) {
+  double total = 0;
+  for (int i = 0; i <= radius; i++) {
+    kernel[i] = exp(-(double)(i * i) / (2.0 * sigma * sigma));
+    total += i == 0 ? kernel[i] : 2 * kernel[i];
+  }
+  for (int i = 0; i <= radius; i++) {
+    kernel[i] /= total;
+  }
+}
+
+// Writes out the blur fragment shader for a Gaussian of sigma texels, cut off
+// radius texels each way. Past the middle, each pair of taps is merged into a
+// single bilinear fetch between them, weighted so it comes out the same, so a
+// radius of 4 takes 5 fetches rather than 9. The caller frees it.
+char *FWGL_makeBlurSource(float sigma, int radius) {
+  double *kernel = malloc(sizeof(double) * (radius + 1));
+  FWGL_blurKernel(sigma, radius, kernel);
+
+  int taps = 1 + (radius + 1) / 2;
+  double *offsets = malloc(sizeof(double) * taps);
+  double *weights = malloc(sizeof(double) * taps);
+  offsets[0] = 0;
+  weights[0] = kernel[0];
+  for (int tap = 1; tap < taps; tap++) {
+    int first = 2 * tap - 1;
+    // The last one has no partner if the radius is odd
+    double second = first < radius ? kernel[first + 1] : 0;
+    weights[tap] = kernel[first] + second;
+    offsets[tap] = first + second / (kernel[first] + second);
+  }
+
+  size_t size = strlen(blurFragmentShaderStart) +
+                strlen(blurFragmentShaderEnd) + 32 * taps + 128;
+  char *source = malloc(size);
+  int length = snprintf(source, size, "%sconst int TAPS = %d;\n",
+                        blurFragmentShaderStart, taps);
+  length += snprintf(source + length, size - length,
+                     "const float offsets[TAPS] = float[](");
+  for (int tap = 0; tap < taps; tap++) {
+    length += snprintf(source + length, size - length, "%s%.7f",
+                       tap > 0 ? ", " : "", offsets[tap]);
+  }
+  length += snprintf(source + length, size - length,
+                     ");\nconst float weights[TAPS] = float[](");
+  for (int tap = 0; tap < taps; tap++) {
+    length += snprintf(source + length, size - length, "%s%.7f",
+                       tap > 0 ? ", " : "", weights[tap]);
+  }
+  snprintf(source + length, size - length, ");\n%s", blurFragmentShaderEnd);
+
+  free(kernel);
+  free(offsets);
+  free(weights);
+  return source;
+}
+
+// Every invocation in a workgroup is a pixel of the tile, and 1024 is as many
+// as GL promises
+_Static_assert(FWGL_BLUR_TILE * FWGL_BLUR_TILE <= 1024,
+               "compute blur tile is too big for a workgroup");
+
+// The same blur as a compute shader, which has every texel in shared memory
+// so doesn't need the bilinear trick. The caller frees it.
+char *FWGL_makeComputeBlurSource(float sigma, int radius) {
+  double *kernel = malloc(sizeof(double) * (radius + 1));
+  FWGL_blurKernel(sigma, radius, kernel);
+
+  size_t size = strlen(computeBlurShaderStart) +
+                strlen(computeBlurShaderEnd) + 16 * radius + 256;
+  char *source = malloc(size);
+  int length = snprintf(source, size,
+                        "%slayout(local_size_x = %d, local_size_y = %d) in;\n"
+                        "const int TILE = %d;\n"
+                        "const int RADIUS = %d;\n"
+                        "const float weights[RADIUS + 1] = float[](",
+                        computeBlurShaderStart, FWGL_BLUR_TILE,
+                        FWGL_BLUR_TILE, FWGL_BLUR_TILE, radius);
+  for (int i = 0; i <= radius; i++) {
+    length += snprintf(source + length, size - length, "%s%.7f",
+                       i > 0 ? ", " : "", kernel[i]);
+  }
+  snprintf(source + length, size - length, ");\n%s", computeBlurShaderEnd);
+
+  free(kernel);
+  return source;
+}
+
+// Shared memory the compute blur needs for its texels and across arrays. A
+// vec3 takes up 16 bytes there, like in std140.
+size_t FWGL_computeBlurSharedBytes(int radius) {
+  size_t side = FWGL_BLUR_TILE + 2 * radius;
+  return 16 * (side * side + side * FWGL_BLUR_TILE);
+}
+
+void FWGL_findUniforms(struct FWGL *fwgl) {
+  fwgl->geometryTimeLocation =
+      glGetUniformLocation(fwgl->geometryShader, "time");
+  fwgl->geometryEdgeLocation =
+      glGetUniformLocation(fwgl->geometryShader, "edge");
+  fwgl->blurHorizontalLocation =
+      glGetUniformLocation(fwgl->blurredShader, "horizontal");
+  fwgl->smokeScreenScaleLocation =
+      glGetUniformLocation(fwgl->smokeShader, "screenScale");
+
+  // Samplers always read the same texture units, so they're only set once
+  glUseProgram(fwgl->bloomShader);
+  glUniform1i(glGetUniformLocation(fwgl->bloomShader, "texture0_screen"), 0);
+  glUniform1i(glGetUniformLocation(fwgl->bloomShader, "texture1_blur"), 1);
+  glUseProgram(0);
+}
+
+// The framebuffer size in the UBO the shaders use, and for the simulation.
+// Only needs doing when the window changes.
+void FWGL_updateDimensions(struct FWGL *fwgl, int width, int height) {
+  fwgl->width = width;
+  fwgl->height = height;
+
+  // Need to pad it to 16 bytes for std140 layout
+  int dimensions[4] = {fwgl->width, fwgl->height, 0, 0};
+  glBindBuffer(GL_UNIFORM_BUFFER, fwgl->dimensionUBO);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(dimensions), &dimensions);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
 void FWGL_makeTexture(unsigned int *texture, int width, int height) {
 
   unsigned int handle;
@@ -422,22 +823,16 @@ void FWGL_prepareBuffers(struct FWGL *fwgl) {
   //
   // Basic output of the particle geometry (semi-transparent circles on a black
   // background)
-  unsigned int dimensionUBO, circleVAO, circleVBO, circleEBO, dataVBO;
+  unsigned int dimensionUBO, circleVAO, circleVBO, circleEBO;
   unsigned int geometryFBO, geometryTexture, geometryShader;
-  unsigned int pointsVAO;
   // A blurred version of the geometry
   unsigned int blurredFBO1, blurredTexture1, blurredShader;
   unsigned int blurredFBO2, blurredTexture2;
-  // A HDR buffer with the bloom (addition) result of the blur and geometry
-  // buffers
-  unsigned int bloomFBO, bloomTexture;
-  // A tone-remapped FBO to reduce the bloom to the standard 0-1 range.
-  unsigned int tonemappedFBO;
-  // Tone-mapped buffer gets drawn to the screen
-  unsigned int screenShader, screenVAO, screenVBO;
+  // A quad over the whole screen, for the passes that work on textures
+  unsigned int screenVAO, screenVBO;
 
-  int width, height;
-  glfwGetWindowSize(fwgl->window, &width, &height);
+  int width = fwgl->width;
+  int height = fwgl->height;
 
   //
   // Framebuffers
@@ -450,9 +845,47 @@ void FWGL_prepareBuffers(struct FWGL *fwgl) {
   FWGL_makeTexture(&blurredTexture2, width, height);
   FWGL_makeFramebuffer(&blurredFBO1, blurredTexture1);
   FWGL_makeFramebuffer(&blurredFBO2, blurredTexture2);
-  // Bloom
-  FWGL_makeTexture(&bloomTexture, width, height);
-  FWGL_makeFramebuffer(&bloomFBO, bloomTexture);
+  // Bloom mip chain, stopping early rather than go below a pixel
+  fwgl->bloomLevels = 0;
+  for (int level = 0; level < FWGL_BLOOM_LEVELS; level++) {
+    int mipWidth = width >> (level + 1);
+    int mipHeight = height >> (level + 1);
+    if (mipWidth < 1 || mipHeight < 1) {
+      break;
+    }
+    FWGL_makeTexture(&(fwgl->bloomMipTextures[level]), mipWidth, mipHeight);
+    FWGL_makeFramebuffer(&(fwgl->bloomMipFBOs[level]),
+                         fwgl->bloomMipTextures[level]);
+    fwgl->bloomMipWidths[level] = mipWidth;
+    fwgl->bloomMipHeights[level] = mipHeight;
+    fwgl->bloomLevels++;
+  }
+  // Every level of the chain ends up added together, so they're averaged to
+  // keep about the same glow as the Gaussian passes
+  float bloomStrength = 1.0f;
+  if (!fwgl->use_full_blur && fwgl->bloomLevels > 0) {
+    float weights = 0;
+    float weight = 1;
+    for (int level = 0; level < fwgl->bloomLevels; level++) {
+      weights += weight;
+      weight *= FWGL_BLOOM_FALLOFF;
+    }
+    bloomStrength = 1.0f / weights;
+  }
+  glUseProgram(fwgl->bloomShader);
+  glUniform1f(glGetUniformLocation(fwgl->bloomShader, "bloomStrength"),
+              bloomStrength);
+  glUseProgram(0);
+  // Smoke, one texel per grid cell and stretched over the screen
+  if (fwgl->use_smoke) {
+    struct FWGLSmokeGrid *smoke =
+        SmokeGridCreate(width, height, SMOKE_CELL_SIZE);
+    fwgl->simulation.smoke = smoke;
+    FWGL_makeTexture(&(fwgl->smokeTexture), smoke->width, smoke->height);
+    if (fwgl->is_preview) {
+      printf("Smoke grid is %dx%d cells\n", smoke->width, smoke->height);
+    }
+  }
 
   // 2*f Screen Position (x,y)
   // 2*f Texture Coordinates (x,y)
@@ -472,25 +905,40 @@ void FWGL_prepareBuffers(struct FWGL *fwgl) {
   // Standard rendering
   //
 
-  // 3*f Translate (x,y,z)
-  // 4*f Colour (r,g,b,a)
-  // 1*f Radius (r)
-  // 1*f Remaining Life (l)
-  // 1*i Particle Type (t)
-  glGenBuffers(1, &dataVBO);
-
   // Vertices
   glGenVertexArrays(1, &circleVAO);
   glGenBuffers(1, &circleVBO);
   glGenBuffers(1, &circleEBO);
 
   glBindVertexArray(circleVAO);
+  // Every mesh back to back, with where each one went kept in fwgl->meshes
+  size_t vertexBytes = 0;
+  size_t indexBytes = 0;
+  for (int i = 0; i < FWGL_MESHES; i++) {
+    vertexBytes += particleMeshSources[i].vertexBytes;
+    indexBytes += particleMeshSources[i].indexBytes;
+  }
   glBindBuffer(GL_ARRAY_BUFFER, circleVBO);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(circleVertices), circleVertices,
-               GL_STATIC_DRAW);
+  glBufferData(GL_ARRAY_BUFFER, vertexBytes, NULL, GL_STATIC_DRAW);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, circleEBO);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(circleIndices), circleIndices,
-               GL_STATIC_DRAW);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes, NULL, GL_STATIC_DRAW);
+
+  vertexBytes = 0;
+  indexBytes = 0;
+  for (int i = 0; i < FWGL_MESHES; i++) {
+    glBufferSubData(GL_ARRAY_BUFFER, vertexBytes,
+                    particleMeshSources[i].vertexBytes,
+                    particleMeshSources[i].vertices);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indexBytes,
+                    particleMeshSources[i].indexBytes,
+                    particleMeshSources[i].indices);
+    fwgl->meshes[i].indexCount =
+        (int)(particleMeshSources[i].indexBytes / sizeof(int));
+    fwgl->meshes[i].firstIndex = (int)(indexBytes / sizeof(int));
+    fwgl->meshes[i].baseVertex = (int)(vertexBytes / (3 * sizeof(float)));
+    vertexBytes += particleMeshSources[i].vertexBytes;
+    indexBytes += particleMeshSources[i].indexBytes;
+  }
 
   // 2*i Dimensions (w,h)
   glGenBuffers(1, &dimensionUBO);
@@ -499,236 +947,461 @@ void FWGL_prepareBuffers(struct FWGL *fwgl) {
   int defaultDimensions[4] = {100, 100, 0, 0}; // Pad to 16 bytes for std140
   glBufferData(GL_UNIFORM_BUFFER, sizeof(defaultDimensions), defaultDimensions,
                GL_STATIC_DRAW);
+  fwgl->dimensionUBO = dimensionUBO;
+  FWGL_updateDimensions(fwgl, fwgl->width, fwgl->height);
 
   // Vertex attributes
   // Vertex base position (x,y,z)
   glEnableVertexAttribArray(0);
   glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void *)0);
-  // Translate (x,y,z)
-  glBindBuffer(GL_ARRAY_BUFFER, dataVBO);
-  glEnableVertexAttribArray(1);
-  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE,
-                        sizeof(struct ParticleRenderData), (void *)0);
-  // Colour (r,g,b,a)
-  glEnableVertexAttribArray(2);
-  glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE,
-                        sizeof(struct ParticleRenderData),
-                        (void *)(3 * sizeof(float)));
-  // Radius (r)
-  glEnableVertexAttribArray(3);
-  glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE,
-                        sizeof(struct ParticleRenderData),
-                        (void *)(7 * sizeof(float)));
-  // Remaining Life (l)
-  glEnableVertexAttribArray(4);
-  glVertexAttribPointer(4, 1, GL_FLOAT, GL_FALSE,
-                        sizeof(struct ParticleRenderData),
-                        (void *)(8 * sizeof(float)));
-  // Particle Type (t)
-  glEnableVertexAttribArray(5);
-  glVertexAttribIPointer(5, 1, GL_INT, sizeof(struct ParticleRenderData),
-                         (void *)(9 * sizeof(float)));
-
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  glVertexAttribDivisor(1, 1); // Stride of 1 between swapping attributes
-  glVertexAttribDivisor(2, 1); // Stride of 1 between swapping attributes
-  glVertexAttribDivisor(3, 1); // Stride of 1 between swapping attributes
-  glVertexAttribDivisor(4, 1); // Stride of 1 between swapping attributes
-  glVertexAttribDivisor(5, 1); // Stride of 1 between swapping attributes
-
   glBindVertexArray(0);
 
-  // Points based on translations
-  glGenVertexArrays(1, &pointsVAO);
-  glBindVertexArray(pointsVAO);
-  glBindBuffer(GL_ARRAY_BUFFER, dataVBO);
-  glEnableVertexAttribArray(0);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,
-                        sizeof(struct ParticleRenderData), (void *)0);
-  glEnableVertexAttribArray(1);
-  glVertexAttribIPointer(1, 1, GL_INT, sizeof(struct ParticleRenderData),
-                         (void *)(9 * sizeof(float)));
-  glBindVertexArray(0);
+  // The per particle data comes from the ring, which FWGL_resizeRing makes
+  fwgl->circleVAO = circleVAO;
+  fwgl->dataVBO = 0;
+  FWGL_resizeRing(fwgl, fwgl->simulation.capacity);
 
   //
-  fwgl->dimensionUBO = dimensionUBO;
-  fwgl->circleVAO = circleVAO;
   fwgl->circleVBO = circleVBO;
   fwgl->circleEBO = circleEBO;
-  fwgl->dataVBO = dataVBO;
   //
   fwgl->geometryFBO = geometryFBO;
   fwgl->geometryTexture = geometryTexture;
-  fwgl->pointsVAO = pointsVAO;
   //
   fwgl->blurredFBO1 = blurredFBO1;
   fwgl->blurredTexture1 = blurredTexture1;
   fwgl->blurredFBO2 = blurredFBO2;
   fwgl->blurredTexture2 = blurredTexture2;
   //
-  fwgl->bloomFBO = bloomFBO;
-  fwgl->bloomTexture = bloomTexture;
-  //
   fwgl->screenVAO = screenVAO;
+  fwgl->screenVBO = screenVBO;
 
   fwgl->error = FWGL_OK;
 }
 
-void FWGL_render(struct FWGL *fwgl) {
+// Point the instance attributes of the circles at the start of the ring.
+// Each frame picks its region with the base instance rather than moving them.
+void FWGL_pointAttributesAtRing(struct FWGL *fwgl) {
+  // 2*us Position (x,y)
+  // 4*ub Colour (r,g,b,a)
+  // 1*h Radius (r)
+  // 1*h Remaining Life (l)
+  // 1*u Particle Type and ID (t,i)
+  GLsizei stride = sizeof(struct ParticleRenderData);
+  glBindVertexArray(fwgl->circleVAO);
+  glBindBuffer(GL_ARRAY_BUFFER, fwgl->dataVBO);
+  // Position (x,y)
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride,
+                        (void *)offsetof(struct ParticleRenderData, position));
+  // Colour (r,g,b,a)
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                        (void *)offsetof(struct ParticleRenderData, colour));
+  // Radius (r)
+  glEnableVertexAttribArray(3);
+  glVertexAttribPointer(3, 1, GL_HALF_FLOAT, GL_FALSE, stride,
+                        (void *)offsetof(struct ParticleRenderData, radius));
+  // Remaining Life (l)
+  glEnableVertexAttribArray(4);
+  glVertexAttribPointer(
+      4, 1, GL_HALF_FLOAT, GL_FALSE, stride,
+      (void *)offsetof(struct ParticleRenderData, remainingLife));
+  // Particle Type and ID (t,i)
+  glEnableVertexAttribArray(5);
+  glVertexAttribIPointer(
+      5, 1, GL_UNSIGNED_INT, stride,
+      (void *)offsetof(struct ParticleRenderData, typeAndId));
 
-  //
-  // Geometry
-  //
-  struct FWGLSimulation *simulation = &(fwgl->simulation);
-  struct Particle *p;
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glVertexAttribDivisor(1, 1); // Stride of 1 between swapping attributes
+  glVertexAttribDivisor(2, 1); // Stride of 1 between swapping attributes
+  glVertexAttribDivisor(3, 1); // Stride of 1 between swapping attributes
+  glVertexAttribDivisor(4, 1); // Stride of 1 between swapping attributes
+  glVertexAttribDivisor(5, 1); // Stride of 1 between swapping attributes
+  glBindVertexArray(0);
+}
 
-  int renderParticles = 0;
-  for (int pId = 0; pId < simulation->maxParticles; pId++) {
-    p = &(simulation->particles[pId]);
-    if (!p->isAlive) {
-      continue;
+// Make each region the smallest power of two chunks that fits this many
+// particles. Storage can't be resized, so it's a whole new buffer, after
+// waiting for the GPU to be done with the old one. Regions at least double or
+// quarter each time, so this stays rare.
+void FWGL_resizeRing(struct FWGL *fwgl, int particles) {
+  int capacity = PARTICLE_CHUNK_SIZE;
+  while (capacity < particles) {
+    capacity *= 2;
+  }
+
+  if (fwgl->dataVBO != 0) {
+    glFinish();
+    glDeleteBuffers(1, &(fwgl->dataVBO));
+    glDeleteBuffers(1, &(fwgl->commandBuffer));
+  }
+  for (int i = 0; i < FWGL_RING_REGIONS; i++) {
+    if (fwgl->ringFences[i] != NULL) {
+      glDeleteSync(fwgl->ringFences[i]);
+      fwgl->ringFences[i] = NULL;
     }
+  }
 
-    struct ParticleRenderData data;
-    // Translate (x,y,z)
-    data.translate[0] = p->position[0];
-    data.translate[1] = p->position[1];
-    data.translate[2] = p->position[2];
-    // Colour (r,g,b,a)
-    data.colour[0] = p->colour[0];
-    data.colour[1] = p->colour[1];
-    data.colour[2] = p->colour[2];
-    data.colour[3] = p->colour[3];
-    // Radius (r)
-    data.radius = p->radius;
-    // Remaining Life (l)
-    data.remainingLife = p->remainingLife;
-    // Particle Type (t)
-    data.particleType = p->type;
-
-    fwgl->renderData[renderParticles] = data;
-    renderParticles++;
+  // Coherent, so writes are seen without flushing them
+  GLbitfield flags =
+      GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  GLsizeiptr size = (GLsizeiptr)sizeof(struct ParticleRenderData) * capacity *
+                    FWGL_RING_REGIONS;
+  glGenBuffers(1, &(fwgl->dataVBO));
+  glBindBuffer(GL_ARRAY_BUFFER, fwgl->dataVBO);
+  glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+  fwgl->ringData = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  // Every chunk but the last is full, so this is a draw for each of those
+  // and each class
+  int chunks = capacity / PARTICLE_CHUNK_SIZE;
+  GLsizeiptr commandSize = (GLsizeiptr)sizeof(struct FWGLDrawCommand) *
+                           chunks * FWGL_SIZE_CLASSES * FWGL_RING_REGIONS;
+  glGenBuffers(1, &(fwgl->commandBuffer));
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, fwgl->commandBuffer);
+  glBufferStorage(GL_DRAW_INDIRECT_BUFFER, commandSize, NULL, flags);
+  fwgl->ringCommands =
+      glMapBufferRange(GL_DRAW_INDIRECT_BUFFER, 0, commandSize, flags);
+  glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+  fwgl->classCounts =
+      realloc(fwgl->classCounts, sizeof(int) * chunks * FWGL_SIZE_CLASSES);
+  fwgl->ringRegionCapacity = capacity;
+  fwgl->ringRegion = 0;
+  if (fwgl->is_preview) {
+    printf("Instance ring is %d regions of %d particles (%lld bytes)\n",
+           FWGL_RING_REGIONS, capacity, (long long)size);
   }
 
-  // Need to pad it to 16 bytes for std140 layout
-  int dimensions[4] = {200, 200, 0, 0};
-  glfwGetWindowSize(fwgl->window, &(dimensions[0]), &(dimensions[1]));
-  glBindBuffer(GL_UNIFORM_BUFFER, fwgl->dimensionUBO);
-  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(dimensions), &dimensions);
-  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  FWGL_pointAttributesAtRing(fwgl);
+}
 
-  // Does this need to come before the uniform buffer?
-  glBindFramebuffer(GL_FRAMEBUFFER, fwgl->geometryFBO);
-  glClearColor(0, 0, 0, 1);
-  glClear(GL_COLOR_BUFFER_BIT);
+// Round to nearest, flushing anything too small for a normal half to zero.
+// Nothing packed is ever big enough to overflow.
+uint16_t FWGL_packHalf(float value) {
+  union {
+    float f;
+    uint32_t u;
+  } bits = {value};
+  uint32_t sign = (bits.u >> 16) & 0x8000;
+  int exponent = (int)((bits.u >> 23) & 0xFF) - 127 + 15;
+  uint32_t mantissa = bits.u & 0x7FFFFF;
+  if (exponent <= 0) {
+    return (uint16_t)sign;
+  }
+  if (exponent >= 31) {
+    return (uint16_t)(sign | 0x7C00);
+  }
+  // A carry out of the mantissa moves the exponent up, which is still right
+  uint32_t half = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+  if (mantissa & 0x1000) {
+    half++;
+  }
+  return (uint16_t)half;
+}
 
-  if (renderParticles > 0) {
-    int bufferSize = sizeof(struct ParticleRenderData) * renderParticles;
-    glBindBuffer(GL_ARRAY_BUFFER, fwgl->dataVBO);
-    glBufferData(GL_ARRAY_BUFFER, bufferSize, fwgl->renderData, GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+// Clamped to [0, 1] then scaled to the whole range of an unsigned normalised
+// integer with that many levels
+static inline uint32_t FWGL_packUnorm(float value, float levels) {
+  return (uint32_t)(fminf(fmaxf(value, 0), 1) * levels + 0.5f);
+}
 
-    int indexCount = (int)(sizeof(circleIndices) / sizeof(int));
+int FWGL_sizeClassFor(float radius) {
+  if (radius < FWGL_SIZE_MEDIUM_RADIUS) {
+    return FWGL_SIZE_SMALL;
+  }
+  return radius < FWGL_SIZE_LARGE_RADIUS ? FWGL_SIZE_MEDIUM : FWGL_SIZE_LARGE;
+}
 
-    glUseProgram(fwgl->geometryShader);
-    glBindVertexArray(fwgl->circleVAO);
-    glDrawElementsInstanced(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, 0,
-                            renderParticles);
+struct FWGLPackPass {
+  struct FWGLSimulation *simulation;
+  struct ParticleRenderData *region;
+  // FWGL_SIZE_CLASSES for each chunk
+  int *counts;
+  // Window size, as the UBO has it
+  float width;
+  float height;
+};
+
+// Packs the live particles of each chunk to the front of the same chunk of
+// the region, sorted by size class. Chunks don't share anything, so any
+// worker can take any of them.
+void FWGL_packChunks(void *context, int begin, int end) {
+  struct FWGLPackPass *pass = context;
+  struct FWGLSimulation *simulation = pass->simulation;
+  float scaleX = 1 / (pass->width + 2 * FWGL_INSTANCE_MARGIN);
+  float scaleY = 1 / (pass->height + 2 * FWGL_INSTANCE_MARGIN);
+  // Classes are counted first, so each particle can go straight to its place
+  // in the ring. It's write-combined, and every class is still written in
+  // order, so that's only a few streams for it to merge.
+  unsigned char classes[PARTICLE_CHUNK_SIZE];
+
+  for (int chunk = begin; chunk < end; chunk++) {
+    int first = chunk << PARTICLE_CHUNK_SHIFT;
+    int size = simulation->capacity - first;
+    if (size > PARTICLE_CHUNK_SIZE) {
+      size = PARTICLE_CHUNK_SIZE;
+    }
+    struct Particle *particles = simulation->chunks[chunk];
+    int counts[FWGL_SIZE_CLASSES] = {0};
+    for (int i = 0; i < size; i++) {
+      if (particles[i].isAlive) {
+        classes[i] = (unsigned char)FWGL_sizeClassFor(particles[i].radius);
+        counts[classes[i]]++;
+      }
+    }
+
+    struct ParticleRenderData *out[FWGL_SIZE_CLASSES];
+    out[0] = pass->region + first;
+    for (int c = 0; c < FWGL_SIZE_CLASSES; c++) {
+      if (c > 0) {
+        out[c] = out[c - 1] + counts[c - 1];
+      }
+      pass->counts[chunk * FWGL_SIZE_CLASSES + c] = counts[c];
+    }
+
+    for (int i = 0; i < size; i++) {
+      struct Particle *p = &(particles[i]);
+      if (!p->isAlive) {
+        continue;
+      }
+
+      // Particles in slower LOD tiers are carried forward to now
+      float lag = (float)(simulation->time - p->lastUpdateTime);
+
+      struct ParticleRenderData *data = out[classes[i]]++;
+      // Position (x,y), there's never any z
+      float x = p->position[0] + p->velocity[0] * lag;
+      float y = p->position[1] + p->velocity[1] * lag;
+      data->position[0] = (uint16_t)FWGL_packUnorm(
+          (x + FWGL_INSTANCE_MARGIN) * scaleX, 65535);
+      data->position[1] = (uint16_t)FWGL_packUnorm(
+          (y + FWGL_INSTANCE_MARGIN) * scaleY, 65535);
+      // Colour (r,g,b,a)
+      data->colour[0] = (uint8_t)FWGL_packUnorm(p->colour[0], 255);
+      data->colour[1] = (uint8_t)FWGL_packUnorm(p->colour[1], 255);
+      data->colour[2] = (uint8_t)FWGL_packUnorm(p->colour[2], 255);
+      data->colour[3] = (uint8_t)FWGL_packUnorm(p->colour[3], 255);
+      // Radius (r)
+      data->radius = FWGL_packHalf(p->radius);
+      // Remaining Life (l)
+      data->remainingLife = FWGL_packHalf(fmaxf(p->remainingLife - lag, 0));
+      // Particle Type and ID (t,i)
+      data->typeAndId = ((uint32_t)p->type << 24) | (p->id & 0xFFFFFF);
+    }
   }
-  glBindVertexArray(0);
+}
 
-  // Draw bright cores
-  glBindFramebuffer(GL_FRAMEBUFFER, fwgl->geometryFBO);
-  glBindVertexArray(fwgl->pointsVAO);
-  glUseProgram(fwgl->pointsShader);
-  glPointSize(2);
-  glDrawArrays(GL_POINTS, 0, renderParticles);
+// Move on to the next region, once the GPU has finished drawing from it
+struct ParticleRenderData *FWGL_nextRingRegion(struct FWGL *fwgl) {
+  fwgl->ringRegion = (fwgl->ringRegion + 1) % FWGL_RING_REGIONS;
+  GLsync fence = fwgl->ringFences[fwgl->ringRegion];
+  if (fence != NULL) {
+    // It was fenced two frames ago, so this is very rarely a wait at all
+    GLenum status;
+    do {
+      status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+    } while (status == GL_TIMEOUT_EXPIRED);
+    glDeleteSync(fence);
+    fwgl->ringFences[fwgl->ringRegion] = NULL;
+  }
+  return fwgl->ringData + (size_t)fwgl->ringRegion * fwgl->ringRegionCapacity;
+}
 
-  //
-  // Blur
-  //
-  const int BLUR_PASSES_1 = 2;
+// Runs passes rounds of the Gaussian across and down, starting from source
+// and ping-ponging between the two blur textures. Returns whichever ends up
+// with the result.
+unsigned int FWGL_renderBlur(struct FWGL *fwgl, unsigned int source,
+                             int passes) {
   unsigned int blurFBOs[] = {fwgl->blurredFBO1, fwgl->blurredFBO2};
   unsigned int blurTextures[] = {fwgl->blurredTexture1, fwgl->blurredTexture2};
 
+  if (fwgl->use_compute_blur) {
+    // Across and down in one go, so there's a texture written per pass
+    glUseProgram(fwgl->computeBlurShader);
+    for (int pass = 0; pass < passes; pass++) {
+      unsigned int dest = blurTextures[pass % 2];
+      glBindTexture(GL_TEXTURE_2D, source);
+      glBindImageTexture(0, dest, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+      glDispatchCompute((fwgl->width + FWGL_BLUR_TILE - 1) / FWGL_BLUR_TILE,
+                        (fwgl->height + FWGL_BLUR_TILE - 1) / FWGL_BLUR_TILE,
+                        1);
+      // Whatever's next reads it through a sampler
+      glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+      source = dest;
+    }
+    return source;
+  }
+
   glUseProgram(fwgl->blurredShader);
-  for (int pass = 0; pass < 2 * BLUR_PASSES_1; pass++) {
+  glBindVertexArray(fwgl->screenVAO);
+  for (int pass = 0; pass < 2 * passes; pass++) {
     int pingpong = pass % 2;
+    glBindFramebuffer(GL_FRAMEBUFFER, blurFBOs[pingpong]);
+    glUniform1i(fwgl->blurHorizontalLocation, 0 == pingpong);
 
-    unsigned int blurDestFBO = blurFBOs[pingpong];
-    unsigned int blurSourceTexture = blurTextures[1 - pingpong];
-
-    glBindFramebuffer(GL_FRAMEBUFFER, blurDestFBO);
-
-    unsigned int loc = glGetUniformLocation(fwgl->blurredShader, "horizontal");
-    glUniform1i(loc, 0 == pingpong);
-
-    // 0: (Initial condition) Draw from geometry to texture1
+    // 0: (Initial condition) Draw from source to texture1
     // 1: Draw from texture1 to texture2
     // 2: Draw from texture2 to texture1
     // 3: Draw from texture1 to texture2
     // etc... (alternating)
-    if (0 == pass) {
-      glBindTexture(GL_TEXTURE_2D, fwgl->geometryTexture);
-    } else {
-      glBindTexture(GL_TEXTURE_2D, blurSourceTexture);
-    }
+    glBindTexture(GL_TEXTURE_2D, source);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    source = blurTextures[pingpong];
+  }
+  return source;
+}
 
-    glBindVertexArray(fwgl->screenVAO);
+// Halves the geometry down the mip chain with the 13 tap filter, then adds
+// each level back into the one above with the tent filter. The first level
+// ends up with all of them in it, each blurred twice as wide as the last.
+void FWGL_renderBloomChain(struct FWGL *fwgl) {
+  glBindVertexArray(fwgl->screenVAO);
+
+  glUseProgram(fwgl->downsampleShader);
+  unsigned int source = fwgl->geometryTexture;
+  for (int level = 0; level < fwgl->bloomLevels; level++) {
+    glBindFramebuffer(GL_FRAMEBUFFER, fwgl->bloomMipFBOs[level]);
+    glViewport(0, 0, fwgl->bloomMipWidths[level],
+               fwgl->bloomMipHeights[level]);
+    glBindTexture(GL_TEXTURE_2D, source);
     glDrawArrays(GL_TRIANGLES, 0, 6);
+    source = fwgl->bloomMipTextures[level];
   }
 
-  // Bloom
-  glBindFramebuffer(GL_FRAMEBUFFER, fwgl->bloomFBO);
-  glUseProgram(fwgl->bloomShader);
+  glUseProgram(fwgl->upsampleShader);
+  glBlendColor(0, 0, 0, FWGL_BLOOM_FALLOFF);
+  glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE);
+  for (int level = fwgl->bloomLevels - 1; level > 0; level--) {
+    glBindFramebuffer(GL_FRAMEBUFFER, fwgl->bloomMipFBOs[level - 1]);
+    glViewport(0, 0, fwgl->bloomMipWidths[level - 1],
+               fwgl->bloomMipHeights[level - 1]);
+    glBindTexture(GL_TEXTURE_2D, fwgl->bloomMipTextures[level]);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+  }
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-  glActiveTexture(GL_TEXTURE1);
-  glBindTexture(GL_TEXTURE_2D, fwgl->blurredTexture2);
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, fwgl->geometryTexture);
+  glViewport(0, 0, fwgl->width, fwgl->height);
+}
 
-  glUniform1i(glGetUniformLocation(fwgl->bloomShader, "texture0_screen"), 0);
-  glUniform1i(glGetUniformLocation(fwgl->bloomShader, "texture1_blur"), 1);
-  glBindVertexArray(fwgl->screenVAO);
-  glDrawArrays(GL_TRIANGLES, 0, 6);
+void FWGL_render(struct FWGL *fwgl) {
 
-  // Blur round 2
-  const int BLUR_PASSES_2 = 1;
-  glUseProgram(fwgl->blurredShader);
-  for (int pass = 0; pass < 2 * BLUR_PASSES_2; pass++) {
-    int pingpong = pass % 2;
+  //
+  // Geometry
+  //
+  struct FWGLSimulation *simulation = &(fwgl->simulation);
 
-    unsigned int blurDestFBO = blurFBOs[pingpong];
-    unsigned int blurSourceTexture = blurTextures[1 - pingpong];
+  // The pool may have grown since the last frame, or be well under the ring
+  // after calibration or a quiet spell, in which case give the memory back
+  if (simulation->capacity > fwgl->ringRegionCapacity ||
+      simulation->capacity <= fwgl->ringRegionCapacity / 4) {
+    FWGL_resizeRing(fwgl, simulation->capacity);
+  }
+  // Written straight into GPU visible memory, nothing to upload after
+  struct FWGLPackPass pack;
+  pack.simulation = simulation;
+  pack.region = FWGL_nextRingRegion(fwgl);
+  pack.counts = fwgl->classCounts;
+  pack.width = (float)fwgl->width;
+  pack.height = (float)fwgl->height;
+  int baseInstance = fwgl->ringRegion * fwgl->ringRegionCapacity;
+  JobsParallelFor(simulation->jobs, simulation->chunkCount,
+                  FWGL_PACK_CHUNKS_PER_JOB, FWGL_packChunks, &pack);
+
+  // A draw for every chunk and size class with something in it, all in one
+  // indirect call
+  const enum FWGLMesh *classMeshes = sizeClassMeshes[fwgl->use_polygons];
+  int commandStart = fwgl->ringRegion * FWGL_SIZE_CLASSES *
+                     (fwgl->ringRegionCapacity >> PARTICLE_CHUNK_SHIFT);
+  struct FWGLDrawCommand *commands = fwgl->ringCommands + commandStart;
+  int draws = 0;
+  int renderParticles = 0;
+  for (int chunk = 0; chunk < simulation->chunkCount; chunk++) {
+    int first = baseInstance + (chunk << PARTICLE_CHUNK_SHIFT);
+    int packed = 0;
+    for (int c = 0; c < FWGL_SIZE_CLASSES; c++) {
+      int count = fwgl->classCounts[chunk * FWGL_SIZE_CLASSES + c];
+      if (count == 0) {
+        continue;
+      }
+      const struct FWGLMeshRange *mesh = &(fwgl->meshes[classMeshes[c]]);
+      struct FWGLDrawCommand command = {mesh->indexCount, count,
+                                        mesh->firstIndex, mesh->baseVertex,
+                                        first + packed};
+      commands[draws++] = command;
+      packed += count;
+    }
+    renderParticles += packed;
+  }
 
-    glBindFramebuffer(GL_FRAMEBUFFER, blurDestFBO);
+  glBindFramebuffer(GL_FRAMEBUFFER, fwgl->geometryFBO);
+  glClearColor(0, 0, 0, 1);
+  glClear(GL_COLOR_BUFFER_BIT);
 
-    unsigned int loc = glGetUniformLocation(fwgl->blurredShader, "horizontal");
-    glUniform1i(loc, 0 == pingpong);
+  if (renderParticles > 0) {
+    // Wrapped so float precision holds up when left running for days
+    float time = (float)fmod(glfwGetTime(), 1000.0);
 
-    // 0: (Initial condition) Draw from geometry to texture1
-    // 1: Draw from texture1 to texture2
-    // 2: Draw from texture2 to texture1
-    // 3: Draw from texture1 to texture2
-    // etc... (alternating)
-    if (0 == pass) {
-      glBindTexture(GL_TEXTURE_2D, fwgl->bloomTexture);
-    } else {
-      glBindTexture(GL_TEXTURE_2D, blurSourceTexture);
-    }
+    glUseProgram(fwgl->geometryShader);
+    glUniform1f(fwgl->geometryTimeLocation, time);
+    // Sprites get a pixel round the edge to fade out over
+    glUniform1f(fwgl->geometryEdgeLocation, fwgl->use_polygons ? 0.0f : 1.0f);
+    glBindVertexArray(fwgl->circleVAO);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, fwgl->commandBuffer);
+    glMultiDrawElementsIndirect(
+        GL_TRIANGLES, GL_UNSIGNED_INT,
+        (void *)(sizeof(struct FWGLDrawCommand) * commandStart), draws, 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+  }
+  glBindVertexArray(0);
+
+  // That's the last read of this region, so it can be reused once it's done
+  fwgl->ringFences[fwgl->ringRegion] =
+      glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+  // Smoke goes on top as a single quad, added to whatever is underneath
+  if (simulation->smoke) {
+    struct FWGLSmokeGrid *smoke = simulation->smoke;
+    glBindTexture(GL_TEXTURE_2D, fwgl->smokeTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, smoke->width, smoke->height,
+                    GL_RGBA, GL_FLOAT, smoke->pixels);
 
+    glUseProgram(fwgl->smokeShader);
+    glUniform2fv(fwgl->smokeScreenScaleLocation, 1, smoke->screenScale);
     glBindVertexArray(fwgl->screenVAO);
+    glBlendFunc(GL_ONE, GL_ONE);
     glDrawArrays(GL_TRIANGLES, 0, 6);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  }
+
+  //
+  // Blur
+  //
+  // Falls back to the Gaussian passes if the window's too small for a chain
+  unsigned int glowTexture;
+  if (!fwgl->use_full_blur && fwgl->bloomLevels > 0) {
+    FWGL_renderBloomChain(fwgl);
+    glowTexture = fwgl->bloomMipTextures[0];
+  } else {
+    glowTexture =
+        FWGL_renderBlur(fwgl, fwgl->geometryTexture, fwgl->blurPasses);
   }
 
   //
   // Screen
   //
-  // Return to the regular framebuffer and render the processed texture as a
-  // quad Don't need to clear colours because quad is opaque.
+  // Bloom, tonemapping and gamma all in one pass, straight onto the screen.
+  // Don't need to clear colours because quad is opaque.
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
-  glUseProgram(fwgl->screenShader);
+  glUseProgram(fwgl->bloomShader);
+
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, glowTexture);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, fwgl->geometryTexture);
+
   glBindVertexArray(fwgl->screenVAO);
-  glBindTexture(GL_TEXTURE_2D, fwgl->bloomTexture);
   glDrawArrays(GL_TRIANGLES, 0, 6);
 }
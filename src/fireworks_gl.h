@@ -1,5 +1,8 @@
 #pragma once
 #include "fireworks_gl_process.h"
+#include "fireworks_gl_replay.h"
+#include "fireworks_gl_timeline.h"
+#include "fireworks_gl_trace.h"
 
 enum FWGL_Error {
   FWGL_OK = 0,
@@ -15,30 +18,164 @@ enum FWGL_Error {
   FWGL_ERROR_PREPBUFFER_FRAME_EFFECT = 201,
 };
 
+// Frames of instance data that can be in flight at once
+#define FWGL_RING_REGIONS 3
+// Pool chunks packed into the ring by each job
+#define FWGL_PACK_CHUNKS_PER_JOB 2
+
+// Instance positions are stored as fractions of the window with this much
+// room round the edge, which covers everything that isn't culled yet. Keep
+// it in step with the shaders.
+#define FWGL_INSTANCE_MARGIN 64
+
+// The glow is blurred by halving the image down this many times and adding
+// the halves back up again. Each level is a quarter of the work of the one
+// before, so more of them widen the glow for next to nothing.
+#define FWGL_BLOOM_LEVELS 6
+// How much each level counts for compared to the one above it, so the glow
+// fades out with distance rather than hazing over the whole sky
+#define FWGL_BLOOM_FALLOFF 0.3f
+
+// The Gaussian for /fullblur, in texels, and how far out it's cut off. The
+// blur shader is generated from these at startup, and costs about half a
+// fetch per texel of radius.
+#define FWGL_BLUR_SIGMA 1.75f
+#define FWGL_BLUR_RADIUS 4
+// Pixels each way in a tile of the compute blur, which is also its workgroup
+#define FWGL_BLUR_TILE 16
+
+// One particle as the vertex shaders see it, packed into 16 bytes
 struct ParticleRenderData {
-  float translate[3];
-  float colour[4];
-  float radius;
-  float remainingLife;
-  int particleType;
+  // Unsigned normalised, see FWGL_INSTANCE_MARGIN. Half floats would only
+  // have whole pixels past x = 1024.
+  uint16_t position[2];
+  uint8_t colour[4];
+  // Half floats
+  uint16_t radius;
+  uint16_t remainingLife;
+  // Particle type in the top 8 bits and the low 24 bits of the ID under it
+  uint32_t typeAndId;
+};
+_Static_assert(sizeof(struct ParticleRenderData) == 16,
+               "Instances should pack into 16 bytes");
+
+// Particle meshes, which all live in circleVBO and circleEBO
+enum FWGLMesh {
+  FWGL_MESH_CIRCLE = 0,
+  FWGL_MESH_OCTAGON = 1,
+  FWGL_MESH_DIAMOND = 2,
+  FWGL_MESH_SPRITE = 3,
+  FWGL_MESH_SPRITE_TRIANGLE = 4,
+};
+#define FWGL_MESHES 5
+
+// Smaller particles are drawn with less geometry, so each class gets its own
+// mesh. Haze, sparks and rockets usually land in one each.
+enum FWGLSizeClass {
+  FWGL_SIZE_SMALL = 0,
+  FWGL_SIZE_MEDIUM = 1,
+  FWGL_SIZE_LARGE = 2,
+};
+#define FWGL_SIZE_CLASSES 3
+// Radius in pixels where each class starts
+#define FWGL_SIZE_MEDIUM_RADIUS 2.0f
+#define FWGL_SIZE_LARGE_RADIUS 4.0f
+
+struct FWGLMeshRange {
+  int indexCount;
+  int firstIndex;
+  int baseVertex;
+};
+
+// The layout glMultiDrawElementsIndirect reads
+struct FWGLDrawCommand {
+  unsigned int count;
+  unsigned int instanceCount;
+  unsigned int firstIndex;
+  int baseVertex;
+  unsigned int baseInstance;
 };
 
 struct FWGL {
   enum FWGL_Error error;
   uint8_t is_preview;
+  uint8_t use_smoke;
+  uint8_t use_finale;
+  // Draw 16-sided circles rather than antialiased sprites
+  uint8_t use_polygons;
+  // Blur the glow at full resolution with the Gaussian passes rather than
+  // down the mip chain
+  uint8_t use_full_blur;
+  // Do the Gaussian passes across and down both at once in a compute shader,
+  // rather than as separate fragment shader passes
+  uint8_t use_compute_blur;
+  // A timeline file or built in profile to launch from instead of the
+  // launcher, if set
+  const char *timeline_name;
+  struct FWGLTimeline timeline;
+  // Overrides the preset particle ceiling when set
+  int max_particles;
+  // Measure the machine again rather than use its saved profile
+  uint8_t force_calibrate;
+  // Where the show is snapshotted every second and resumed from, if set
+  const char *resume_path;
+  struct FWGLSnapshotWriter *snapshots;
+  float timeSinceSnapshot;
+  // Every frame's input and resulting state hash go here, if set
+  const char *record_path;
+  struct FWGLReplayRecorder *recorder;
+  // Every frame's particles and timing are traced here, if set
+  const char *trace_path;
+  struct FWGLTraceWriter *trace;
+  // Check a recording headlessly instead of showing anything
+  const char *replay_path;
   GLFWwindow *window;
+  // Framebuffer size in pixels, kept up to date by
+  // FWGL_framebufferSizeCallback
+  int width, height;
 
   // Basic circle geometry
   unsigned int dimensionUBO, circleVAO, circleVBO, circleEBO, dataVBO;
   unsigned int geometryFBO, geometryTexture, geometryShader;
-  unsigned int pointsVAO, pointsShader;
   unsigned int blurredFBO1, blurredTexture1, blurredShader;
   unsigned int blurredFBO2, blurredTexture2;
-  unsigned int bloomFBO, bloomTexture, bloomShader;
-  unsigned int screenShader, screenVAO;
+  unsigned int computeBlurShader;
+  // Adds the glow, tonemaps and gamma corrects onto the screen
+  unsigned int bloomShader;
+  // Half the window size and down, smallest last. Small windows may not get
+  // all of them.
+  unsigned int bloomMipFBOs[FWGL_BLOOM_LEVELS];
+  unsigned int bloomMipTextures[FWGL_BLOOM_LEVELS];
+  int bloomMipWidths[FWGL_BLOOM_LEVELS], bloomMipHeights[FWGL_BLOOM_LEVELS];
+  int bloomLevels;
+  unsigned int downsampleShader, upsampleShader;
+  unsigned int screenVAO, screenVBO;
+  unsigned int smokeTexture, smokeShader;
+  // Uniforms that change every frame, looked up once after linking
+  int geometryTimeLocation, geometryEdgeLocation;
+  int blurHorizontalLocation;
+  int smokeScreenScaleLocation;
+  // Gaussian passes for use_full_blur, picked by calibration
+  int blurPasses;
 
   struct FWGLSimulation simulation;
-  struct ParticleRenderData *renderData;
+  // Instance data is written straight into dataVBO, which stays mapped. It's
+  // split into regions so the GPU can still be drawing from the last couple
+  // of frames' while this one's is written, and each region has a fence for
+  // when the GPU is done with it.
+  struct ParticleRenderData *ringData;
+  int ringRegionCapacity;
+  int ringRegion;
+  GLsync ringFences[FWGL_RING_REGIONS];
+  // Each pool chunk is packed into the same chunk of the region by whichever
+  // worker gets it, sorted by size class, so there's a draw per chunk and
+  // class. Their commands are in commandBuffer, which is mapped and split
+  // into regions the same way.
+  unsigned int commandBuffer;
+  struct FWGLDrawCommand *ringCommands;
+  // Per chunk and class, from the packers
+  int *classCounts;
+  struct FWGLMeshRange meshes[FWGL_MESHES];
 };
 
 #define TO_GLCOLOR(b) (b / 255.0f)
@@ -46,11 +183,28 @@ struct FWGL {
 enum FWGL_Error FWGL_Init(struct FWGL *fwgl, int maxParticles, int maxRockets);
 enum FWGL_Error FWGL_DeInit(struct FWGL *fwgl);
 void FWGL_printHelp();
+void FWGL_log(void *context, const char *message);
 void FWGL_parseArgs(struct FWGL *fwgl, int argc, char *argv[]);
 void FWGL_createGLFWWindow(struct FWGL *fwgl);
 void FWGL_framebufferSizeCallback(GLFWwindow *window, int width, int height);
 void FWGL_process(struct FWGL *fwgl, float dSecs);
 void FWGL_compileShader(struct FWGL *fwgl, unsigned int *program,
                         const char *vertexSource, const char *fragSource);
+void FWGL_compileComputeShader(struct FWGL *fwgl, unsigned int *program,
+                               const char *source);
+void FWGL_blurKernel(float sigma, int radius, double *kernel);
+char *FWGL_makeBlurSource(float sigma, int radius);
+char *FWGL_makeComputeBlurSource(float sigma, int radius);
+size_t FWGL_computeBlurSharedBytes(int radius);
+void FWGL_findUniforms(struct FWGL *fwgl);
+void FWGL_updateDimensions(struct FWGL *fwgl, int width, int height);
 void FWGL_prepareBuffers(struct FWGL *fwgl);
+void FWGL_pointAttributesAtRing(struct FWGL *fwgl);
+void FWGL_resizeRing(struct FWGL *fwgl, int particles);
+struct ParticleRenderData *FWGL_nextRingRegion(struct FWGL *fwgl);
+uint16_t FWGL_packHalf(float value);
+void FWGL_packChunks(void *context, int begin, int end);
+void FWGL_renderBloomChain(struct FWGL *fwgl);
+unsigned int FWGL_renderBlur(struct FWGL *fwgl, unsigned int source,
+                             int passes);
 void FWGL_render(struct FWGL *fwgl);
@@ -0,0 +1,306 @@
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fireworks_gl_calibrate.h"
+
+// Particle counts to try, smallest first. The last is the finale's ceiling.
+static const int calibrationLoads[] = {1000,  2000,   5000,  10000,
+                                       20000, 50000, 100000, 200000};
+// Gaussian passes to try, best looking first. Only /fullblur has any.
+static const int calibrationBlurs[] = {2, 1};
+
+// What slow machines get if even the smallest load misses a refresh
+#define CALIBRATION_FLOOR 500
+// Leave some of each refresh for the compositor and everything else
+#define CALIBRATION_HEADROOM 0.8
+#define CALIBRATION_WARMUP_FRAMES 2
+#define CALIBRATION_FRAMES 6
+// Stop early rather than keep the screen black for ages on a slow machine
+#define CALIBRATION_TIME_LIMIT 3.0
+// Roughly how many particles the finale has alive per rocket at its peak
+#define CALIBRATION_PARTICLES_PER_ROCKET 100
+
+#define PROFILE_LINE_LENGTH 512
+// Longest blur or geometry mode name, with its terminator
+#define PROFILE_MODE_LENGTH 16
+
+void FWGL_profilePath(char *path, int size) {
+#ifdef _WIN32
+  const char *dir = getenv("LOCALAPPDATA");
+  snprintf(path, size, "%s\\FireworksGL.profiles", dir ? dir : ".");
+#else
+  const char *cache = getenv("XDG_CACHE_HOME");
+  if (cache != NULL && cache[0] != '\0') {
+    snprintf(path, size, "%s/fireworksgl.profiles", cache);
+  } else {
+    const char *home = getenv("HOME");
+    snprintf(path, size, "%s/.cache/fireworksgl.profiles", home ? home : ".");
+  }
+#endif
+}
+
+struct FWGLProfileMode FWGL_profileMode(struct FWGL *fwgl) {
+  struct FWGLProfileMode mode;
+  if (!fwgl->use_full_blur) {
+    mode.blur = "chain";
+  } else if (fwgl->use_compute_blur) {
+    mode.blur = "compute";
+  } else {
+    mode.blur = "fragment";
+  }
+  mode.geometry = fwgl->use_polygons ? "polygons" : "sprites";
+  return mode;
+}
+
+int FWGL_profileModeIs(struct FWGLProfileMode mode, const char *blur,
+                       const char *geometry) {
+  return strcmp(mode.blur, blur) == 0 && strcmp(mode.geometry, geometry) == 0;
+}
+
+// One profile per line:
+//     version width height blur geometry maxParticles blurPasses renderer
+// The renderer goes last because it has spaces in it. blur and geometry need
+// room for PROFILE_MODE_LENGTH characters.
+int FWGL_parseProfileLine(const char *line, int *width, int *height,
+                          char *blur, char *geometry,
+                          struct FWGLProfile *profile, char *renderer,
+                          int rendererSize) {
+  int version = 0;
+  int consumed = 0;
+  if (sscanf(line, "%d %d %d %15s %15s %d %d %n", &version, width, height,
+             blur, geometry, &(profile->maxParticles),
+             &(profile->blurPasses), &consumed) != 7 ||
+      version != FWGL_PROFILE_VERSION) {
+    return 0;
+  }
+
+  snprintf(renderer, rendererSize, "%s", line + consumed);
+  renderer[strcspn(renderer, "\r\n")] = '\0';
+  return 1;
+}
+
+int FWGL_readProfile(const char *renderer, int width, int height,
+                     struct FWGLProfileMode mode, struct FWGLProfile *profile) {
+  char path[PROFILE_LINE_LENGTH];
+  FWGL_profilePath(path, sizeof(path));
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return 0;
+  }
+
+  char line[PROFILE_LINE_LENGTH];
+  char lineRenderer[PROFILE_LINE_LENGTH];
+  char lineBlur[PROFILE_MODE_LENGTH], lineGeometry[PROFILE_MODE_LENGTH];
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), file) != NULL) {
+    int lineWidth, lineHeight;
+    struct FWGLProfile lineProfile;
+    if (FWGL_parseProfileLine(line, &lineWidth, &lineHeight, lineBlur,
+                              lineGeometry, &lineProfile, lineRenderer,
+                              sizeof(lineRenderer)) &&
+        lineWidth == width && lineHeight == height &&
+        FWGL_profileModeIs(mode, lineBlur, lineGeometry) &&
+        strcmp(lineRenderer, renderer) == 0) {
+      *profile = lineProfile;
+      found = 1;
+    }
+  }
+
+  fclose(file);
+  return found;
+}
+
+void FWGL_writeProfile(const char *renderer, int width, int height,
+                       struct FWGLProfileMode mode,
+                       struct FWGLProfile *profile) {
+  char path[PROFILE_LINE_LENGTH];
+  FWGL_profilePath(path, sizeof(path));
+
+  // Keep every other machine's profiles, but replace this one's
+  char *kept = NULL;
+  size_t keptLength = 0;
+  FILE *file = fopen(path, "r");
+  if (file != NULL) {
+    char line[PROFILE_LINE_LENGTH];
+    char lineRenderer[PROFILE_LINE_LENGTH];
+    char lineBlur[PROFILE_MODE_LENGTH], lineGeometry[PROFILE_MODE_LENGTH];
+    while (fgets(line, sizeof(line), file) != NULL) {
+      int lineWidth, lineHeight;
+      struct FWGLProfile lineProfile;
+      if (!FWGL_parseProfileLine(line, &lineWidth, &lineHeight, lineBlur,
+                                 lineGeometry, &lineProfile, lineRenderer,
+                                 sizeof(lineRenderer)) ||
+          (lineWidth == width && lineHeight == height &&
+           FWGL_profileModeIs(mode, lineBlur, lineGeometry) &&
+           strcmp(lineRenderer, renderer) == 0)) {
+        continue;
+      }
+      size_t length = strlen(line);
+      kept = realloc(kept, keptLength + length + 1);
+      memcpy(kept + keptLength, line, length + 1);
+      keptLength += length;
+    }
+    fclose(file);
+  }
+
+  file = fopen(path, "w");
+  if (file == NULL) {
+    printf("Couldn't save calibration to %s\n", path);
+    free(kept);
+    return;
+  }
+  if (kept != NULL) {
+    fputs(kept, file);
+  }
+  fprintf(file, "%d %d %d %s %s %d %d %s\n", FWGL_PROFILE_VERSION, width,
+          height, mode.blur, mode.geometry, profile->maxParticles,
+          profile->blurPasses, renderer);
+  fclose(file);
+  free(kept);
+}
+
+// Average seconds per frame with this many particles alive, including the
+// wait for the GPU to finish
+double FWGL_timeLoad(struct FWGL *fwgl, int load, int width, int height) {
+  struct FWGLSimulation *simulation = &(fwgl->simulation);
+  double total = 0;
+
+  for (int frame = 0; frame < CALIBRATION_WARMUP_FRAMES + CALIBRATION_FRAMES;
+       frame++) {
+    // Top the load back up as particles die
+    SpawnStressParticles(simulation, width, height,
+                         load - simulation->liveParticles);
+
+    double start = glfwGetTime();
+    MoveParticles(simulation, width, height, 1 / 60.0f);
+    FWGL_render(fwgl);
+    glFinish();
+    if (frame >= CALIBRATION_WARMUP_FRAMES) {
+      total += glfwGetTime() - start;
+    }
+  }
+
+  return total / CALIBRATION_FRAMES;
+}
+
+// Runs the real simulation and pipeline without ever swapping, stepping the
+// load up until a frame no longer fits in a refresh. With /fullblur, blur is
+// only turned down if even the smallest load doesn't fit.
+void FWGL_calibrate(struct FWGL *fwgl, struct FWGLProfile *profile) {
+  int width, height;
+  glfwGetFramebufferSize(fwgl->window, &width, &height);
+
+  const GLFWvidmode *mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+  int refreshRate = mode != NULL && mode->refreshRate > 0 ? mode->refreshRate
+                                                          : 60;
+  double frameBudget = CALIBRATION_HEADROOM / refreshRate;
+  if (fwgl->is_preview) {
+    printf("Calibrating for %dx%d at %dHz (%.2fms per frame)\n", width, height,
+           refreshRate, 1000 * frameBudget);
+  }
+
+  // Load up a throwaway simulation so the real one still starts empty
+  struct FWGLSimulation saved = fwgl->simulation;
+  struct FWGLSimulation *simulation = &(fwgl->simulation);
+  simulation->log = NULL;
+  simulation->maxRockets = 0;
+  int loadCount = sizeof(calibrationLoads) / sizeof(calibrationLoads[0]);
+  ParticlePoolInit(simulation, calibrationLoads[loadCount - 1]);
+
+  // The mip chain costs the same whatever blurPasses is
+  int blurCount = sizeof(calibrationBlurs) / sizeof(calibrationBlurs[0]);
+  if (!fwgl->use_full_blur) {
+    blurCount = 1;
+  }
+  profile->maxParticles = CALIBRATION_FLOOR;
+  profile->blurPasses = calibrationBlurs[blurCount - 1];
+
+  double started = glfwGetTime();
+  int outOfTime = 0;
+  for (int blur = 0; blur < blurCount && !outOfTime; blur++) {
+    fwgl->blurPasses = calibrationBlurs[blur];
+
+    int fitted = 0;
+    for (int load = 0; load < loadCount; load++) {
+      double frameTime =
+          FWGL_timeLoad(fwgl, calibrationLoads[load], width, height);
+      if (fwgl->is_preview) {
+        printf("  blur %d, %6d particles: %.2fms\n", fwgl->blurPasses,
+               calibrationLoads[load], 1000 * frameTime);
+      }
+      if (frameTime > frameBudget) {
+        break;
+      }
+      fitted = calibrationLoads[load];
+
+      outOfTime = glfwGetTime() - started > CALIBRATION_TIME_LIMIT;
+      if (outOfTime) {
+        break;
+      }
+    }
+
+    if (fitted > 0) {
+      profile->maxParticles = fitted;
+      profile->blurPasses = fwgl->blurPasses;
+      break;
+    }
+    outOfTime = glfwGetTime() - started > CALIBRATION_TIME_LIMIT;
+  }
+
+  ParticlePoolFree(simulation);
+  fwgl->simulation = saved;
+  // Sparks will have been feeding the smoke
+  if (fwgl->simulation.smoke != NULL) {
+    SmokeGridClear(fwgl->simulation.smoke);
+  }
+}
+
+// Measure the machine if it hasn't been measured at this resolution and in
+// this render mode before, then size the particle pool and blur to suit
+void FWGL_applyProfile(struct FWGL *fwgl) {
+  const char *renderer = (const char *)glGetString(GL_RENDERER);
+  if (renderer == NULL) {
+    renderer = "unknown";
+  }
+  int width, height;
+  glfwGetFramebufferSize(fwgl->window, &width, &height);
+
+  struct FWGLProfileMode mode = FWGL_profileMode(fwgl);
+  struct FWGLProfile profile;
+  if (fwgl->force_calibrate ||
+      !FWGL_readProfile(renderer, width, height, mode, &profile)) {
+    FWGL_calibrate(fwgl, &profile);
+    FWGL_writeProfile(renderer, width, height, mode, &profile);
+  }
+  if (fwgl->is_preview) {
+    printf("Profile for %s at %dx%d (%s blur, %s): %d particles, blur %d\n",
+           renderer, width, height, mode.blur, mode.geometry,
+           profile.maxParticles, profile.blurPasses);
+  }
+
+  fwgl->blurPasses = profile.blurPasses;
+
+  // Nothing has been spawned yet, so the pool can just be remade smaller. An
+  // explicit /maxparticles wins over whatever was measured.
+  struct FWGLSimulation *simulation = &(fwgl->simulation);
+  if (fwgl->max_particles <= 0 &&
+      profile.maxParticles < simulation->maxParticles) {
+    ParticlePoolFree(simulation);
+    ParticlePoolInit(simulation, profile.maxParticles);
+
+    // Fewer particles means fewer rockets, or the finale just evicts haze
+    if (fwgl->use_finale) {
+      int rockets = profile.maxParticles / CALIBRATION_PARTICLES_PER_ROCKET;
+      if (rockets < 1) {
+        rockets = 1;
+      }
+      if (rockets < simulation->maxRockets) {
+        simulation->maxRockets = rockets;
+      }
+    }
+  }
+}
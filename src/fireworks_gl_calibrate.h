@@ -0,0 +1,36 @@
+#pragma once
+#include "fireworks_gl.h"
+
+// Bumped whenever calibration changes enough that old profiles are wrong
+#define FWGL_PROFILE_VERSION 3
+
+// The most this machine can draw at its resolution and still make every
+// refresh. Measured on the first run and cached per renderer, resolution and
+// render mode (see FWGL_profileMode), since they all change what fits.
+struct FWGLProfile {
+  int maxParticles;
+  int blurPasses;
+};
+
+// How the glow and particles are drawn, which is part of a profile's key
+struct FWGLProfileMode {
+  // chain, fragment or compute
+  const char *blur;
+  // sprites or polygons
+  const char *geometry;
+};
+
+void FWGL_profilePath(char *path, int size);
+struct FWGLProfileMode FWGL_profileMode(struct FWGL *fwgl);
+int FWGL_parseProfileLine(const char *line, int *width, int *height,
+                          char *blur, char *geometry,
+                          struct FWGLProfile *profile, char *renderer,
+                          int rendererSize);
+int FWGL_readProfile(const char *renderer, int width, int height,
+                     struct FWGLProfileMode mode, struct FWGLProfile *profile);
+void FWGL_writeProfile(const char *renderer, int width, int height,
+                       struct FWGLProfileMode mode,
+                       struct FWGLProfile *profile);
+double FWGL_timeLoad(struct FWGL *fwgl, int load, int width, int height);
+void FWGL_calibrate(struct FWGL *fwgl, struct FWGLProfile *profile);
+void FWGL_applyProfile(struct FWGL *fwgl);
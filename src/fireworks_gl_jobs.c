@@ -0,0 +1,162 @@
+#include "fireworks_gl_jobs.h"
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "fireworks_gl_threads.h"
+
+struct FWGLJobs {
+  int threadCount;
+  FWGLThread *threads;
+  FWGLMutex lock;
+  FWGLCond wake;
+  FWGLCond done;
+  int generation;
+  int quit;
+
+  // The current batch of work, guarded by lock
+  JobFunction function;
+  void *context;
+  int count;
+  int grain;
+  int next;
+  int pending;
+};
+
+int JobsDefaultThreadCount() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  int cores = (int)info.dwNumberOfProcessors;
+#else
+  int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return cores < 1 ? 1 : cores;
+}
+
+// Claim and run ranges until the current batch has none left.
+// Must be called with the lock held, and returns with it held.
+void JobsRunRanges(struct FWGLJobs *jobs) {
+  while (jobs->next < jobs->count) {
+    int begin = jobs->next;
+    int end = begin + jobs->grain;
+    if (end > jobs->count) {
+      end = jobs->count;
+    }
+    jobs->next = end;
+
+    JobFunction function = jobs->function;
+    void *context = jobs->context;
+    MutexUnlock(&(jobs->lock));
+    function(context, begin, end);
+    MutexLock(&(jobs->lock));
+
+    jobs->pending -= end - begin;
+    if (jobs->pending == 0) {
+      CondBroadcast(&(jobs->done));
+    }
+  }
+}
+
+int JobsWorker(void *arg) {
+  struct FWGLJobs *jobs = arg;
+  int seen = 0;
+
+  MutexLock(&(jobs->lock));
+  while (1) {
+    while (!jobs->quit && jobs->generation == seen) {
+      CondWait(&(jobs->wake), &(jobs->lock));
+    }
+    if (jobs->quit) {
+      break;
+    }
+    seen = jobs->generation;
+    JobsRunRanges(jobs);
+  }
+  MutexUnlock(&(jobs->lock));
+  return 0;
+}
+
+struct FWGLJobs *JobsCreate(int threadCount) {
+  struct FWGLJobs *jobs = calloc(1, sizeof(struct FWGLJobs));
+  if (threadCount < 1) {
+    threadCount = 1;
+  }
+
+  MutexInit(&(jobs->lock));
+  CondInit(&(jobs->wake));
+  CondInit(&(jobs->done));
+
+  // The calling thread always helps out, so it counts as one of the threads
+  jobs->threads = malloc(sizeof(FWGLThread) * threadCount);
+  jobs->threadCount = 1;
+  for (int i = 1; i < threadCount; i++) {
+    if (!ThreadCreate(&(jobs->threads[i]), JobsWorker, jobs)) {
+      break;
+    }
+    jobs->threadCount++;
+  }
+
+  return jobs;
+}
+
+void JobsDestroy(struct FWGLJobs *jobs) {
+  if (jobs == NULL) {
+    return;
+  }
+
+  MutexLock(&(jobs->lock));
+  jobs->quit = 1;
+  CondBroadcast(&(jobs->wake));
+  MutexUnlock(&(jobs->lock));
+
+  for (int i = 1; i < jobs->threadCount; i++) {
+    ThreadJoin(jobs->threads[i]);
+  }
+
+  CondDestroy(&(jobs->done));
+  CondDestroy(&(jobs->wake));
+  MutexDestroy(&(jobs->lock));
+  free(jobs->threads);
+  free(jobs);
+}
+
+int JobsThreadCount(struct FWGLJobs *jobs) {
+  return jobs == NULL ? 1 : jobs->threadCount;
+}
+
+void JobsParallelFor(struct FWGLJobs *jobs, int count, int grain,
+                     JobFunction function, void *context) {
+  if (count <= 0) {
+    return;
+  }
+  if (grain < 1) {
+    grain = 1;
+  }
+
+  // Not worth waking anybody up for
+  if (jobs == NULL || jobs->threadCount <= 1 || count <= grain) {
+    function(context, 0, count);
+    return;
+  }
+
+  MutexLock(&(jobs->lock));
+  jobs->function = function;
+  jobs->context = context;
+  jobs->count = count;
+  jobs->grain = grain;
+  jobs->next = 0;
+  jobs->pending = count;
+  jobs->generation++;
+  CondBroadcast(&(jobs->wake));
+
+  JobsRunRanges(jobs);
+  while (jobs->pending > 0) {
+    CondWait(&(jobs->done), &(jobs->lock));
+  }
+  MutexUnlock(&(jobs->lock));
+}
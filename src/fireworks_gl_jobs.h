@@ -0,0 +1,15 @@
+#pragma once
+
+// A tiny fork-join worker pool. Work is split into [begin, end) ranges which
+// are handed out to the workers and the calling thread, and JobsParallelFor
+// only returns once every range is done.
+typedef void (*JobFunction)(void *context, int begin, int end);
+
+struct FWGLJobs;
+
+int JobsDefaultThreadCount();
+struct FWGLJobs *JobsCreate(int threadCount);
+void JobsDestroy(struct FWGLJobs *jobs);
+int JobsThreadCount(struct FWGLJobs *jobs);
+void JobsParallelFor(struct FWGLJobs *jobs, int count, int grain,
+                     JobFunction function, void *context);
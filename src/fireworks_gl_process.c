@@ -1,10 +1,139 @@
 #include "fireworks_gl_process.h"
 #include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Smoke density added per emission, in place of a single haze particle
+#define SMOKE_ROCKET_AMOUNT 0.08f
+#define SMOKE_SPARK_AMOUNT 0.05f
+
+// A particle drops a LOD tier once it is both this faint (shaded alpha) and
+// this slow (pixels per second). Skipped particles are drawn extrapolated
+// along their velocity, so speed only matters for how far drag bends the
+// path in between, which stays under half a pixel at these speeds.
+#define LOD_TIER1_ALPHA 0.3f
+#define LOD_TIER1_SPEED 400.0f
+#define LOD_TIER2_ALPHA 0.1f
+#define LOD_TIER2_SPEED 120.0f
+
+// Seconds the pool has to stay under half full (not counting its last chunk)
+// before it starts shrinking
+#define POOL_SHRINK_DELAY 5.0f
+
+// Two ticks at 60Hz
+#define PREWARM_STEP (1 / 30.0f)
+
+// The faintest HDR value which still moves an 8-bit pixel by half a step
+// through bloomFragmentShaderSource's tonemap (exposure 2, gamma 2.2):
+//     (1 - exp(-2x)) ^ (1/2.2) = 0.5/255  =>  x = 5.5e-7
+// Gamma is steep near black, so this is a lot lower than 1/255!
+#define VISIBLE_HDR_MIN 5.5e-7f
+// Bloom adds a normalised blur of the geometry back on top of itself, which
+// at most doubles a lone particle's brightness
+#define BLOOM_GAIN 2.0f
+
+// What each BurstTemplate looks like. Speeds are in pixels per second, spark
+// life is a multiple of the usual second, and jitter is how much of its arc
+// each spark's angle can wander over (see DistributeSpeeds).
+struct BurstShape {
+  const char *name;
+  int minSpeed;
+  int maxSpeed;
+  float sparkLife;
+  float jitter;
+};
+static const struct BurstShape burstShapes[BURST_TEMPLATES] = {
+    [BURST_RANDOM] = {"random", 200, 300, 1.0f, 0.5f},
+    [BURST_RING] = {"ring", 250, 250, 1.0f, 0.0f},
+    [BURST_PEONY] = {"peony", 245, 255, 1.2f, 0.5f},
+    [BURST_WILLOW] = {"willow", 60, 140, 2.5f, 0.5f},
+    [BURST_PALM] = {"palm", 320, 420, 0.7f, 0.5f},
+};
+
+// -1 if there's no template called that
+int BurstTemplateByName(const char *name) {
+  for (int i = 0; i < BURST_TEMPLATES; i++) {
+    if (strcmp(burstShapes[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// An empty classic show with no pool yet. Set maxRockets, log, smoke and jobs
+// as needed, then ParticlePoolInit.
+void SimulationInit(struct FWGLSimulation *simulation,
+                    unsigned long long seed) {
+  memset(simulation, 0, sizeof(struct FWGLSimulation));
+  SimulationSeed(simulation, seed);
+  LaunchSchedulerClassic(simulation);
+}
+
+// The jobs pool may be shared, so it's left for whoever made it
+void SimulationFree(struct FWGLSimulation *simulation) {
+  ParticlePoolFree(simulation);
+  SmokeGridDestroy(simulation->smoke);
+  simulation->smoke = NULL;
+}
+
+// Heap the simulation is holding on to, for keeping an eye on how the pool and
+// its lists grow
+size_t SimulationBytes(struct FWGLSimulation *simulation) {
+  int maxChunks = (simulation->maxParticles + PARTICLE_CHUNK_SIZE - 1) /
+                  PARTICLE_CHUNK_SIZE;
+  size_t bytes = sizeof(struct Particle *) * maxChunks;
+  bytes += sizeof(struct Particle) * PARTICLE_CHUNK_SIZE *
+           (size_t)simulation->chunkCount;
+  bytes += sizeof(int) * (size_t)simulation->capacity;
+  bytes += (sizeof(struct ParticleHandleSlot) + sizeof(int)) *
+           (size_t)simulation->handleCapacity;
+  for (int tier = 0; tier < LOD_TIERS; tier++) {
+    bytes += sizeof(struct LodEntry) * (size_t)simulation->lodCapacities[tier];
+  }
+  if (simulation->smoke != NULL) {
+    bytes += SmokeGridBytes(simulation->smoke);
+  }
+  return bytes;
+}
+
+void SimulationSeed(struct FWGLSimulation *simulation,
+                    unsigned long long seed) {
+  // xorshift gets stuck on zero
+  simulation->randomState = seed ^ 0x9E3779B97F4A7C15ull;
+  if (simulation->randomState == 0) {
+    simulation->randomState = 1;
+  }
+}
 
-int RandIntRange(int lower, int upper) {
-  int r = rand();
+void SimulationLog(struct FWGLSimulation *simulation, const char *format,
+                   ...) {
+  if (simulation->log == NULL) {
+    return;
+  }
+
+  char message[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  simulation->log(simulation->logContext, message);
+}
+
+// xorshift64*, cut down to the same range as rand() promises
+int SimulationRandom(struct FWGLSimulation *simulation) {
+  unsigned long long x = simulation->randomState;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  simulation->randomState = x;
+  return (int)((x * 0x2545F4914F6CDD1Dull) >> 33);
+}
+
+int RandIntRange(struct FWGLSimulation *simulation, int lower, int upper) {
+  int r = SimulationRandom(simulation);
 
   if (upper < lower) {
     int temp = lower;
@@ -13,95 +142,629 @@ int RandIntRange(int lower, int upper) {
   }
 
   int diff = upper - lower;
+  if (diff == 0) {
+    return lower;
+  }
   int n = lower + (r % diff);
   return n;
 }
 
-double RandDouble() { return (double)rand() / (double)RAND_MAX; }
+double RandDouble(struct FWGLSimulation *simulation) {
+  return (double)SimulationRandom(simulation) / (double)SIMULATION_RANDOM_MAX;
+}
 
-void DistributeSpeeds(float *speeds, float *velocities, int speedCount) {
+void DistributeSpeeds(struct FWGLSimulation *simulation, float *speeds,
+                      float *velocities, int speedCount, float jitter) {
   float arc = 2 * 3.1415926 / speedCount;
 
   for (int i = 0; i < speedCount; i++) {
-    // Generate a random angle in the first half of each arc
-    float angle = arc * (i + 0.5 * RandDouble());
+    // Generate a random angle in the first jitter of each arc, or exactly at
+    // the start if there's none
+    double offset = jitter > 0 ? jitter * RandDouble(simulation) : 0;
+    float angle = arc * (i + offset);
     velocities[2 * i] = speeds[i] * cos(angle);
     velocities[2 * i + 1] = speeds[i] * sin(angle);
   }
 }
 
+void ParticlePoolInit(struct FWGLSimulation *simulation, int maxParticles) {
+  // Handles can't address any more than this
+  if (maxParticles > (int)PARTICLE_HANDLE_SLOT_MASK) {
+    maxParticles = (int)PARTICLE_HANDLE_SLOT_MASK;
+  }
+
+  simulation->maxParticles = maxParticles;
+  simulation->capacity = 0;
+  simulation->liveParticles = 0;
+  int maxChunks =
+      (maxParticles + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+  simulation->chunks = malloc(sizeof(struct Particle *) * maxChunks);
+  simulation->chunkCount = 0;
+  simulation->freeList = NULL;
+  simulation->freeCount = 0;
+  simulation->handles = NULL;
+  simulation->handleCapacity = 0;
+  simulation->freeHandles = NULL;
+  simulation->freeHandleCount = 0;
+  simulation->quietTime = 0;
+
+  for (int tier = 0; tier < LOD_TIERS; tier++) {
+    simulation->lodLists[tier] = malloc(sizeof(struct LodEntry) * 64);
+    simulation->lodCounts[tier] = 0;
+    simulation->lodCapacities[tier] = 64;
+    simulation->lodStale[tier] = 0;
+  }
+
+  ParticlePoolGrow(simulation);
+}
+
+void ParticlePoolFree(struct FWGLSimulation *simulation) {
+  for (int c = 0; c < simulation->chunkCount; c++) {
+    free(simulation->chunks[c]);
+  }
+  free(simulation->chunks);
+  free(simulation->freeList);
+  free(simulation->handles);
+  free(simulation->freeHandles);
+  for (int tier = 0; tier < LOD_TIERS; tier++) {
+    free(simulation->lodLists[tier]);
+  }
+}
+
+// Add a chunk of dead particles to the pool, returning 0 if it's already at
+// maxParticles. Nothing already in the pool moves.
+int ParticlePoolGrow(struct FWGLSimulation *simulation) {
+  int first = simulation->capacity;
+  int last = first + PARTICLE_CHUNK_SIZE;
+  if (last > simulation->maxParticles) {
+    last = simulation->maxParticles;
+  }
+  if (last <= first) {
+    return 0;
+  }
+
+  struct Particle defaultParticle;
+  defaultParticle.isAlive = 0;
+  defaultParticle.position[0] = 0;
+  defaultParticle.position[1] = 0;
+  defaultParticle.position[2] = 0;
+  defaultParticle.velocity[0] = 0;
+  defaultParticle.velocity[1] = 0;
+  defaultParticle.velocity[2] = 0;
+  defaultParticle.acceleration[0] = 0;
+  defaultParticle.acceleration[1] = 0;
+  defaultParticle.acceleration[2] = 0;
+  defaultParticle.colour[0] = 1;
+  defaultParticle.colour[1] = 1;
+  defaultParticle.colour[2] = 1;
+  defaultParticle.colour[3] = 1;
+  defaultParticle.children = 0;
+  defaultParticle.radius = 0;
+  defaultParticle.remainingLife = 0;
+  defaultParticle.timeSinceLastEmission = 0;
+  defaultParticle.rocketIsPinwheel = 0;
+  defaultParticle.hazeDragFactor = 0;
+  defaultParticle.type = PT_HAZE;
+  defaultParticle.id = 0;
+  defaultParticle.handle = PARTICLE_HANDLE_NONE;
+  defaultParticle.lodTier = 0;
+  defaultParticle.lodSlot = -1;
+  defaultParticle.burst = BURST_RANDOM;
+  defaultParticle.lastUpdateTime = 0;
+
+  struct Particle *chunk =
+      malloc(sizeof(struct Particle) * PARTICLE_CHUNK_SIZE);
+  for (int i = 0; i < PARTICLE_CHUNK_SIZE; i++) {
+    chunk[i] = defaultParticle;
+  }
+  simulation->chunks[simulation->chunkCount++] = chunk;
+  simulation->capacity = last;
+
+  // The index arrays are only ints, so they can just be resized
+  simulation->freeList =
+      realloc(simulation->freeList, sizeof(int) * simulation->capacity);
+  // Backwards, so particles are handed out from the start
+  for (int i = last - 1; i >= first; i--) {
+    simulation->freeList[simulation->freeCount++] = i;
+  }
+
+  // Every live particle needs a handle, so keep one slot per particle. The
+  // table doesn't shrink with the pool because live handles can be anywhere.
+  if (simulation->handleCapacity < simulation->capacity) {
+    int oldCapacity = simulation->handleCapacity;
+    simulation->handleCapacity = simulation->capacity;
+    simulation->handles =
+        realloc(simulation->handles, sizeof(struct ParticleHandleSlot) *
+                                         simulation->handleCapacity);
+    simulation->freeHandles = realloc(
+        simulation->freeHandles, sizeof(int) * simulation->handleCapacity);
+    for (int h = simulation->handleCapacity - 1; h >= oldCapacity; h--) {
+      simulation->handles[h].particle = -1;
+      simulation->handles[h].generation = 0;
+      simulation->freeHandles[simulation->freeHandleCount++] = h;
+    }
+  }
+
+  SimulationLog(simulation, "Particle pool grown to %d (max %d)\n",
+                simulation->capacity, simulation->maxParticles);
+  return 1;
+}
+
+// Give back the last chunk. Anything still alive in it is moved down into
+// dead particles lower in the pool, so there has to be room for them.
+void ParticlePoolShrink(struct FWGLSimulation *simulation) {
+  if (simulation->chunkCount <= 1) {
+    return;
+  }
+
+  int first = (simulation->chunkCount - 1) * PARTICLE_CHUNK_SIZE;
+  int last = simulation->capacity;
+
+  // Free particles in the last chunk are going away
+  int kept = 0;
+  for (int i = 0; i < simulation->freeCount; i++) {
+    if (simulation->freeList[i] < first) {
+      simulation->freeList[kept++] = simulation->freeList[i];
+    }
+  }
+  simulation->freeCount = kept;
+
+  int live = 0;
+  for (int i = first; i < last; i++) {
+    live += ParticleAt(simulation, i)->isAlive;
+  }
+  if (live > simulation->freeCount) {
+    // Not enough room, so put things back how they were
+    for (int i = last - 1; i >= first; i--) {
+      if (!ParticleAt(simulation, i)->isAlive) {
+        simulation->freeList[simulation->freeCount++] = i;
+      }
+    }
+    return;
+  }
+
+  for (int i = first; i < last; i++) {
+    struct Particle *p = ParticleAt(simulation, i);
+    if (!p->isAlive) {
+      continue;
+    }
+
+    int to = simulation->freeList[--simulation->freeCount];
+    *ParticleAt(simulation, to) = *p;
+    simulation->handles[p->handle & PARTICLE_HANDLE_SLOT_MASK].particle = to;
+  }
+
+  free(simulation->chunks[--simulation->chunkCount]);
+  simulation->capacity = first;
+
+  SimulationLog(simulation,
+                "Particle pool shrunk to %d, moved %d live particles\n",
+                simulation->capacity, live);
+}
+
+void ParticleHandleAcquire(struct FWGLSimulation *simulation, int particle) {
+  int slot = simulation->freeHandles[--simulation->freeHandleCount];
+  struct ParticleHandleSlot *h = &(simulation->handles[slot]);
+  h->particle = particle;
+  ParticleAt(simulation, particle)->handle =
+      (h->generation << PARTICLE_HANDLE_SLOT_BITS) | (unsigned int)slot;
+}
+
+void ParticleHandleRelease(struct FWGLSimulation *simulation, int particle) {
+  int slot =
+      ParticleAt(simulation, particle)->handle & PARTICLE_HANDLE_SLOT_MASK;
+  struct ParticleHandleSlot *h = &(simulation->handles[slot]);
+  h->particle = -1;
+  // Only the bits that fit in a handle count, so let it wrap there
+  h->generation = (h->generation + 1) &
+                  (0xffffffffu >> PARTICLE_HANDLE_SLOT_BITS);
+  simulation->freeHandles[simulation->freeHandleCount++] = slot;
+}
+
+// The particle's index, or -1 if it has died since the handle was taken
+int ParticleFromHandle(struct FWGLSimulation *simulation,
+                       ParticleHandle handle) {
+  struct ParticleHandleSlot *h =
+      &(simulation->handles[handle & PARTICLE_HANDLE_SLOT_MASK]);
+  if (h->generation != handle >> PARTICLE_HANDLE_SLOT_BITS) {
+    return -1;
+  }
+  return h->particle;
+}
+
 void DeleteParticle(struct FWGLSimulation *simulation, int particle) {
-  struct Particle *p = &(simulation->particles[particle]);
+  struct Particle *p = ParticleAt(simulation, particle);
+
+  // Old and out of bounds in the same tick used to count twice
+  if (!p->isAlive) {
+    return;
+  }
+
+  simulation->lodStale[p->lodTier]++;
 
   if (p->type == PT_SPARK_ROCKET) {
     simulation->liveRockets--;
   }
 
   p->isAlive = 0;
+  ParticleHandleRelease(simulation, particle);
   simulation->liveParticles--;
+  simulation->freeList[simulation->freeCount++] = particle;
 }
 
 void RandomBrightColour(struct FWGLSimulation *simulation, float rgba[4]) {
-  int flip = RandDouble() > 0.5 ? 1 : 0;
-  int random = RandIntRange(0, 3);
+  int flip = RandDouble(simulation) > 0.5 ? 1 : 0;
+  int random = RandIntRange(simulation, 0, 3);
   int zero = flip ? (random + 1) % 3 : (random + 2) % 3;
   int one = flip ? (random + 2) % 3 : (random + 1) % 3;
 
-  rgba[random] = (float)RandDouble();
+  rgba[random] = (float)RandDouble(simulation);
   rgba[zero] = 0.0f;
   rgba[one] = 1.0f;
   // Maximum alpha
   rgba[3] = 1.0f;
 
-  if (simulation->fwglIsPreview) {
-    printf("RandomBrightColour(simulation, %.2f, %.2f, %.2f, %.2f)\n", rgba[0],
-           rgba[1], rgba[2], rgba[3]);
+  SimulationLog(simulation,
+                "RandomBrightColour(simulation, %.2f, %.2f, %.2f, %.2f)\n",
+                rgba[0], rgba[1], rgba[2], rgba[3]);
+}
+
+// Alpha of the particle as drawn, following geometryFragmentShaderSource
+float ParticleAlpha(struct Particle *p) {
+  if (p->type == PT_SPARK && p->remainingLife < 0.5f) {
+    float factor = 2 * p->remainingLife;
+    return factor * factor;
+  }
+  if (p->type == PT_HAZE) {
+    float factor = p->remainingLife / 2;
+    return p->colour[3] * 0.5f * factor * factor;
+  }
+  return p->colour[3];
+}
+
+// Upper bound on how much the particle adds to its brightest pixel
+float ParticleContribution(struct Particle *p) {
+  float brightest = fmaxf(p->colour[0], fmaxf(p->colour[1], p->colour[2]));
+  // Leave room for the flicker geometryVertexShaderSource adds to haze
+  if (p->type == PT_HAZE) {
+    brightest += p->remainingLife / 12;
   }
+  return ParticleAlpha(p) * fmaxf(brightest, 0) * BLOOM_GAIN;
 }
 
-int ReviveDeadParticle(struct FWGLSimulation *simulation) {
+int LodTierFor(struct Particle *p) {
+  // Anything that emits or bursts needs every tick to keep its timing
+  if (p->type == PT_SPARK_ROCKET || p->children > 0) {
+    return 0;
+  }
 
-  // First, look for dead particles
-  for (int i = 0; i < simulation->maxParticles; i++) {
-    struct Particle *c = &(simulation->particles[i]);
-    if (!c->isAlive) {
-      c->isAlive = 1;
-      simulation->liveParticles++;
-      return i;
+  float speedSquared = p->velocity[0] * p->velocity[0] +
+                       p->velocity[1] * p->velocity[1] +
+                       p->velocity[2] * p->velocity[2];
+  float alpha = ParticleAlpha(p);
+
+  if (alpha < LOD_TIER2_ALPHA &&
+      speedSquared < LOD_TIER2_SPEED * LOD_TIER2_SPEED) {
+    return 2;
+  }
+  if (alpha < LOD_TIER1_ALPHA &&
+      speedSquared < LOD_TIER1_SPEED * LOD_TIER1_SPEED) {
+    return 1;
+  }
+  return 0;
+}
+
+// LodEntryParticle's slow path, for when the particle has moved or died
+int LodEntryRefresh(struct FWGLSimulation *simulation, struct LodEntry *entry) {
+  int particle = ParticleFromHandle(simulation, entry->handle);
+  if (particle >= 0) {
+    entry->particle = particle;
+  }
+  return particle;
+}
+
+void LodAdd(struct FWGLSimulation *simulation, int particle, int tier) {
+  struct Particle *p = ParticleAt(simulation, particle);
+
+  if (simulation->lodCounts[tier] == simulation->lodCapacities[tier]) {
+    simulation->lodCapacities[tier] *= 2;
+    simulation->lodLists[tier] =
+        realloc(simulation->lodLists[tier],
+                sizeof(struct LodEntry) * simulation->lodCapacities[tier]);
+  }
+
+  p->lodTier = tier;
+  p->lodSlot = simulation->lodCounts[tier];
+  simulation->lodLists[tier][p->lodSlot].particle = particle;
+  simulation->lodLists[tier][p->lodSlot].handle = p->handle;
+  simulation->lodCounts[tier]++;
+}
+
+void LodCompact(struct FWGLSimulation *simulation, int tier) {
+  struct LodEntry *list = simulation->lodLists[tier];
+  int kept = 0;
+
+  for (int slot = 0; slot < simulation->lodCounts[tier]; slot++) {
+    int particle = LodEntryParticle(simulation, tier, slot);
+    if (particle < 0) {
+      continue;
     }
+    ParticleAt(simulation, particle)->lodSlot = kept;
+    list[kept] = list[slot];
+    kept++;
   }
 
-  // Then, look for already alive haze
-  for (int i = 0; i < simulation->maxParticles; i++) {
-    struct Particle *c = &(simulation->particles[i]);
-    if (c->type == PT_HAZE) {
-      // Don't increment because we're just reassigning
-      if (simulation->fwglIsPreview) {
-        printf(
-            "No dead particles to revive, reallocating haze particle %d (you "
-            "should increase FWGL_Init maxParticles)\n",
-            i);
+  simulation->lodCounts[tier] = kept;
+  simulation->lodStale[tier] = 0;
+}
+
+// Find live haze to reuse, faintest LOD tier first since that's the stuff
+// nobody will miss
+int FindHazeToEvict(struct FWGLSimulation *simulation) {
+  for (int tier = LOD_TIERS - 1; tier >= 0; tier--) {
+    for (int slot = 0; slot < simulation->lodCounts[tier]; slot++) {
+      int i = LodEntryParticle(simulation, tier, slot);
+      if (i >= 0 && ParticleAt(simulation, i)->type == PT_HAZE) {
+        return i;
       }
-      return i;
     }
   }
+  return -1;
+}
+
+int ReviveDeadParticle(struct FWGLSimulation *simulation) {
+
+  // First, look for dead particles, making some more if there's room
+  if (simulation->freeCount > 0 || ParticlePoolGrow(simulation)) {
+    int i = simulation->freeList[--simulation->freeCount];
+    struct Particle *c = ParticleAt(simulation, i);
+    c->isAlive = 1;
+    c->id = simulation->nextParticleId++;
+    c->lastUpdateTime = simulation->time;
+    ParticleHandleAcquire(simulation, i);
+    LodAdd(simulation, i, 0);
+    simulation->liveParticles++;
+    return i;
+  }
+
+  // Then, look for already alive haze
+  int i = FindHazeToEvict(simulation);
+  if (i >= 0) {
+    struct Particle *c = ParticleAt(simulation, i);
+    c->id = simulation->nextParticleId++;
+    c->lastUpdateTime = simulation->time;
+    simulation->lodStale[c->lodTier]++;
+    // Anyone holding the old handle shouldn't get the new particle
+    ParticleHandleRelease(simulation, i);
+    ParticleHandleAcquire(simulation, i);
+    LodAdd(simulation, i, 0);
+    simulation->evictions++;
+    // Don't increment because we're just reassigning
+    SimulationLog(simulation,
+                  "No dead particles to revive, reallocating haze particle %d "
+                  "(you should increase FWGL_Init maxParticles)\n",
+                  i);
+    return i;
+  }
 
   // I hope this never happens
-  int x = RandIntRange(0, simulation->maxParticles);
-  printf("Particle overflow! No dead and no haze, so reallocating whatever %d "
-         "is!\n",
-         x);
+  int x = RandIntRange(simulation, 0, simulation->capacity);
+  struct Particle *c = ParticleAt(simulation, x);
+  c->id = simulation->nextParticleId++;
+  c->lastUpdateTime = simulation->time;
+  simulation->lodStale[c->lodTier]++;
+  ParticleHandleRelease(simulation, x);
+  ParticleHandleAcquire(simulation, x);
+  LodAdd(simulation, x, 0);
+  simulation->evictions++;
+  SimulationLog(simulation,
+                "Particle overflow! No dead and no haze, so reallocating "
+                "whatever %d is!\n",
+                x);
   return x;
 }
 
+void LaunchSchedulerClassic(struct FWGLSimulation *simulation) {
+  struct FWGLLaunchScheduler *launcher = &(simulation->launcher);
+  launcher->launchRate = 0;
+  launcher->salvoInterval = 0;
+  launcher->salvoSize = 0;
+  launcher->finaleInterval = 0;
+  launcher->finaleDuration = 0;
+  launcher->finaleRate = 0;
+  launcher->launchDebt = 0;
+  launcher->timeSinceSalvo = 0;
+  launcher->timeSinceFinale = 0;
+  launcher->placement = 0;
+}
+
+// A steady show with salvos, building to a finale every 45 seconds
+void LaunchSchedulerFinale(struct FWGLSimulation *simulation) {
+  struct FWGLLaunchScheduler *launcher = &(simulation->launcher);
+  LaunchSchedulerClassic(simulation);
+  launcher->launchRate = 12;
+  launcher->salvoInterval = 4;
+  launcher->salvoSize = 16;
+  launcher->finaleInterval = 45;
+  launcher->finaleDuration = 8;
+  launcher->finaleRate = 80;
+  launcher->placement = RandDouble(simulation);
+}
+
+int ScheduleLaunches(struct FWGLSimulation *simulation, float dSecs) {
+  struct FWGLLaunchScheduler *launcher = &(simulation->launcher);
+  int room = simulation->maxRockets - simulation->liveRockets;
+
+  if (room <= 0) {
+    return 0;
+  }
+
+  // Classic mode, just fill up the sky
+  if (launcher->launchRate <= 0 && launcher->salvoInterval <= 0 &&
+      launcher->finaleInterval <= 0) {
+    return room;
+  }
+
+  float rate = launcher->launchRate;
+  launcher->timeSinceFinale += dSecs;
+  if (launcher->finaleInterval > 0 &&
+      launcher->timeSinceFinale > launcher->finaleInterval) {
+    rate += launcher->finaleRate;
+    if (launcher->timeSinceFinale >
+        launcher->finaleInterval + launcher->finaleDuration) {
+      launcher->timeSinceFinale = 0;
+    }
+  }
+  launcher->launchDebt += rate * dSecs;
+
+  launcher->timeSinceSalvo += dSecs;
+  if (launcher->salvoInterval > 0 &&
+      launcher->timeSinceSalvo > launcher->salvoInterval) {
+    launcher->timeSinceSalvo = 0;
+    launcher->launchDebt += launcher->salvoSize;
+  }
+
+  int count = (int)launcher->launchDebt;
+  if (count > room) {
+    count = room;
+  }
+  launcher->launchDebt -= count;
+  // Don't let a full sky bank up a flood for later
+  if (launcher->launchDebt > room) {
+    launcher->launchDebt = (float)room;
+  }
+  return count;
+}
+
+void LaunchRockets(struct FWGLSimulation *simulation, int width, int count) {
+  struct FWGLLaunchScheduler *launcher = &(simulation->launcher);
+  int classic = launcher->launchRate <= 0 && launcher->salvoInterval <= 0 &&
+                launcher->finaleInterval <= 0;
+  int margin = width > 600 ? 200 : width / 4;
+
+  for (int i = 0; i < count; i++) {
+    int pId = ReviveDeadParticle(simulation);
+    struct Particle *p = ParticleAt(simulation, pId);
+    MakePTSparkRocket(simulation, pId);
+    simulation->liveRockets += 1;
+
+    // Lots of rockets at once clump up if they're placed randomly, so step
+    // along a golden ratio sequence instead to spread them evenly
+    if (classic) {
+      p->position[0] =
+          (float)RandIntRange(simulation, margin, width - margin);
+    } else {
+      launcher->placement += GOLDEN_RATIO_FRACTION;
+      launcher->placement -= (int)launcher->placement;
+      p->position[0] =
+          (float)(margin + launcher->placement * (width - 2 * margin));
+    }
+    p->position[1] = -50;
+    p->position[2] = 0;
+  }
+}
+
+// Start playing a timeline from the beginning, or go back to the launcher if
+// it's NULL
+void SimulationSetTimeline(struct FWGLSimulation *simulation,
+                           const struct FWGLTimeline *timeline) {
+  simulation->timeline = timeline;
+  simulation->timelineCursor = 0;
+  simulation->timelineTime = 0;
+}
+
+void LaunchTimelineEvent(struct FWGLSimulation *simulation, int width,
+                         const struct FWGLTimelineEvent *event) {
+  int pId = ReviveDeadParticle(simulation);
+  struct Particle *p = ParticleAt(simulation, pId);
+  MakePTSparkRocket(simulation, pId);
+  simulation->liveRockets += 1;
+
+  p->position[0] = event->position[0] * width;
+  p->position[1] = event->position[1];
+  p->position[2] = 0;
+  p->velocity[0] = event->velocity[0];
+  p->velocity[1] = event->velocity[1];
+  if (event->colour[0] >= 0) {
+    p->colour[0] = event->colour[0];
+    p->colour[1] = event->colour[1];
+    p->colour[2] = event->colour[2];
+    p->colour[3] = 1;
+  }
+  p->burst = event->burst;
+  if (event->children > 0) {
+    p->children = event->children;
+  }
+  if (event->fuse > 0) {
+    p->remainingLife = event->fuse;
+  }
+}
+
+// Launch everything on the timeline that's come due. Events are sorted, so
+// each one is only looked at when it goes up.
+void LaunchTimelineEvents(struct FWGLSimulation *simulation, int width,
+                          float dSecs) {
+  const struct FWGLTimeline *timeline = simulation->timeline;
+  simulation->timelineTime += dSecs;
+
+  while (1) {
+    if (simulation->timelineCursor >= timeline->count) {
+      if (timeline->period <= 0 ||
+          simulation->timelineTime < timeline->period) {
+        return;
+      }
+      simulation->timelineTime -= timeline->period;
+      simulation->timelineCursor = 0;
+      continue;
+    }
+
+    const struct FWGLTimelineEvent *event =
+        &(timeline->events[simulation->timelineCursor]);
+    if (event->time > simulation->timelineTime) {
+      return;
+    }
+    simulation->timelineCursor++;
+    LaunchTimelineEvent(simulation, width, event);
+  }
+}
+
+// Fill the sky with a mix of sparks and haze like a busy show has, for
+// measuring how much the machine can take
+void SpawnStressParticles(struct FWGLSimulation *simulation, int width,
+                          int height, int count) {
+  for (int i = 0; i < count; i++) {
+    int pId = ReviveDeadParticle(simulation);
+    struct Particle *p = ParticleAt(simulation, pId);
+    if (i % 4 == 0) {
+      MakePTSpark(simulation, pId);
+      p->timeSinceLastEmission = 0;
+    } else {
+      MakePTHaze(simulation, pId);
+      p->velocity[0] = (float)RandIntRange(simulation, -20, 20);
+      p->velocity[1] = (float)RandIntRange(simulation, -20, 20);
+      p->hazeDragFactor = 0;
+    }
+
+    float colour[4] = {0};
+    RandomBrightColour(simulation, colour);
+    p->colour[0] = colour[0];
+    p->colour[1] = colour[1];
+    p->colour[2] = colour[2];
+    p->colour[3] = colour[3];
+    p->position[0] = (float)RandIntRange(simulation, 0, width);
+    p->position[1] = (float)RandIntRange(simulation, 0, height);
+    p->position[2] = 0;
+  }
+}
+
 void MakePTSparkRocket(struct FWGLSimulation *simulation, int particle) {
-  struct Particle *p = &(simulation->particles[particle]);
+  struct Particle *p = ParticleAt(simulation, particle);
 
   p->type = PT_SPARK_ROCKET;
-  p->rocketIsPinwheel = RandDouble() < 0.1 ? 1 : 0;
+  p->rocketIsPinwheel = RandDouble(simulation) < 0.1 ? 1 : 0;
 
-  p->velocity[0] = (float)RandIntRange(-100, 100);
-  p->velocity[1] = (float)RandIntRange(250, 400);
+  p->velocity[0] = (float)RandIntRange(simulation, -100, 100);
+  p->velocity[1] = (float)RandIntRange(simulation, 250, 400);
   p->velocity[2] = 0;
   p->acceleration[0] = 0;
   p->acceleration[1] = -100;
@@ -114,20 +777,21 @@ void MakePTSparkRocket(struct FWGLSimulation *simulation, int particle) {
   p->colour[2] = colour[2];
   p->colour[3] = colour[3];
 
-  p->remainingLife = RandIntRange(10, 40) / 10.0f;
+  p->remainingLife = RandIntRange(simulation, 10, 40) / 10.0f;
   p->radius = 6;
-  p->children = RandIntRange(5, 12);
+  p->children = RandIntRange(simulation, 5, 12);
+  p->burst = BURST_RANDOM;
 }
 
 void MakePTSpark(struct FWGLSimulation *simulation, int particle) {
-  struct Particle *p = &(simulation->particles[particle]);
+  struct Particle *p = ParticleAt(simulation, particle);
 
   p->type = PT_SPARK;
   p->children = 0;
   p->radius = 3;
 
-  p->velocity[0] = (float)RandIntRange(-200, 200);
-  p->velocity[1] = (float)RandIntRange(-200, 200);
+  p->velocity[0] = (float)RandIntRange(simulation, -200, 200);
+  p->velocity[1] = (float)RandIntRange(simulation, -200, 200);
   p->velocity[2] = 0;
   p->acceleration[0] = 0;
   p->acceleration[1] = -100;
@@ -137,7 +801,7 @@ void MakePTSpark(struct FWGLSimulation *simulation, int particle) {
 }
 
 void MakePTHaze(struct FWGLSimulation *simulation, int particle) {
-  struct Particle *p = &(simulation->particles[particle]);
+  struct Particle *p = ParticleAt(simulation, particle);
 
   p->type = PT_HAZE;
 
@@ -155,70 +819,87 @@ void MakePTHaze(struct FWGLSimulation *simulation, int particle) {
 
 void ProcessPTSparkRocket(struct FWGLSimulation *simulation, int particle,
                           float dSecs) {
-  struct Particle *rocket = &(simulation->particles[particle]);
+  struct Particle *rocket = ParticleAt(simulation, particle);
 
-  rocket->velocity[0] += RandIntRange(-30, 30) / 10.0f;
-  rocket->radius += RandIntRange(-100, 100) / 2500.0f;
+  rocket->velocity[0] += RandIntRange(simulation, -30, 30) / 10.0f;
+  rocket->radius += RandIntRange(simulation, -100, 100) / 2500.0f;
 
   if ((rocket->rocketIsPinwheel && rocket->timeSinceLastEmission > 0.02f) ||
       (!rocket->rocketIsPinwheel && rocket->timeSinceLastEmission > 0.05f)) {
     rocket->timeSinceLastEmission = 0;
 
-    int hId = ReviveDeadParticle(simulation);
-    MakePTHaze(simulation, hId);
-    struct Particle *haze = &(simulation->particles[hId]);
-
+    float position[3];
+    float velocity[3];
     float vMag = sqrt(rocket->velocity[0] * rocket->velocity[0] +
                       rocket->velocity[1] * rocket->velocity[1] +
                       rocket->velocity[2] * rocket->velocity[2]);
 
-    haze->position[0] =
+    position[0] =
         rocket->position[0] - (rocket->radius * rocket->velocity[0] / vMag);
-    haze->position[1] =
+    position[1] =
         rocket->position[1] - (rocket->radius * rocket->velocity[1] / vMag);
-    haze->position[2] =
+    position[2] =
         rocket->position[2] - (rocket->radius * rocket->velocity[2] / vMag);
 
-    float erraticness = pow(fmin(0.35 / rocket->remainingLife, 1), 1.5);
+    // Life can dip just below zero before the rocket is killed next tick
+    float erraticness = pow(0.35 / fmax(rocket->remainingLife, 0.35), 1.5);
 
     if (rocket->rocketIsPinwheel) {
-      haze->velocity[0] =
-          RandIntRange(200, 250) * cos(20 * rocket->remainingLife);
-      haze->velocity[1] =
-          RandIntRange(150, 200) * sin(20 * rocket->remainingLife);
-      haze->velocity[2] = 0;
+      velocity[0] = RandIntRange(simulation, 200, 250) *
+                    cos(20 * rocket->remainingLife);
+      velocity[1] = RandIntRange(simulation, 150, 200) *
+                    sin(20 * rocket->remainingLife);
+      velocity[2] = 0;
 
       // Final indices are inverted because trig, don't change them
-      haze->velocity[0] +=
-          rocket->velocity[0] + (0.25 * RandDouble() * haze->velocity[1]);
-      haze->velocity[1] +=
-          rocket->velocity[1] + (0.25 * RandDouble() * haze->velocity[0]);
-      haze->velocity[2] += rocket->velocity[2];
-
-      haze->hazeDragFactor = 1.3;
+      velocity[0] += rocket->velocity[0] +
+                     (0.25 * RandDouble(simulation) * velocity[1]);
+      velocity[1] += rocket->velocity[1] +
+                     (0.25 * RandDouble(simulation) * velocity[0]);
+      velocity[2] += rocket->velocity[2];
     } else {
       // Final indices are inverted because trig, don't change them
-      haze->velocity[0] =
-          (-0.75f * rocket->velocity[0]) + (RandDouble() * rocket->velocity[1]);
-      haze->velocity[1] = (-0.75f * rocket->velocity[1]) +
-                          (erraticness * RandDouble() * rocket->velocity[0]);
-      haze->velocity[2] = (-0.75f * rocket->velocity[2]);
+      velocity[0] = (-0.75f * rocket->velocity[0]) +
+                    (RandDouble(simulation) * rocket->velocity[1]);
+      velocity[1] =
+          (-0.75f * rocket->velocity[1]) +
+          (erraticness * RandDouble(simulation) * rocket->velocity[0]);
+      velocity[2] = (-0.75f * rocket->velocity[2]);
     }
 
-    haze->acceleration[0] = 0;
-    haze->acceleration[1] = 0;
-    haze->acceleration[2] = 0;
-    haze->colour[0] = rocket->colour[0];
-    haze->colour[1] = rocket->colour[1];
-    haze->colour[2] = rocket->colour[2];
-    haze->colour[3] = rocket->colour[3];
+    if (simulation->smoke) {
+      SmokeInject(simulation->smoke, position, velocity, rocket->colour,
+                  SMOKE_ROCKET_AMOUNT);
+    } else {
+      int hId = ReviveDeadParticle(simulation);
+      MakePTHaze(simulation, hId);
+      struct Particle *haze = ParticleAt(simulation, hId);
+
+      haze->position[0] = position[0];
+      haze->position[1] = position[1];
+      haze->position[2] = position[2];
+      haze->velocity[0] = velocity[0];
+      haze->velocity[1] = velocity[1];
+      haze->velocity[2] = velocity[2];
+      if (rocket->rocketIsPinwheel) {
+        haze->hazeDragFactor = 1.3;
+      }
+
+      haze->acceleration[0] = 0;
+      haze->acceleration[1] = 0;
+      haze->acceleration[2] = 0;
+      haze->colour[0] = rocket->colour[0];
+      haze->colour[1] = rocket->colour[1];
+      haze->colour[2] = rocket->colour[2];
+      haze->colour[3] = rocket->colour[3];
+    }
   }
   rocket->timeSinceLastEmission += dSecs;
 }
 
 void ProcessPTSpark(struct FWGLSimulation *simulation, int particle,
                     float dSecs) {
-  struct Particle *spark = &(simulation->particles[particle]);
+  struct Particle *spark = ParticleAt(simulation, particle);
 
   spark->acceleration[0] = -1.6f * spark->velocity[0];
   spark->acceleration[1] = -60;
@@ -226,22 +907,34 @@ void ProcessPTSpark(struct FWGLSimulation *simulation, int particle,
   if (spark->timeSinceLastEmission > 0.1) {
     spark->timeSinceLastEmission = 0;
 
-    int hId = ReviveDeadParticle(simulation);
-    struct Particle *haze = &(simulation->particles[hId]);
-    MakePTHaze(simulation, hId);
-
-    haze->position[0] = spark->position[0];
-    haze->position[1] = spark->position[1];
-    haze->position[2] = spark->position[2];
+    float velocity[3];
+    velocity[0] =
+        (0.1 * spark->velocity[0]) + 5 * (RandDouble(simulation) - 0.5);
+    velocity[1] =
+        (0.1 * spark->velocity[1]) + 5 * (RandDouble(simulation) - 0.5);
+    velocity[2] = 0;
 
-    haze->velocity[0] = (0.1 * spark->velocity[0]) + 5 * (RandDouble() - 0.5);
-    haze->velocity[1] = (0.1 * spark->velocity[1]) + 5 * (RandDouble() - 0.5);
-    haze->velocity[2] = 0;
-
-    haze->colour[0] = spark->colour[0];
-    haze->colour[1] = spark->colour[1];
-    haze->colour[2] = spark->colour[2];
-    haze->colour[3] = spark->colour[3];
+    if (simulation->smoke) {
+      SmokeInject(simulation->smoke, spark->position, velocity, spark->colour,
+                  SMOKE_SPARK_AMOUNT);
+    } else {
+      int hId = ReviveDeadParticle(simulation);
+      struct Particle *haze = ParticleAt(simulation, hId);
+      MakePTHaze(simulation, hId);
+
+      haze->position[0] = spark->position[0];
+      haze->position[1] = spark->position[1];
+      haze->position[2] = spark->position[2];
+
+      haze->velocity[0] = velocity[0];
+      haze->velocity[1] = velocity[1];
+      haze->velocity[2] = velocity[2];
+
+      haze->colour[0] = spark->colour[0];
+      haze->colour[1] = spark->colour[1];
+      haze->colour[2] = spark->colour[2];
+      haze->colour[3] = spark->colour[3];
+    }
   }
 
   spark->timeSinceLastEmission += dSecs;
@@ -249,21 +942,18 @@ void ProcessPTSpark(struct FWGLSimulation *simulation, int particle,
 
 void ProcessPTHaze(struct FWGLSimulation *simulation, int particle,
                    float dSecs) {
-  struct Particle *haze = &(simulation->particles[particle]);
+  // Same shape as the other ProcessPT functions, but haze doesn't need it
+  (void)dSecs;
+  struct Particle *haze = ParticleAt(simulation, particle);
 
   // Haze's velocity is constant and fading/alpha is done in the fragment shader
+  // Colour flicker is a hash of the particle id in the vertex shader
   haze->acceleration[0] = -haze->hazeDragFactor * haze->velocity[0];
   haze->acceleration[1] = -haze->hazeDragFactor * haze->velocity[1];
-
-  // This may cause some artifacting around red particles? Overexposure?
-  double factor = (haze->remainingLife) / 3 * (RandDouble() - 0.5) / 5.0f;
-  haze->colour[0] += factor;
-  haze->colour[1] += factor;
-  haze->colour[2] += factor;
 }
 
 void KillPTSpark(struct FWGLSimulation *simulation, int particle) {
-  struct Particle *parent = &(simulation->particles[particle]);
+  struct Particle *parent = ParticleAt(simulation, particle);
 
   // If the spark isn't a splitter, nothing happens
   if (parent->children <= 0)
@@ -273,13 +963,13 @@ void KillPTSpark(struct FWGLSimulation *simulation, int particle) {
   float *speeds = malloc(sizeof(float) * parent->children);
   float *velocities = malloc(2 * sizeof(float) * parent->children);
   for (int i = 0; i < parent->children; i++) {
-    speeds[i] = (float)RandIntRange(150, 250);
+    speeds[i] = (float)RandIntRange(simulation, 150, 250);
   }
-  DistributeSpeeds(speeds, velocities, parent->children);
+  DistributeSpeeds(simulation, speeds, velocities, parent->children, 0.5f);
 
   for (int i = 0; i < parent->children; i++) {
     int sId = ReviveDeadParticle(simulation);
-    struct Particle *spark = &(simulation->particles[sId]);
+    struct Particle *spark = ParticleAt(simulation, sId);
     MakePTSpark(simulation, sId);
 
     spark->position[0] = parent->position[0];
@@ -306,28 +996,39 @@ void KillPTSpark(struct FWGLSimulation *simulation, int particle) {
 }
 
 void KillPTSparkRocket(struct FWGLSimulation *simulation, int particle) {
-  struct Particle *rocket = &(simulation->particles[particle]);
+  struct Particle *rocket = ParticleAt(simulation, particle);
+  int template = rocket->burst & BURST_TEMPLATE_MASK;
+  if (template >= BURST_TEMPLATES) {
+    template = BURST_RANDOM;
+  }
+  const struct BurstShape *shape = &(burstShapes[template]);
 
   // Space particles out around a circle
   float *speeds = malloc(sizeof(float) * rocket->children);
   float *velocities = malloc(2 * sizeof(float) * rocket->children);
   for (int i = 0; i < rocket->children; i++) {
-    speeds[i] = (float)RandIntRange(200, 300);
+    speeds[i] =
+        (float)RandIntRange(simulation, shape->minSpeed, shape->maxSpeed);
   }
-  DistributeSpeeds(speeds, velocities, rocket->children);
+  DistributeSpeeds(simulation, speeds, velocities, rocket->children,
+                   shape->jitter);
 
-  // Small chance to make a really big bang!
-  int splitter = RandDouble() < 0.1 ? 1 : 0;
+  // Small chance to make a really big bang, unless it's asked for anyway
+  int splitter = (rocket->burst & BURST_SPLITTER) != 0;
+  if (template == BURST_RANDOM && !splitter) {
+    splitter = RandDouble(simulation) < 0.1 ? 1 : 0;
+  }
 
   for (int i = 0; i < rocket->children; i++) {
     int sId = ReviveDeadParticle(simulation);
-    struct Particle *spark = &(simulation->particles[sId]);
+    struct Particle *spark = ParticleAt(simulation, sId);
     MakePTSpark(simulation, sId);
+    spark->remainingLife *= shape->sparkLife;
 
     // Splitter-spark
     if (splitter) {
       spark->radius = 2;
-      spark->children = RandIntRange(6, 12);
+      spark->children = RandIntRange(simulation, 6, 12);
       spark->remainingLife *= 0.75;
 
       float colour[4] = {0};
@@ -368,14 +1069,79 @@ void KillPTHaze(struct FWGLSimulation *simulation, int particle) {
   // Haze does nothing special when it dies
 }
 
+void UpdateParticle(struct FWGLSimulation *simulation, int pId, int width,
+                    int height, float dSecs) {
+  struct Particle *p = ParticleAt(simulation, pId);
+
+  // Kill old particles
+  if (p->remainingLife <= 0) {
+    switch (p->type) {
+    case PT_SPARK:
+      KillPTSpark(simulation, pId);
+      break;
+    case PT_SPARK_ROCKET:
+      KillPTSparkRocket(simulation, pId);
+      break;
+    case PT_HAZE:
+      KillPTHaze(simulation, pId);
+      break;
+    }
+
+    DeleteParticle(simulation, pId);
+  }
+
+  // Kill out of bounds particles
+  if (p->position[0] < -50 || p->position[0] > width + 50 ||
+      p->position[1] < -50 || p->position[1] > height + 50) {
+    DeleteParticle(simulation, pId);
+  }
+
+  // Retire particles which can't change a pixel any more, as long as dying
+  // early doesn't skip a burst
+  if ((p->type == PT_HAZE || (p->type == PT_SPARK && p->children <= 0)) &&
+      ParticleContribution(p) < VISIBLE_HDR_MIN) {
+    DeleteParticle(simulation, pId);
+  }
+
+  // Skip newly dead particles
+  if (!p->isAlive) {
+    return;
+  }
+
+  // Make particles older
+  p->remainingLife -= dSecs;
+
+  // Process different types of particle
+  switch (p->type) {
+  case PT_SPARK_ROCKET:
+    ProcessPTSparkRocket(simulation, pId, dSecs);
+    break;
+  case PT_SPARK:
+    ProcessPTSpark(simulation, pId, dSecs);
+    break;
+  case PT_HAZE:
+    ProcessPTHaze(simulation, pId, dSecs);
+    break;
+  }
+
+  // Update position and velocity
+  p->position[0] += p->velocity[0] * dSecs;
+  p->position[1] += p->velocity[1] * dSecs;
+  p->position[2] += p->velocity[2] * dSecs;
+
+  p->velocity[0] += p->acceleration[0] * dSecs;
+  p->velocity[1] += p->acceleration[1] * dSecs;
+  p->velocity[2] += p->acceleration[2] * dSecs;
+}
+
 void MoveParticles(struct FWGLSimulation *simulation, int width, int height,
                    float dSecs) {
   // Sometimes the rocket count gets out of sync?
   // No idea how that happens, but here's a bodge for it
   int rocketCheck = 0;
   if (simulation->timeSinceRocketCount > 5.0f) {
-    for (int i = 0; i < simulation->maxParticles; i++) {
-      struct Particle *p = &(simulation->particles[i]);
+    for (int i = 0; i < simulation->capacity; i++) {
+      struct Particle *p = ParticleAt(simulation, i);
       if ((p->type == PT_SPARK_ROCKET) && (p->isAlive)) {
         rocketCheck++;
       }
@@ -386,78 +1152,97 @@ void MoveParticles(struct FWGLSimulation *simulation, int width, int height,
   }
   simulation->timeSinceRocketCount += dSecs;
 
-  // Make new rockets
-  while (simulation->maxRockets > simulation->liveRockets) {
-    int pId = ReviveDeadParticle(simulation);
-    struct Particle *p = &(simulation->particles[pId]);
-    MakePTSparkRocket(simulation, pId);
-    simulation->liveRockets += 1;
+  simulation->tick++;
+  simulation->time += dSecs;
 
-    p->position[0] = (float)RandIntRange(200, width - 200);
-    p->position[1] = -50;
-    p->position[2] = 0;
+  // Make new rockets, all of this tick's at once
+  if (simulation->timeline != NULL) {
+    LaunchTimelineEvents(simulation, width, dSecs);
+  } else {
+    LaunchRockets(simulation, width, ScheduleLaunches(simulation, dSecs));
   }
 
-  // Move and process all particles
-  for (int pId = 0; pId < simulation->maxParticles; pId++) {
-    struct Particle *p = &(simulation->particles[pId]);
+  // Process each LOD tier, staggered so a 1/2^n slice of tier n is done on
+  // every tick. Particles spawned in here wait for the next tick.
+  for (int tier = 0; tier < LOD_TIERS; tier++) {
+    int period = 1 << tier;
+    int count = simulation->lodCounts[tier];
 
-    // Skip already dead particles
-    if (!p->isAlive) {
-      continue;
-    }
+    for (int slot = simulation->tick % period; slot < count; slot += period) {
+      int pId = LodEntryParticle(simulation, tier, slot);
+      if (pId < 0) {
+        continue;
+      }
+      struct Particle *p = ParticleAt(simulation, pId);
 
-    // Kill old particles
-    if (p->remainingLife <= 0) {
-      switch (p->type) {
-      case PT_SPARK:
-        KillPTSpark(simulation, pId);
-        break;
-      case PT_SPARK_ROCKET:
-        KillPTSparkRocket(simulation, pId);
-        break;
-      case PT_HAZE:
-        KillPTHaze(simulation, pId);
-        break;
+      // Already done this tick, on its way down from a faster tier
+      if (p->lastUpdateTime == simulation->time) {
+        continue;
       }
 
-      DeleteParticle(simulation, pId);
+      // Skipped ticks are caught up in one go
+      float dt = (float)(simulation->time - p->lastUpdateTime);
+      p->lastUpdateTime = simulation->time;
+      UpdateParticle(simulation, pId, width, height, dt);
+
+      if (p->isAlive) {
+        int newTier = LodTierFor(p);
+        if (newTier != tier) {
+          simulation->lodStale[tier]++;
+          LodAdd(simulation, pId, newTier);
+        }
+      }
     }
+  }
 
-    // Kill out of bounds particles
-    if (p->position[0] < -50 || p->position[0] > width + 50 ||
-        p->position[1] < -50 || p->position[1] > height + 50) {
-      DeleteParticle(simulation, pId);
+  for (int tier = 0; tier < LOD_TIERS; tier++) {
+    if (4 * simulation->lodStale[tier] > simulation->lodCounts[tier]) {
+      LodCompact(simulation, tier);
     }
+  }
 
-    // Skip newly dead particles
-    if (!p->isAlive) {
-      continue;
-    }
-
-    // Make particles older
-    p->remainingLife -= dSecs;
-
-    // Process different types of particle
-    switch (p->type) {
-    case PT_SPARK_ROCKET:
-      ProcessPTSparkRocket(simulation, pId, dSecs);
-      break;
-    case PT_SPARK:
-      ProcessPTSpark(simulation, pId, dSecs);
-      break;
-    case PT_HAZE:
-      ProcessPTHaze(simulation, pId, dSecs);
-      break;
+  // Once the pool has been mostly empty for a while, give chunks back one
+  // per tick until it isn't
+  int spare = simulation->capacity - PARTICLE_CHUNK_SIZE;
+  if (simulation->chunkCount > 1 && 2 * simulation->liveParticles < spare) {
+    simulation->quietTime += dSecs;
+    if (simulation->quietTime > POOL_SHRINK_DELAY) {
+      ParticlePoolShrink(simulation);
+      simulation->quietTime = POOL_SHRINK_DELAY;
     }
+  } else {
+    simulation->quietTime = 0;
+  }
 
-    // Update position and velocity
-    p->position[0] += p->velocity[0] * dSecs;
-    p->position[1] += p->velocity[1] * dSecs;
-    p->position[2] += p->velocity[2] * dSecs;
+  // Haze smoke costs the same however many emitters feed it
+  if (simulation->smoke) {
+    SmokeStep(simulation->smoke, simulation->jobs, dSecs);
+  }
+}
 
-    p->velocity[0] += p->acceleration[0] * dSecs;
-    p->velocity[1] += p->acceleration[1] * dSecs;
-    p->velocity[2] += p->acceleration[2] * dSecs;
+// Run the simulation on ahead without drawing anything, so the first frame
+// isn't an empty sky. The step is as coarse as it can be without changing how
+// often rockets and sparks leave haze (every 4th and 7th tick at 60Hz), and it
+// stops early if it runs out of real time.
+void PrewarmSimulation(struct FWGLSimulation *simulation, int width,
+                       int height, float seconds, float budget) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  double started = ts.tv_sec + ts.tv_nsec / 1e9;
+  double elapsed = 0;
+
+  float simulated = 0;
+  int steps = 0;
+  while (simulated < seconds && elapsed < budget) {
+    MoveParticles(simulation, width, height, PREWARM_STEP);
+    simulated += PREWARM_STEP;
+    steps++;
+
+    timespec_get(&ts, TIME_UTC);
+    elapsed = ts.tv_sec + ts.tv_nsec / 1e9 - started;
   }
+
+  SimulationLog(simulation,
+                "Prewarmed %.2fs in %d steps and %.2fms, %d particles alive\n",
+                simulated, steps, 1000 * elapsed, simulation->liveParticles);
 }
@@ -1,7 +1,58 @@
 #pragma once
+#include "fireworks_gl_jobs.h"
+#include "fireworks_gl_smoke.h"
 
 enum ParticleType { PT_SPARK = 0, PT_SPARK_ROCKET = 1, PT_HAZE = 2 };
 
+// How a rocket bursts. Random is the classic look, where one in ten rockets
+// picks splitter sparks by itself; the others only split if BURST_SPLITTER is
+// set too.
+enum BurstTemplate {
+  BURST_RANDOM = 0,
+  BURST_RING = 1,
+  BURST_PEONY = 2,
+  BURST_WILLOW = 3,
+  BURST_PALM = 4,
+};
+#define BURST_TEMPLATES 5
+#define BURST_TEMPLATE_MASK 0xF
+#define BURST_SPLITTER 0x10
+
+// Fractional part of the golden ratio, for an R1 low-discrepancy sequence
+#define GOLDEN_RATIO_FRACTION 0.6180339887498949
+
+// Particles in LOD tier n are only updated every 2^n ticks
+#define LOD_TIERS 3
+
+// The pool grows and shrinks a chunk at a time. Chunks never move once
+// allocated, so a Particle pointer stays good while the pool grows.
+#define PARTICLE_CHUNK_SHIFT 10
+#define PARTICLE_CHUNK_SIZE (1 << PARTICLE_CHUNK_SHIFT)
+
+// A handle is a slot in the handle table (low bits) plus that slot's
+// generation (high bits). The generation moves on when the particle dies, so
+// old handles stop resolving, and shrinking the pool only has to fix up the
+// table when it moves a particle.
+typedef unsigned int ParticleHandle;
+#define PARTICLE_HANDLE_SLOT_BITS 22
+#define PARTICLE_HANDLE_SLOT_MASK ((1u << PARTICLE_HANDLE_SLOT_BITS) - 1)
+// The pool is capped one short of the last slot, so this is never handed out
+#define PARTICLE_HANDLE_NONE PARTICLE_HANDLE_SLOT_MASK
+
+struct ParticleHandleSlot {
+  // -1 while the slot is free
+  int particle;
+  unsigned int generation;
+};
+
+// The index is where the particle was when the entry was made. That's right
+// until the pool shrinks and moves it, so the handle is only looked up when
+// the particle there turns out to be somebody else.
+struct LodEntry {
+  int particle;
+  ParticleHandle handle;
+};
+
 struct Particle {
   float position[3];
   float velocity[3];
@@ -15,25 +66,197 @@ struct Particle {
   float timeSinceLastEmission;
   int rocketIsPinwheel;
   float hazeDragFactor;
+  // Unique per spawn, so the shaders can tell particles apart
+  unsigned int id;
+  // Only valid while the particle is alive
+  ParticleHandle handle;
+  // Which LOD list the particle is in, and where
+  int lodTier;
+  int lodSlot;
+  // Rockets only, a BurstTemplate and maybe BURST_SPLITTER. This also fills
+  // what would be padding, so a snapshot of the same state always comes out
+  // as the same bytes.
+  int burst;
+  double lastUpdateTime;
 };
 
+// Decides how many rockets go up each tick. With no launch rate, salvos or
+// finales it just keeps maxRockets in the air, which is the classic look.
+struct FWGLLaunchScheduler {
+  // Rockets per second, steady
+  float launchRate;
+  // Every salvoInterval seconds, salvoSize rockets go up at once
+  float salvoInterval;
+  int salvoSize;
+  // Every finaleInterval seconds, finaleRate rockets per second for
+  // finaleDuration seconds
+  float finaleInterval;
+  float finaleDuration;
+  float finaleRate;
+
+  float launchDebt;
+  float timeSinceSalvo;
+  float timeSinceFinale;
+  // Position in the low-discrepancy launch sequence, [0, 1)
+  double placement;
+};
+
+// One scripted rocket
+struct FWGLTimelineEvent {
+  // Seconds from the start of the timeline
+  float time;
+  // x is a fraction of the screen width, y is pixels up from the bottom
+  float position[2];
+  float velocity[2];
+  // A random bright colour if red is negative
+  float colour[3];
+  // A BurstTemplate, maybe with BURST_SPLITTER
+  int burst;
+  // Sparks in the burst, or random if 0
+  int children;
+  // Seconds until it bursts, or random if 0
+  float fuse;
+};
+
+// Events sorted by time, so launching them is just moving a cursor along.
+// Simulations only read it, so any number of them can share one.
+struct FWGLTimeline {
+  struct FWGLTimelineEvent *events;
+  int count;
+  // Starts over every this many seconds, or plays once if 0
+  float period;
+};
+
+// Gets each line the simulation would like logged
+typedef void (*SimulationLogFunction)(void *context, const char *message);
+
+// Everything a simulation touches lives in here (or in its pool, smoke and
+// jobs), so separate simulations can be run on separate threads at once
 struct FWGLSimulation {
-  int fwglIsPreview;
+  // Nothing is logged without one
+  SimulationLogFunction log;
+  void *logContext;
+  // Per simulation, rather than rand()'s shared state
+  unsigned long long randomState;
+  // The pool can grow up to maxParticles, and capacity is what it has now
   int maxParticles;
+  int capacity;
   int liveParticles;
   int maxRockets;
   int liveRockets;
-  struct Particle *particles;
+  // Use ParticleAt rather than indexing these directly
+  struct Particle **chunks;
+  int chunkCount;
+  // Stack of dead particle indices, popped by ReviveDeadParticle
+  int *freeList;
+  int freeCount;
+  // The handle table, and a stack of the slots nobody is using
+  struct ParticleHandleSlot *handles;
+  int handleCapacity;
+  int *freeHandles;
+  int freeHandleCount;
+  // How long the pool has had a lot more room than it needs
+  float quietTime;
   float timeSinceRocketCount;
+  struct FWGLLaunchScheduler launcher;
+  // Replaces the launcher when set. Not owned by the simulation.
+  const struct FWGLTimeline *timeline;
+  int timelineCursor;
+  double timelineTime;
+  unsigned int nextParticleId;
+  // Live particles taken over for new ones because the pool was full
+  unsigned int evictions;
+  unsigned int tick;
+  double time;
+  // Live particles, split by how often they need updating. Entries go stale
+  // when their particle dies or moves tier and are compacted away lazily, so
+  // go through LodEntryParticle to use one.
+  struct LodEntry *lodLists[LOD_TIERS];
+  int lodCounts[LOD_TIERS];
+  int lodCapacities[LOD_TIERS];
+  int lodStale[LOD_TIERS];
+  // Optional, replaces haze particles when set
+  struct FWGLSmokeGrid *smoke;
+  struct FWGLJobs *jobs;
 };
 
+static inline struct Particle *ParticleAt(struct FWGLSimulation *simulation,
+                                          int particle) {
+  return &(simulation->chunks[particle >> PARTICLE_CHUNK_SHIFT]
+                             [particle & (PARTICLE_CHUNK_SIZE - 1)]);
+}
+
+void ParticlePoolInit(struct FWGLSimulation *simulation, int maxParticles);
+void ParticlePoolFree(struct FWGLSimulation *simulation);
+int ParticlePoolGrow(struct FWGLSimulation *simulation);
+void ParticlePoolShrink(struct FWGLSimulation *simulation);
+int ParticleFromHandle(struct FWGLSimulation *simulation,
+                       ParticleHandle handle);
+
+int LodEntryRefresh(struct FWGLSimulation *simulation, struct LodEntry *entry);
+
+// The particle an LOD list entry points at, or -1 if the entry is stale. This
+// is on the path of every particle update, so it's kept small enough to
+// inline and only goes through the handle table when the index misses.
+static inline int LodEntryParticle(struct FWGLSimulation *simulation,
+                                   int tier, int slot) {
+  struct LodEntry *entry = &(simulation->lodLists[tier][slot]);
+  int particle = entry->particle;
+  if (particle >= simulation->capacity ||
+      ParticleAt(simulation, particle)->handle != entry->handle) {
+    particle = LodEntryRefresh(simulation, entry);
+    if (particle < 0) {
+      return -1;
+    }
+  }
+
+  struct Particle *p = ParticleAt(simulation, particle);
+  if (!p->isAlive || p->lodTier != tier || p->lodSlot != slot) {
+    return -1;
+  }
+  return particle;
+}
+
+// The most SimulationRandom can return
+#define SIMULATION_RANDOM_MAX 0x7FFFFFFF
+
+void SimulationInit(struct FWGLSimulation *simulation,
+                    unsigned long long seed);
+void SimulationFree(struct FWGLSimulation *simulation);
+size_t SimulationBytes(struct FWGLSimulation *simulation);
+void SimulationSeed(struct FWGLSimulation *simulation,
+                    unsigned long long seed);
+void SimulationLog(struct FWGLSimulation *simulation, const char *format,
+                   ...);
+int SimulationRandom(struct FWGLSimulation *simulation);
+
 void RandomBrightColour(struct FWGLSimulation *simulation, float rgba[4]);
-int RandIntRange(int lower, int upper);
-double RandDouble();
-void DistributeSpeeds(float *speeds, float *velocities, int speedCount);
+int RandIntRange(struct FWGLSimulation *simulation, int lower, int upper);
+double RandDouble(struct FWGLSimulation *simulation);
+void DistributeSpeeds(struct FWGLSimulation *simulation, float *speeds,
+                      float *velocities, int speedCount, float jitter);
+void LaunchSchedulerClassic(struct FWGLSimulation *simulation);
+void LaunchSchedulerFinale(struct FWGLSimulation *simulation);
+int ScheduleLaunches(struct FWGLSimulation *simulation, float dSecs);
+void LaunchRockets(struct FWGLSimulation *simulation, int width, int count);
+void SimulationSetTimeline(struct FWGLSimulation *simulation,
+                           const struct FWGLTimeline *timeline);
+void LaunchTimelineEvents(struct FWGLSimulation *simulation, int width,
+                          float dSecs);
+int BurstTemplateByName(const char *name);
+int ReviveDeadParticle(struct FWGLSimulation *simulation);
+void SpawnStressParticles(struct FWGLSimulation *simulation, int width,
+                          int height, int count);
 void MoveParticles(struct FWGLSimulation *simulation, int width, int height,
                    float dSecs);
+void PrewarmSimulation(struct FWGLSimulation *simulation, int width,
+                       int height, float seconds, float budget);
 void DeleteParticle(struct FWGLSimulation *simulation, int particle);
+float ParticleAlpha(struct Particle *p);
+float ParticleContribution(struct Particle *p);
+int LodTierFor(struct Particle *p);
+void LodAdd(struct FWGLSimulation *simulation, int particle, int tier);
+void LodCompact(struct FWGLSimulation *simulation, int tier);
 
 void MakePTSpark(struct FWGLSimulation *simulation, int particle);
 void MakePTSparkRocket(struct FWGLSimulation *simulation, int particle);
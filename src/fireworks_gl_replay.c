@@ -0,0 +1,331 @@
+#include "fireworks_gl_replay.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fireworks_gl_snapshot.h"
+#include "fireworks_gl_timeline.h"
+
+_Static_assert(sizeof(struct FWGLReplayHeader) == 304,
+               "replay header layout changed");
+_Static_assert(sizeof(struct FWGLReplayFrame) == 120,
+               "replay frame layout changed");
+_Static_assert(sizeof(struct Particle) % 8 == 0,
+               "particles are hashed a word at a time");
+
+#define REPLAY_HASH_MULTIPLIER 0x9E3779B97F4A7C15ull
+
+// splitmix64's finaliser
+uint64_t ReplayMix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ull;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBull;
+  x ^= x >> 31;
+  return x;
+}
+
+// Every byte of the particle counts, so a float that's off in its last bit
+// shows up. Dead particles aren't hashed, so their leftovers don't matter.
+uint64_t ReplayHashParticle(int index, struct Particle *p) {
+  uint64_t hash = ReplayMix((uint64_t)index + 1);
+  const unsigned char *bytes = (const unsigned char *)p;
+  for (size_t i = 0; i < sizeof(struct Particle); i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * REPLAY_HASH_MULTIPLIER;
+  }
+  return ReplayMix(hash);
+}
+
+void ReplayHashPool(struct FWGLSimulation *simulation,
+                    struct FWGLReplayFrame *frame) {
+  // The counters and random state first, so they can't drift unnoticed
+  uint64_t pool = ReplayMix(simulation->randomState);
+  pool = ReplayMix(pool ^ simulation->nextParticleId);
+  pool = ReplayMix(pool ^ ((uint64_t)simulation->liveParticles << 32 |
+                           (uint32_t)simulation->liveRockets));
+
+  memset(frame->sketch, 0, sizeof(frame->sketch));
+  for (int i = 0; i < simulation->capacity; i++) {
+    struct Particle *p = ParticleAt(simulation, i);
+    if (!p->isAlive) {
+      continue;
+    }
+
+    uint64_t hash = ReplayHashParticle(i, p);
+    pool = (pool ^ hash) * REPLAY_HASH_MULTIPLIER;
+    for (int bit = 0; bit < PARTICLE_HANDLE_SLOT_BITS; bit++) {
+      if (i & (1 << bit)) {
+        frame->sketch[bit] ^= (uint32_t)hash;
+      }
+    }
+    frame->sketch[PARTICLE_HANDLE_SLOT_BITS] ^= (uint32_t)hash;
+  }
+
+  // The smoke doesn't feed back into the particles, so it needs checking too
+  struct FWGLSmokeGrid *smoke = simulation->smoke;
+  if (smoke != NULL) {
+    float *fields[] = {smoke->red, smoke->green, smoke->blue, smoke->velocityX,
+                       smoke->velocityY};
+    int cells = smoke->width * smoke->height;
+    for (int f = 0; f < 5; f++) {
+      for (int c = 0; c < cells; c++) {
+        uint32_t word;
+        memcpy(&word, &(fields[f][c]), 4);
+        pool = (pool ^ word) * REPLAY_HASH_MULTIPLIER;
+      }
+    }
+  }
+
+  frame->poolHash = ReplayMix(pool);
+  frame->liveParticles = simulation->liveParticles;
+  frame->reserved = 0;
+}
+
+int ReplaySnapshotSink(void *context, const void *data, size_t size) {
+  return fwrite(data, 1, size, context) == size;
+}
+
+// Starts the log with a snapshot, so call it once the simulation is in the
+// state the first recorded frame starts from. timelineName is what the
+// simulation's timeline was opened from, if it has one.
+struct FWGLReplayRecorder *ReplayRecorderOpen(struct FWGLSimulation *simulation,
+                                              const char *path,
+                                              const char *timelineName) {
+  if (simulation->timeline != NULL &&
+      (timelineName == NULL || strlen(timelineName) >= REPLAY_TIMELINE_NAME)) {
+    SimulationLog(simulation, "Can't record, the timeline's name is too long "
+                              "to keep in the recording\n");
+    return NULL;
+  }
+
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    SimulationLog(simulation, "Couldn't open %s to record to\n", path);
+    return NULL;
+  }
+
+  struct FWGLReplayHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+  header.version = REPLAY_VERSION;
+  header.frameSize = sizeof(struct FWGLReplayFrame);
+  header.snapshotSize = SnapshotSize(simulation);
+  struct FWGLSmokeGrid *smoke = simulation->smoke;
+  if (smoke != NULL) {
+    header.smokeCellSize = (int32_t)smoke->cellSize;
+    header.smokeScreenWidth = (int32_t)lroundf(smoke->screenScale[0] *
+                                               smoke->width * smoke->cellSize);
+    header.smokeScreenHeight = (int32_t)lroundf(
+        smoke->screenScale[1] * smoke->height * smoke->cellSize);
+  }
+  if (simulation->timeline != NULL) {
+    header.timelineCursor = simulation->timelineCursor;
+    header.timelineTime = simulation->timelineTime;
+    strcpy(header.timeline, timelineName);
+  }
+
+  if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+      !SnapshotEmit(simulation, ReplaySnapshotSink, file)) {
+    SimulationLog(simulation, "Couldn't start recording to %s\n", path);
+    fclose(file);
+    return NULL;
+  }
+
+  struct FWGLReplayRecorder *recorder =
+      malloc(sizeof(struct FWGLReplayRecorder));
+  recorder->file = file;
+  recorder->frames = 0;
+  SimulationLog(simulation, "Recording to %s\n", path);
+  return recorder;
+}
+
+// Call straight after MoveParticles, with what it was given
+void ReplayRecord(struct FWGLReplayRecorder *recorder,
+                  struct FWGLSimulation *simulation, int width, int height,
+                  float dSecs) {
+  struct FWGLReplayFrame frame;
+  frame.dSecs = dSecs;
+  frame.width = width;
+  frame.height = height;
+  ReplayHashPool(simulation, &frame);
+  fwrite(&frame, sizeof(frame), 1, recorder->file);
+  recorder->frames++;
+}
+
+void ReplayRecorderClose(struct FWGLReplayRecorder *recorder) {
+  if (recorder == NULL) {
+    return;
+  }
+  fclose(recorder->file);
+  free(recorder);
+}
+
+void ReplayPrintParticle(struct Particle *p) {
+  printf("    type %d, alive %d, id %u, life %.9g, radius %.9g\n", p->type,
+         p->isAlive, p->id, p->remainingLife, p->radius);
+  printf("    position (%.9g, %.9g, %.9g)\n", p->position[0], p->position[1],
+         p->position[2]);
+  printf("    velocity (%.9g, %.9g, %.9g)\n", p->velocity[0], p->velocity[1],
+         p->velocity[2]);
+  printf("    colour (%.9g, %.9g, %.9g, %.9g)\n", p->colour[0], p->colour[1],
+         p->colour[2], p->colour[3]);
+  printf("    LOD tier %d slot %d, last updated at %.9g\n", p->lodTier,
+         p->lodSlot, p->lastUpdateTime);
+}
+
+// Work out which particle broke from the difference in the sketches. That
+// only works if there's exactly one, which is usual on the first bad frame.
+void ReplayReportParticle(struct FWGLSimulation *simulation,
+                          struct FWGLReplayFrame *expected,
+                          struct FWGLReplayFrame *actual) {
+  uint32_t difference = expected->sketch[PARTICLE_HANDLE_SLOT_BITS] ^
+                        actual->sketch[PARTICLE_HANDLE_SLOT_BITS];
+  if (difference == 0) {
+    printf("  Every particle matches, so the counters, random state or smoke "
+           "differ\n");
+    return;
+  }
+
+  int index = 0;
+  for (int bit = 0; bit < PARTICLE_HANDLE_SLOT_BITS; bit++) {
+    uint32_t column = expected->sketch[bit] ^ actual->sketch[bit];
+    if (column == difference) {
+      index |= 1 << bit;
+    } else if (column != 0) {
+      printf("  More than one particle differs\n");
+      return;
+    }
+  }
+
+  if (index >= simulation->capacity) {
+    printf("  More than one particle differs\n");
+    return;
+  }
+  printf("  First differing particle is %d, which is now:\n", index);
+  ReplayPrintParticle(ParticleAt(simulation, index));
+}
+
+double ReplayNow() {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run a log back as fast as possible with no window, checking every frame
+// against the recording. Returns 0 if they all match.
+int ReplayRun(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    printf("Couldn't open %s\n", path);
+    return 2;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *data = size > 0 ? malloc(size) : NULL;
+  int read = data != NULL && fread(data, 1, size, file) == (size_t)size;
+  fclose(file);
+
+  const struct FWGLReplayHeader *header = (const void *)data;
+  if (!read || size < (long)sizeof(*header) ||
+      memcmp(header->magic, REPLAY_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != REPLAY_VERSION ||
+      header->frameSize != sizeof(struct FWGLReplayFrame) ||
+      header->snapshotSize > (uint64_t)size - sizeof(*header) ||
+      memchr(header->timeline, 0, sizeof(header->timeline)) == NULL) {
+    printf("%s isn't a replay log this version can read\n", path);
+    free(data);
+    return 2;
+  }
+
+  // The same rockets have to go up, so it has to be the same timeline
+  struct FWGLTimeline timeline;
+  memset(&timeline, 0, sizeof(timeline));
+  if (header->timeline[0] != '\0' &&
+      !TimelineOpen(&timeline, header->timeline)) {
+    printf("Couldn't open the timeline %s was recorded with\n", path);
+    free(data);
+    return 2;
+  }
+
+  struct FWGLSimulation simulation;
+  SimulationInit(&simulation, 0);
+  ParticlePoolInit(&simulation, PARTICLE_CHUNK_SIZE);
+  simulation.jobs = JobsCreate(JobsDefaultThreadCount());
+  if (header->smokeCellSize > 0) {
+    simulation.smoke =
+        SmokeGridCreate(header->smokeScreenWidth, header->smokeScreenHeight,
+                        header->smokeCellSize);
+  }
+
+  const char *snapshot = data + sizeof(*header);
+  if (!SnapshotRestore(&simulation, snapshot, header->snapshotSize)) {
+    printf("%s has a bad snapshot in it\n", path);
+    SimulationFree(&simulation);
+    JobsDestroy(simulation.jobs);
+    TimelineFree(&timeline);
+    free(data);
+    return 2;
+  }
+  if (header->timeline[0] != '\0') {
+    if (header->timelineCursor < 0 ||
+        header->timelineCursor > timeline.count) {
+      printf("%s doesn't match the timeline it was recorded with\n", path);
+      SimulationFree(&simulation);
+      JobsDestroy(simulation.jobs);
+      TimelineFree(&timeline);
+      free(data);
+      return 2;
+    }
+    SimulationSetTimeline(&simulation, &timeline);
+    simulation.timelineCursor = header->timelineCursor;
+    simulation.timelineTime = header->timelineTime;
+    printf("Using the timeline %s\n", header->timeline);
+  }
+
+  const struct FWGLReplayFrame *frames =
+      (const void *)(snapshot + header->snapshotSize);
+  long frameCount = (size - sizeof(*header) - header->snapshotSize) /
+                    sizeof(struct FWGLReplayFrame);
+  printf("Replaying %ld frames from %s\n", frameCount, path);
+
+  int result = 0;
+  double started = ReplayNow();
+  long frame;
+  for (frame = 0; frame < frameCount; frame++) {
+    // Copied out, since the snapshot's size might leave it unaligned
+    struct FWGLReplayFrame expected;
+    memcpy(&expected, &(frames[frame]), sizeof(expected));
+    MoveParticles(&simulation, expected.width, expected.height,
+                  expected.dSecs);
+
+    struct FWGLReplayFrame actual;
+    ReplayHashPool(&simulation, &actual);
+    if (actual.poolHash != expected.poolHash) {
+      printf("Frame %ld (%.3fs in) doesn't match the recording\n", frame,
+             simulation.time);
+      if (actual.liveParticles != expected.liveParticles) {
+        printf("  %d particles alive, but %d were recorded\n",
+               actual.liveParticles, expected.liveParticles);
+      }
+      ReplayReportParticle(&simulation, &expected, &actual);
+      result = 1;
+      break;
+    }
+  }
+  double elapsed = ReplayNow() - started;
+
+  if (result == 0) {
+    printf("All %ld frames match (%.2fs, %.0f frames per second)\n", frame,
+           elapsed, frame / (elapsed > 0 ? elapsed : 1));
+  }
+
+  SimulationFree(&simulation);
+  JobsDestroy(simulation.jobs);
+  TimelineFree(&timeline);
+  free(data);
+  return result;
+}
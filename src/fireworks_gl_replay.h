@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fireworks_gl_process.h"
+
+// Bumped whenever the log layout or the hash changes
+#define REPLAY_VERSION 2
+#define REPLAY_MAGIC "FWGLRPLY"
+
+// Longest timeline name or path a recording can keep, with its terminator
+#define REPLAY_TIMELINE_NAME 256
+
+// One bit of particle index per sketch column, plus a column for all of them
+#define REPLAY_SKETCH_COLUMNS (PARTICLE_HANDLE_SLOT_BITS + 1)
+
+// A replay log is this header, a snapshot of the simulation as recording
+// started (which covers the seed, and everything calibration and prewarming
+// did before the first frame), then one FWGLReplayFrame per MoveParticles.
+// All little-endian. A timeline isn't in the snapshot, so its name is kept
+// here and it's opened again to replay, which only works if it hasn't
+// changed since.
+struct FWGLReplayHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t frameSize;
+  uint64_t snapshotSize;
+  // What the smoke grid was made for, or zeroes if there wasn't one
+  int32_t smokeScreenWidth;
+  int32_t smokeScreenHeight;
+  int32_t smokeCellSize;
+  // Where the timeline was up to, if there was one
+  int32_t timelineCursor;
+  double timelineTime;
+  // What /timeline was given, or empty if it wasn't
+  char timeline[REPLAY_TIMELINE_NAME];
+};
+
+// Everything MoveParticles was given, and what the pool looked like after.
+// The sketch is, for each bit of particle index, the XOR of the hashes of
+// the live particles whose index has that bit set (the last column has all
+// of them). If one particle goes wrong, the columns it's in differ by the
+// same amount and the others don't, which spells out its index.
+struct FWGLReplayFrame {
+  float dSecs;
+  int32_t width;
+  int32_t height;
+  int32_t liveParticles;
+  uint64_t poolHash;
+  uint32_t sketch[REPLAY_SKETCH_COLUMNS];
+  uint32_t reserved;
+};
+
+struct FWGLReplayRecorder {
+  FILE *file;
+  int frames;
+};
+
+uint64_t ReplayHashParticle(int index, struct Particle *p);
+void ReplayHashPool(struct FWGLSimulation *simulation,
+                    struct FWGLReplayFrame *frame);
+
+struct FWGLReplayRecorder *ReplayRecorderOpen(struct FWGLSimulation *simulation,
+                                              const char *path,
+                                              const char *timelineName);
+void ReplayRecord(struct FWGLReplayRecorder *recorder,
+                  struct FWGLSimulation *simulation, int width, int height,
+                  float dSecs);
+void ReplayRecorderClose(struct FWGLReplayRecorder *recorder);
+
+int ReplayRun(const char *path);
@@ -7,30 +7,71 @@
 const char *geometryVertexShaderSource =
     "   #version 330 core                                               \n"
     "   layout(location = 0) in vec3 aBasePos;                          \n"
-    "   layout(location = 1) in vec3 aTranslate;                        \n"
+    "   layout(location = 1) in vec2 aPosition;                         \n"
     "   layout(location = 2) in vec4 aColour;                           \n"
     "   layout(location = 3) in float aRadius;                          \n"
     "   layout(location = 4) in float aRemainingLife;                   \n"
-    "   layout(location = 5) in int aParticleType;                      \n"
+    "   layout(location = 5) in uint aTypeAndId;                        \n"
     "                                                                   \n"
     "   layout (std140) uniform WindowDimensions {                      \n"
     "       int width;                                                  \n"
     "       int height;                                                 \n"
     "   };                                                              \n"
+    "   uniform float time;                                             \n"
+    "   // Pixels of antialiasing round sprites, or 0 for polygons      \n"
+    "   uniform float edge;                                             \n"
+    "   // FWGL_INSTANCE_MARGIN, round the edge of the window           \n"
+    "   const float margin = 64.0;                                      \n"
     "                                                                   \n"
     "   out vec4 vertexColour;                                          \n"
     "   out float remainingLife;                                        \n"
     "   flat out int particleType;                                      \n"
+    "   // Pixels from the middle of the particle, and its radius       \n"
+    "   out vec2 offset;                                                \n"
+    "   flat out float radius;                                          \n"
+    "                                                                   \n"
+    "   // Integer hash to [0, 1), so every particle flickers the same  \n"
+    "   // way each time without the CPU touching its colour            \n"
+    "   float hash(uint x) {                                            \n"
+    "       x ^= x >> 16u;                                              \n"
+    "       x *= 0x7feb352du;                                           \n"
+    "       x ^= x >> 15u;                                              \n"
+    "       x *= 0x846ca68bu;                                           \n"
+    "       x ^= x >> 16u;                                              \n"
+    "       return float(x) / 4294967296.0;                             \n"
+    "   }                                                               \n"
+    "                                                                   \n"
+    "   // Smooth per-particle noise in [-0.5, 0.5], 30 steps a second  \n"
+    "   float flicker(uint id, float t) {                               \n"
+    "       float step = t * 30.0;                                      \n"
+    "       uint i = uint(floor(step));                                 \n"
+    "       uint seed = id * 0x9e3779b9u;                               \n"
+    "       float a = hash(seed + i);                                   \n"
+    "       float b = hash(seed + i + 1u);                              \n"
+    "       return mix(a, b, fract(step)) - 0.5;                        \n"
+    "   }                                                               \n"
     "                                                                   \n"
     "   void main()                                                     \n"
     "   {                                                               \n"
-    "       gl_Position = vec4(aBasePos*aRadius + aTranslate, 1.0f);    \n"
+    "       int type = int(aTypeAndId >> 24u);                          \n"
+    "       uint id = aTypeAndId & 0xFFFFFFu;                           \n"
+    "       vec2 size = vec2(width, height);                            \n"
+    "       vec2 translate = aPosition * (size + 2.0 * margin) - margin;\n"
+    "       vec2 corner = aBasePos.xy * (aRadius + edge);               \n"
+    "       gl_Position = vec4(corner + translate, 0, 1.0f);            \n"
     "       gl_Position.x /= (width / 2.0f);                            \n"
     "       gl_Position.y /= (height / 2.0f);                           \n"
     "       gl_Position += vec4(-1, -1, 0, 0);                          \n"
     "       vertexColour = aColour;                                     \n"
+    "       if (type == 2) {                                            \n"
+    "           float factor = aRemainingLife / 3 * flicker(id, time) * 0.5;\n"
+    "           // Negative colour turns into NaN in the tonemap        \n"
+    "           vertexColour.rgb = max(vertexColour.rgb + factor, 0.0); \n"
+    "       }                                                           \n"
     "       remainingLife = aRemainingLife;                             \n"
-    "       particleType = aParticleType;                               \n"
+    "       particleType = type;                                        \n"
+    "       offset = corner;                                            \n"
+    "       radius = aRadius;                                           \n"
     "   }                                                               \n"
     "\0";
 
@@ -40,6 +81,9 @@ const char *geometryFragmentShaderSource =
     "   in vec4 vertexColour;                                           \n"
     "   in float remainingLife;                                         \n"
     "   flat in int particleType;                                       \n"
+    "   in vec2 offset;                                                 \n"
+    "   flat in float radius;                                           \n"
+    "   uniform float edge;                                             \n"
     "   void main() {                                                   \n"
     "       FragColor = vec4(vertexColour);                             \n"
     "       if (particleType == 0 && remainingLife < 0.5) {             \n"
@@ -50,53 +94,51 @@ const char *geometryFragmentShaderSource =
     "           float factor = remainingLife / 2;                       \n"
     "           FragColor.w = vertexColour.w * 0.5 * factor * factor;   \n"
     "       }                                                           \n"
+    "       // How much of the pixel the circle covers, for sprites     \n"
+    "       if (edge > 0.0) {                                           \n"
+    "           float inside = radius - length(offset) + 0.5;           \n"
+    "           FragColor.w *= clamp(inside, 0.0, 1.0);                 \n"
+    "       }                                                           \n"
+    "       // Rockets have a white core, the 2x2 pixels in the middle  \n"
+    "       vec2 core = abs(offset);                                    \n"
+    "       if (particleType == 1 && max(core.x, core.y) < 1.0) {       \n"
+    "           FragColor = vec4(1, 1, 1, 1);                           \n"
+    "       }                                                           \n"
     "   }                                                               \n"
     "\0";
 
-const char *pointVertexShaderSource =
-    "   #version 330 core                                       \n"
-    "   layout(location = 0) in vec3 aPosition;                 \n"
-    "	layout(location = 1) in int particleType;			"
-    "	\n"
-    "                                                           \n"
-    "   layout (std140) uniform WindowDimensions {              \n"
-    "       int width;                                          \n"
-    "       int height;                                         \n"
-    "   };                                                      \n"
-    "                                                           \n"
-    "   void main()                                             \n"
-    "   {                                                       \n"
-    "		// Only applies to rockets                          \n"
-    "		if (particleType == 1) {				"
-    "			\n"
-    "			gl_Position = vec4(aPosition, 1.0f);            \n"
-    "			gl_Position.x /= (width / 2.0f);                \n"
-    "			gl_Position.y /= (height / 2.0f);               \n"
-    "			gl_Position += vec4(-1, -1, 0, 0);              \n"
-    "		}							"
-    "						\n"
-    "		else {							"
-    "					\n"
-    "			gl_Position = vec4(-2, -2, -2, 1);		"
-    "		\n"
-    "		}							"
-    "						\n"
-    "	}								"
-    "						\n"
+//
+// Smoke
+//
+
+const char *smokeVertexShaderSource =
+    "#version 330 core                                      \n"
+    "layout(location = 0) in vec2 aPos;                     \n"
+    "layout(location = 1) in vec2 aTexCoords;               \n"
+    "                                                       \n"
+    "out vec2 TexCoords;                                    \n"
+    "                                                       \n"
+    "void main()                                            \n"
+    "{                                                      \n"
+    "    gl_Position = vec4(aPos.x, aPos.y, 0.0, 1.0);      \n"
+    "    TexCoords = aTexCoords;                            \n"
+    "}                                                      \n"
     "\0";
 
-const char *pointFragmentShaderSource =
+const char *smokeFragmentShaderSource =
     "#version 330 core                                      \n"
     "out vec4 FragColor;                                    \n"
     "                                                       \n"
     "in vec2 TexCoords;                                     \n"
     "                                                       \n"
-    "uniform sampler2D screenTexture;                       \n"
+    "uniform sampler2D smokeTexture;                        \n"
+    "uniform vec2 screenScale;                              \n"
     "                                                       \n"
     "void main()                                            \n"
     "{                                                      \n"
-    "    FragColor = vec4(1,1,1,1);					"
-    "		\n"
+    "    vec2 cell = TexCoords * screenScale;               \n"
+    "    vec3 density = texture(smokeTexture, cell).rgb;    \n"
+    "    FragColor = vec4(max(density, vec3(0)), 1.0);      \n"
     "}                                                      \n"
     "\0";
 
@@ -118,105 +160,158 @@ const char *blurVertexShaderSource =
     "}                                                      \n"
     "\0";
 
-const char *blurFragmentShaderSource =
-    "#version 330 core							"
-    "									"
-    "					\n"
-    "out vec4 FragColor;						"
-    "									"
-    "					\n"
-    "									"
-    "									"
-    "							\n"
-    "in vec2 TexCoords;							"
-    "									"
-    "					\n"
-    "									"
-    "									"
-    "							\n"
-    "uniform sampler2D image;						"
-    "									"
-    "				\n"
-    "									"
-    "									"
-    "							\n"
-    "uniform bool horizontal;						"
-    "									"
-    "				\n"
-    "uniform float weight[5] = float[](0.227027, 0.1945946, 0.1216216, "
-    "0.054054, 0.016216);				\n"
-    //"uniform float weight[3] = float[](2*0.3513, 0.1159, 0.0228);
-    //\n" "uniform float weight[5] = float[](2*0.2340, 2*0.1603, 2*0.0753,
-    // 2*0.0242, 2*0.0062);				\n" "uniform float
-    // weight[6] = float[](2*0.1915, 0.1499, 0.0918, 0.0441, 0.0165, 2*0.0062);
-    //\n"
-    "const int WEIGHTS = 5;						"
-    "									"
-    "									"
-    "	\n"
-    "									"
-    "									"
-    "							\n"
-    "void main()							"
-    "									"
-    "						\n"
-    "{									"
-    "									"
-    "							\n"
-    "    vec2 tex_offset = 1.0 / textureSize(image, 0); // gets size of single "
-    "texel					\n"
-    "    vec3 result = texture(image, TexCoords).rgb * weight[0]; // current "
-    "fragment's contribution	\n"
-    "    if (horizontal)						"
-    "									"
-    "					\n"
-    "    {								"
-    "									"
-    "							\n"
-    "        for (int i = 1; i < WEIGHTS; ++i)				"
-    "									"
-    "			\n"
-    "        {								"
-    "									"
-    "						\n"
-    "            result += texture(image, TexCoords + vec2(tex_offset.x * i, "
-    "0.0)).rgb * weight[i];		\n"
-    "            result += texture(image, TexCoords - vec2(tex_offset.x * i, "
-    "0.0)).rgb * weight[i];		\n"
-    "        }								"
-    "									"
-    "						\n"
-    "    }								"
-    "									"
-    "							\n"
-    "    else								"
-    "									"
-    "						\n"
-    "    {								"
-    "									"
-    "							\n"
-    "        for (int i = 1; i < WEIGHTS; ++i)				"
-    "									"
-    "			\n"
-    "        {								"
-    "									"
-    "						\n"
-    "            result += texture(image, TexCoords + vec2(0.0, tex_offset.y * "
-    "i)).rgb * weight[i];		\n"
-    "            result += texture(image, TexCoords - vec2(0.0, tex_offset.y * "
-    "i)).rgb * weight[i];		\n"
-    "        }								"
-    "									"
-    "						\n"
-    "    }								"
-    "									"
-    "							\n"
-    "    FragColor = vec4(result, 1.0);					"
-    "									"
-    "			\n"
-    "}									"
-    "									"
-    "							\n"
+// Put together by FWGL_makeBlurSource, with the kernel in between
+const char *blurFragmentShaderStart =
+    "#version 330 core                                               \n"
+    "out vec4 FragColor;                                             \n"
+    "                                                                \n"
+    "in vec2 TexCoords;                                              \n"
+    "                                                                \n"
+    "uniform sampler2D image;                                        \n"
+    "uniform bool horizontal;                                        \n"
+    "                                                                \n"
+    "// FWGL_makeBlurSource puts TAPS, offsets[] and weights[] here  \n"
+    "\0";
+
+const char *blurFragmentShaderEnd =
+    "                                                                \n"
+    "void main()                                                     \n"
+    "{                                                               \n"
+    "    vec2 texel = 1.0 / textureSize(image, 0);                   \n"
+    "    vec2 direction = horizontal ? vec2(texel.x, 0) : vec2(0, texel.y);\n"
+    "    vec3 result = texture(image, TexCoords).rgb * weights[0];   \n"
+    "    for (int i = 1; i < TAPS; ++i)                              \n"
+    "    {                                                           \n"
+    "        vec2 offset = direction * offsets[i];                   \n"
+    "        result += texture(image, TexCoords + offset).rgb * weights[i];\n"
+    "        result += texture(image, TexCoords - offset).rgb * weights[i];\n"
+    "    }                                                           \n"
+    "    FragColor = vec4(result, 1.0);                              \n"
+    "}                                                               \n"
+    "\0";
+
+// The same blur as a compute shader, put together by
+// FWGL_makeComputeBlurSource
+const char *computeBlurShaderStart =
+    "#version 430 core                                               \n"
+    "uniform sampler2D image;                                        \n"
+    "layout(rgba16f, binding = 0) uniform writeonly image2D result;  \n"
+    "                                                                \n"
+    "// FWGL_makeComputeBlurSource puts the workgroup size, TILE,    \n"
+    "// RADIUS and weights[] here                                    \n"
+    "\0";
+
+const char *computeBlurShaderEnd =
+    "                                                                \n"
+    "// Each workgroup blurs a TILExTILE tile, reading it and RADIUS \n"
+    "// texels round it into shared memory once, then blurring across\n"
+    "// and down there rather than through another texture           \n"
+    "const int SIDE = TILE + 2 * RADIUS;                             \n"
+    "shared vec3 texels[SIDE][SIDE];                                 \n"
+    "shared vec3 across[SIDE][TILE];                                 \n"
+    "                                                                \n"
+    "void main()                                                     \n"
+    "{                                                               \n"
+    "    ivec2 size = textureSize(image, 0);                         \n"
+    "    ivec2 origin = ivec2(gl_WorkGroupID.xy) * TILE - RADIUS;    \n"
+    "    ivec2 local = ivec2(gl_LocalInvocationID.xy);               \n"
+    "                                                                \n"
+    "    // Clamped at the edges, like the fragment passes' sampler  \n"
+    "    for (int y = local.y; y < SIDE; y += TILE) {                \n"
+    "        for (int x = local.x; x < SIDE; x += TILE) {            \n"
+    "            ivec2 at = clamp(origin + ivec2(x, y), ivec2(0), size - 1);\n"
+    "            texels[y][x] = texelFetch(image, at, 0).rgb;        \n"
+    "        }                                                       \n"
+    "    }                                                           \n"
+    "    barrier();                                                  \n"
+    "                                                                \n"
+    "    // Across every row, including the ones above and below the tile\n"
+    "    int x = local.x + RADIUS;                                   \n"
+    "    for (int y = local.y; y < SIDE; y += TILE) {                \n"
+    "        vec3 sum = texels[y][x] * weights[0];                   \n"
+    "        for (int i = 1; i <= RADIUS; ++i) {                     \n"
+    "            sum += (texels[y][x - i] + texels[y][x + i]) * weights[i];\n"
+    "        }                                                       \n"
+    "        across[y][local.x] = sum;                               \n"
+    "    }                                                           \n"
+    "    barrier();                                                  \n"
+    "                                                                \n"
+    "    int y = local.y + RADIUS;                                   \n"
+    "    vec3 sum = across[y][local.x] * weights[0];                 \n"
+    "    for (int i = 1; i <= RADIUS; ++i) {                         \n"
+    "        sum += (across[y - i][local.x] + across[y + i][local.x]) *\n"
+    "               weights[i];                                      \n"
+    "    }                                                           \n"
+    "    ivec2 pixel = origin + RADIUS + local;                      \n"
+    "    if (all(lessThan(pixel, size))) {                           \n"
+    "        imageStore(result, pixel, vec4(sum, 1.0));              \n"
+    "    }                                                           \n"
+    "}                                                               \n"
+    "\0";
+
+//
+// Bloom mip chain, which reuses the blur vertex shader
+//
+
+const char *downsampleFragmentShaderSource =
+    "#version 330 core                                               \n"
+    "out vec4 FragColor;                                             \n"
+    "                                                                \n"
+    "in vec2 TexCoords;                                              \n"
+    "                                                                \n"
+    "// The level above, or the geometry for the first level         \n"
+    "uniform sampler2D image;                                        \n"
+    "                                                                \n"
+    "// 13 taps in overlapping 2x2 boxes, as in Call of Duty: Advanced\n"
+    "// Warfare, so single bright pixels don't flicker as they move  \n"
+    "void main()                                                     \n"
+    "{                                                               \n"
+    "    vec2 t = 1.0 / textureSize(image, 0);                       \n"
+    "    vec3 a = texture(image, TexCoords + t * vec2(-2,  2)).rgb;  \n"
+    "    vec3 b = texture(image, TexCoords + t * vec2( 0,  2)).rgb;  \n"
+    "    vec3 c = texture(image, TexCoords + t * vec2( 2,  2)).rgb;  \n"
+    "    vec3 d = texture(image, TexCoords + t * vec2(-2,  0)).rgb;  \n"
+    "    vec3 e = texture(image, TexCoords).rgb;                     \n"
+    "    vec3 f = texture(image, TexCoords + t * vec2( 2,  0)).rgb;  \n"
+    "    vec3 g = texture(image, TexCoords + t * vec2(-2, -2)).rgb;  \n"
+    "    vec3 h = texture(image, TexCoords + t * vec2( 0, -2)).rgb;  \n"
+    "    vec3 i = texture(image, TexCoords + t * vec2( 2, -2)).rgb;  \n"
+    "    vec3 j = texture(image, TexCoords + t * vec2(-1,  1)).rgb;  \n"
+    "    vec3 k = texture(image, TexCoords + t * vec2( 1,  1)).rgb;  \n"
+    "    vec3 l = texture(image, TexCoords + t * vec2(-1, -1)).rgb;  \n"
+    "    vec3 m = texture(image, TexCoords + t * vec2( 1, -1)).rgb;  \n"
+    "    vec3 result = e * 0.125;                                    \n"
+    "    result += (a + c + g + i) * 0.03125;                        \n"
+    "    result += (b + d + f + h) * 0.0625;                         \n"
+    "    result += (j + k + l + m) * 0.125;                          \n"
+    "    FragColor = vec4(result, 1.0);                              \n"
+    "}                                                               \n"
+    "\0";
+
+const char *upsampleFragmentShaderSource =
+    "#version 330 core                                               \n"
+    "out vec4 FragColor;                                             \n"
+    "                                                                \n"
+    "in vec2 TexCoords;                                              \n"
+    "                                                                \n"
+    "// The level below, which is blended on top of this one         \n"
+    "uniform sampler2D image;                                        \n"
+    "                                                                \n"
+    "// A 3x3 tent, to smooth out the smaller level's blocky texels  \n"
+    "void main()                                                     \n"
+    "{                                                               \n"
+    "    vec2 t = 1.0 / textureSize(image, 0);                       \n"
+    "    vec3 result = texture(image, TexCoords).rgb * 4.0;          \n"
+    "    result += texture(image, TexCoords + t * vec2(-1,  0)).rgb * 2.0;\n"
+    "    result += texture(image, TexCoords + t * vec2( 1,  0)).rgb * 2.0;\n"
+    "    result += texture(image, TexCoords + t * vec2( 0, -1)).rgb * 2.0;\n"
+    "    result += texture(image, TexCoords + t * vec2( 0,  1)).rgb * 2.0;\n"
+    "    result += texture(image, TexCoords + t * vec2(-1, -1)).rgb; \n"
+    "    result += texture(image, TexCoords + t * vec2( 1, -1)).rgb; \n"
+    "    result += texture(image, TexCoords + t * vec2(-1,  1)).rgb; \n"
+    "    result += texture(image, TexCoords + t * vec2( 1,  1)).rgb; \n"
+    "    FragColor = vec4(result / 16.0, 1.0);                       \n"
+    "}                                                               \n"
     "\0";
 
 //
@@ -252,6 +347,9 @@ const char *bloomFragmentShaderSource =
     "			\n"
     "uniform sampler2D texture1_blur;					"
     "			\n"
+    "// Scales the glow down when it's several levels added up\n"
+    "uniform float bloomStrength;					"
+    "			\n"
     "									"
     "							\n"
     "void main()							"
@@ -268,7 +366,7 @@ const char *bloomFragmentShaderSource =
     "							\n"
     "	// Additive blending						"
     "				\n"
-    "	hdrColor += bloomColor;						"
+    "	hdrColor += bloomColor * bloomStrength;				"
     "				\n"
     "									"
     "							\n"
@@ -286,35 +384,3 @@ const char *bloomFragmentShaderSource =
     "}									"
     "							\n"
     "\0";
-
-//
-// Screen
-//
-
-const char *screenVertexShaderSource =
-    "#version 330 core                                      \n"
-    "layout(location = 0) in vec2 aPos;                     \n"
-    "layout(location = 1) in vec2 aTexCoords;               \n"
-    "                                                       \n"
-    "out vec2 TexCoords;                                    \n"
-    "                                                       \n"
-    "void main()                                            \n"
-    "{                                                      \n"
-    "    gl_Position = vec4(aPos.x, aPos.y, 0.0, 1.0);      \n"
-    "    TexCoords = aTexCoords;                            \n"
-    "}                                                      \n"
-    "\0";
-
-const char *screenFragmentShaderSource =
-    "#version 330 core                                      \n"
-    "out vec4 FragColor;                                    \n"
-    "                                                       \n"
-    "in vec2 TexCoords;                                     \n"
-    "                                                       \n"
-    "uniform sampler2D screenTexture;                       \n"
-    "                                                       \n"
-    "void main()                                            \n"
-    "{                                                      \n"
-    "    FragColor = texture(screenTexture, TexCoords);     \n"
-    "}                                                      \n"
-    "\0";
@@ -0,0 +1,246 @@
+#include "fireworks_gl_smoke.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How quickly the smoke fades and slows down, per second
+#define SMOKE_DENSITY_DECAY 1.2f
+#define SMOKE_VELOCITY_DECAY 1.3f
+// Smoke falls slowly, like haze particles used to
+#define SMOKE_GRAVITY -8.0f
+// Explicit diffusion is only stable while this stays under 0.25 per step
+#define SMOKE_DIFFUSION_RATE 6.0f
+#define SMOKE_DIFFUSION_MAX 0.2f
+// How far injected momentum pulls a cell towards the emitter's velocity
+#define SMOKE_MOMENTUM_BLEND 0.5f
+// Anything fainter or slower than this is flushed to 0. Otherwise decay
+// takes cells into denormals, which are several times slower to work on.
+#define SMOKE_EPSILON 1e-5f
+
+// Rows per job when the grid passes are split between threads
+#define SMOKE_ROWS_PER_JOB 8
+
+struct FWGLSmokeGrid *SmokeGridCreate(int screenWidth, int screenHeight,
+                                      int cellSize) {
+  struct FWGLSmokeGrid *grid = malloc(sizeof(struct FWGLSmokeGrid));
+  grid->cellSize = (float)cellSize;
+  grid->width = (screenWidth + cellSize - 1) / cellSize;
+  grid->height = (screenHeight + cellSize - 1) / cellSize;
+  // The last row and column usually hang off the edge of the screen
+  grid->screenScale[0] = screenWidth / (grid->width * grid->cellSize);
+  grid->screenScale[1] = screenHeight / (grid->height * grid->cellSize);
+
+  int cells = grid->width * grid->height;
+  grid->red = calloc(cells, sizeof(float));
+  grid->green = calloc(cells, sizeof(float));
+  grid->blue = calloc(cells, sizeof(float));
+  grid->velocityX = calloc(cells, sizeof(float));
+  grid->velocityY = calloc(cells, sizeof(float));
+  grid->nextRed = calloc(cells, sizeof(float));
+  grid->nextGreen = calloc(cells, sizeof(float));
+  grid->nextBlue = calloc(cells, sizeof(float));
+  grid->nextVelocityX = calloc(cells, sizeof(float));
+  grid->nextVelocityY = calloc(cells, sizeof(float));
+  grid->pixels = calloc(4 * cells, sizeof(float));
+
+  return grid;
+}
+
+// Everything SmokeGridCreate allocated
+size_t SmokeGridBytes(struct FWGLSmokeGrid *grid) {
+  size_t cells = (size_t)grid->width * grid->height;
+  return sizeof(struct FWGLSmokeGrid) + sizeof(float) * cells * (10 + 4);
+}
+
+void SmokeGridDestroy(struct FWGLSmokeGrid *grid) {
+  if (grid == NULL) {
+    return;
+  }
+
+  free(grid->red);
+  free(grid->green);
+  free(grid->blue);
+  free(grid->velocityX);
+  free(grid->velocityY);
+  free(grid->nextRed);
+  free(grid->nextGreen);
+  free(grid->nextBlue);
+  free(grid->nextVelocityX);
+  free(grid->nextVelocityY);
+  free(grid->pixels);
+  free(grid);
+}
+
+void SmokeGridClear(struct FWGLSmokeGrid *grid) {
+  size_t cells = grid->width * grid->height;
+  memset(grid->red, 0, sizeof(float) * cells);
+  memset(grid->green, 0, sizeof(float) * cells);
+  memset(grid->blue, 0, sizeof(float) * cells);
+  memset(grid->velocityX, 0, sizeof(float) * cells);
+  memset(grid->velocityY, 0, sizeof(float) * cells);
+  memset(grid->pixels, 0, 4 * sizeof(float) * cells);
+}
+
+void SmokeInject(struct FWGLSmokeGrid *grid, float position[3],
+                 float velocity[3], float colour[4], float amount) {
+  // Cell centres sit half a cell in from the corner
+  float gx = position[0] / grid->cellSize - 0.5f;
+  float gy = position[1] / grid->cellSize - 0.5f;
+  int x0 = (int)floorf(gx);
+  int y0 = (int)floorf(gy);
+  float fx = gx - x0;
+  float fy = gy - y0;
+
+  // Splat bilinearly over the four surrounding cells
+  float weights[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy,
+                      fx * fy};
+  int xs[4] = {x0, x0 + 1, x0, x0 + 1};
+  int ys[4] = {y0, y0, y0 + 1, y0 + 1};
+
+  for (int i = 0; i < 4; i++) {
+    if (xs[i] < 0 || xs[i] >= grid->width || ys[i] < 0 ||
+        ys[i] >= grid->height) {
+      continue;
+    }
+
+    int cell = ys[i] * grid->width + xs[i];
+    float w = weights[i] * amount * colour[3];
+    grid->red[cell] += w * colour[0];
+    grid->green[cell] += w * colour[1];
+    grid->blue[cell] += w * colour[2];
+
+    float blend = weights[i] * SMOKE_MOMENTUM_BLEND;
+    grid->velocityX[cell] += (velocity[0] - grid->velocityX[cell]) * blend;
+    grid->velocityY[cell] += (velocity[1] - grid->velocityY[cell]) * blend;
+  }
+}
+
+struct SmokePass {
+  struct FWGLSmokeGrid *grid;
+  float dSecs;
+  float diffusion;
+  float densityDecay;
+  float velocityDecay;
+};
+
+float SmokeSample(const float *field, int width, int x0, int y0, float fx,
+                  float fy) {
+  const float *row0 = field + y0 * width + x0;
+  const float *row1 = row0 + width;
+  float bottom = row0[0] + (row0[1] - row0[0]) * fx;
+  float top = row1[0] + (row1[1] - row1[0]) * fx;
+  return bottom + (top - bottom) * fy;
+}
+
+// Semi-Lagrangian advection: each cell traces its velocity backwards and takes
+// whatever was there last step.
+void SmokeAdvectRows(void *context, int begin, int end) {
+  struct SmokePass *pass = context;
+  struct FWGLSmokeGrid *grid = pass->grid;
+  int w = grid->width;
+  int h = grid->height;
+  float cellsPerPixel = pass->dSecs / grid->cellSize;
+
+  for (int y = begin; y < end; y++) {
+    for (int x = 0; x < w; x++) {
+      int cell = y * w + x;
+
+      float sx = x - grid->velocityX[cell] * cellsPerPixel;
+      float sy = y - grid->velocityY[cell] * cellsPerPixel;
+      sx = fminf(fmaxf(sx, 0), w - 1.001f);
+      sy = fminf(fmaxf(sy, 0), h - 1.001f);
+
+      int x0 = (int)sx;
+      int y0 = (int)sy;
+      float fx = sx - x0;
+      float fy = sy - y0;
+
+      grid->nextRed[cell] = SmokeSample(grid->red, w, x0, y0, fx, fy);
+      grid->nextGreen[cell] = SmokeSample(grid->green, w, x0, y0, fx, fy);
+      grid->nextBlue[cell] = SmokeSample(grid->blue, w, x0, y0, fx, fy);
+      grid->nextVelocityX[cell] =
+          SmokeSample(grid->velocityX, w, x0, y0, fx, fy);
+      grid->nextVelocityY[cell] =
+          SmokeSample(grid->velocityY, w, x0, y0, fx, fy);
+    }
+  }
+}
+
+static inline float SmokeFlush(float value) {
+  return fabsf(value) < SMOKE_EPSILON ? 0 : value;
+}
+
+// One explicit diffusion step over a row, with edges clamped to themselves.
+// The interior loop is branch-free so the compiler can vectorise it.
+void SmokeDiffuseRow(float *restrict out, const float *restrict row,
+                     const float *restrict below, const float *restrict above,
+                     int w, float k, float scale) {
+  out[0] = (row[0] + k * (row[1] + below[0] + above[0] - 3 * row[0])) * scale;
+  for (int x = 1; x < w - 1; x++) {
+    float laplacian = row[x - 1] + row[x + 1] + below[x] + above[x] - 4 * row[x];
+    out[x] = (row[x] + k * laplacian) * scale;
+  }
+  out[w - 1] = (row[w - 1] + k * (row[w - 2] + below[w - 1] + above[w - 1] -
+                                  3 * row[w - 1])) *
+               scale;
+}
+
+void SmokeDiffuseRows(void *context, int begin, int end) {
+  struct SmokePass *pass = context;
+  struct FWGLSmokeGrid *grid = pass->grid;
+  int w = grid->width;
+  int h = grid->height;
+  float k = pass->diffusion;
+  float gravity = SMOKE_GRAVITY * pass->dSecs;
+
+  for (int y = begin; y < end; y++) {
+    int row = y * w;
+    int below = (y > 0 ? y - 1 : y) * w;
+    int above = (y < h - 1 ? y + 1 : y) * w;
+
+    SmokeDiffuseRow(grid->red + row, grid->nextRed + row,
+                    grid->nextRed + below, grid->nextRed + above, w, k,
+                    pass->densityDecay);
+    SmokeDiffuseRow(grid->green + row, grid->nextGreen + row,
+                    grid->nextGreen + below, grid->nextGreen + above, w, k,
+                    pass->densityDecay);
+    SmokeDiffuseRow(grid->blue + row, grid->nextBlue + row,
+                    grid->nextBlue + below, grid->nextBlue + above, w, k,
+                    pass->densityDecay);
+    SmokeDiffuseRow(grid->velocityX + row, grid->nextVelocityX + row,
+                    grid->nextVelocityX + below, grid->nextVelocityX + above,
+                    w, k, pass->velocityDecay);
+    SmokeDiffuseRow(grid->velocityY + row, grid->nextVelocityY + row,
+                    grid->nextVelocityY + below, grid->nextVelocityY + above,
+                    w, k, pass->velocityDecay);
+
+    float *pixels = grid->pixels + 4 * row;
+    for (int x = 0; x < w; x++) {
+      grid->red[row + x] = SmokeFlush(grid->red[row + x]);
+      grid->green[row + x] = SmokeFlush(grid->green[row + x]);
+      grid->blue[row + x] = SmokeFlush(grid->blue[row + x]);
+      grid->velocityX[row + x] = SmokeFlush(grid->velocityX[row + x]);
+      grid->velocityY[row + x] = SmokeFlush(grid->velocityY[row + x]);
+      grid->velocityY[row + x] += gravity;
+      pixels[4 * x + 0] = grid->red[row + x];
+      pixels[4 * x + 1] = grid->green[row + x];
+      pixels[4 * x + 2] = grid->blue[row + x];
+      pixels[4 * x + 3] = 1;
+    }
+  }
+}
+
+void SmokeStep(struct FWGLSmokeGrid *grid, struct FWGLJobs *jobs,
+               float dSecs) {
+  struct SmokePass pass;
+  pass.grid = grid;
+  pass.dSecs = dSecs;
+  pass.diffusion = fminf(SMOKE_DIFFUSION_RATE * dSecs, SMOKE_DIFFUSION_MAX);
+  pass.densityDecay = expf(-SMOKE_DENSITY_DECAY * dSecs);
+  pass.velocityDecay = expf(-SMOKE_VELOCITY_DECAY * dSecs);
+
+  JobsParallelFor(jobs, grid->height, SMOKE_ROWS_PER_JOB, SmokeAdvectRows,
+                  &pass);
+  JobsParallelFor(jobs, grid->height, SMOKE_ROWS_PER_JOB, SmokeDiffuseRows,
+                  &pass);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+
+#include "fireworks_gl_jobs.h"
+
+// Pixels per smoke cell, so 1920x1080 becomes a 240x135 grid
+#define SMOKE_CELL_SIZE 8
+
+// A low resolution density/velocity field which stands in for haze particles.
+// Each quantity is stored as its own row-major array so the per-cell passes
+// are flat loops over floats.
+struct FWGLSmokeGrid {
+  int width;
+  int height;
+  float cellSize;
+  float screenScale[2];
+
+  float *red, *green, *blue;
+  float *velocityX, *velocityY;
+  // Advection can't happen in place, so it writes into these and then
+  // diffusion writes back into the arrays above
+  float *nextRed, *nextGreen, *nextBlue;
+  float *nextVelocityX, *nextVelocityY;
+
+  // Interleaved RGBA copy of the density, ready to upload as a texture
+  float *pixels;
+};
+
+struct FWGLSmokeGrid *SmokeGridCreate(int screenWidth, int screenHeight,
+                                      int cellSize);
+void SmokeGridDestroy(struct FWGLSmokeGrid *grid);
+size_t SmokeGridBytes(struct FWGLSmokeGrid *grid);
+void SmokeGridClear(struct FWGLSmokeGrid *grid);
+void SmokeInject(struct FWGLSmokeGrid *grid, float position[3],
+                 float velocity[3], float colour[4], float amount);
+void SmokeStep(struct FWGLSmokeGrid *grid, struct FWGLJobs *jobs,
+               float dSecs);
@@ -0,0 +1,641 @@
+#include "fireworks_gl_snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fireworks_gl_threads.h"
+
+// The arrays are written straight out of memory, so their layout is the file
+// format. If one of these fails, bump SNAPSHOT_VERSION and fix the sizes.
+_Static_assert(sizeof(int) == 4, "snapshot arrays assume 32 bit ints");
+_Static_assert(sizeof(enum ParticleType) == 4, "particle layout changed");
+_Static_assert(sizeof(struct Particle) == 112, "particle layout changed");
+_Static_assert(sizeof(struct LodEntry) == 8, "LOD entry layout changed");
+_Static_assert(sizeof(struct ParticleHandleSlot) == 8,
+               "handle slot layout changed");
+_Static_assert(sizeof(struct FWGLLaunchScheduler) == 48,
+               "launch scheduler layout changed");
+_Static_assert(sizeof(struct FWGLSnapshotHeader) == 240,
+               "snapshot header layout changed");
+
+int SnapshotHostIsLittleEndian() {
+  uint16_t one = 1;
+  return *(uint8_t *)&one == 1;
+}
+
+uint64_t SnapshotAlign(uint64_t offset) { return (offset + 7) & ~(uint64_t)7; }
+
+int SnapshotSmokeCells(const struct FWGLSnapshotHeader *header) {
+  return header->smokeWidth * header->smokeHeight;
+}
+
+// Fill in everything but the header's size and offsets from the simulation,
+// then work out where everything goes
+void SnapshotLayout(struct FWGLSimulation *simulation,
+                    struct FWGLSnapshotHeader *header) {
+  memset(header, 0, sizeof(struct FWGLSnapshotHeader));
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->version = SNAPSHOT_VERSION;
+  header->headerSize = sizeof(struct FWGLSnapshotHeader);
+
+  header->maxParticles = simulation->maxParticles;
+  header->capacity = simulation->capacity;
+  header->liveParticles = simulation->liveParticles;
+  header->maxRockets = simulation->maxRockets;
+  header->liveRockets = simulation->liveRockets;
+  header->freeCount = simulation->freeCount;
+  header->handleCapacity = simulation->handleCapacity;
+  header->freeHandleCount = simulation->freeHandleCount;
+  for (int tier = 0; tier < LOD_TIERS; tier++) {
+    header->lodCounts[tier] = simulation->lodCounts[tier];
+    header->lodStale[tier] = simulation->lodStale[tier];
+  }
+  header->nextParticleId = simulation->nextParticleId;
+  header->tick = simulation->tick;
+  header->quietTime = simulation->quietTime;
+  header->timeSinceRocketCount = simulation->timeSinceRocketCount;
+  header->time = simulation->time;
+  header->randomState = simulation->randomState;
+  header->launcher = simulation->launcher;
+  if (simulation->smoke != NULL) {
+    header->smokeWidth = simulation->smoke->width;
+    header->smokeHeight = simulation->smoke->height;
+  }
+
+  uint64_t at = sizeof(struct FWGLSnapshotHeader);
+  header->particlesOffset = at;
+  at = SnapshotAlign(at +
+                     sizeof(struct Particle) * (uint64_t)header->capacity);
+  header->freeListOffset = at;
+  at = SnapshotAlign(at + sizeof(int) * (uint64_t)header->freeCount);
+  header->handlesOffset = at;
+  at = SnapshotAlign(at + sizeof(struct ParticleHandleSlot) *
+                              (uint64_t)header->handleCapacity);
+  header->freeHandlesOffset = at;
+  at = SnapshotAlign(at + sizeof(int) * (uint64_t)header->freeHandleCount);
+  for (int tier = 0; tier < LOD_TIERS; tier++) {
+    header->lodOffsets[tier] = at;
+    at = SnapshotAlign(at + sizeof(struct LodEntry) *
+                                (uint64_t)header->lodCounts[tier]);
+  }
+  header->smokeOffset = at;
+  at = SnapshotAlign(at + 5 * sizeof(float) *
+                              (uint64_t)SnapshotSmokeCells(header));
+  header->size = at;
+}
+
+size_t SnapshotSize(struct FWGLSimulation *simulation) {
+  struct FWGLSnapshotHeader header;
+  SnapshotLayout(simulation, &header);
+  return (size_t)header.size;
+}
+
+// Send one array, then zeroes up to where the next one starts
+int SnapshotEmitArray(SnapshotSink sink, void *context, uint64_t *at,
+                      uint64_t offset, const void *data, size_t size) {
+  static const char zeroes[8] = {0};
+  if (*at < offset && !sink(context, zeroes, (size_t)(offset - *at))) {
+    return 0;
+  }
+  *at = offset + size;
+  return size == 0 || sink(context, data, size);
+}
+
+// Stream the snapshot out piece by piece, so nothing has to be copied into
+// one big buffer first
+int SnapshotEmit(struct FWGLSimulation *simulation, SnapshotSink sink,
+                 void *context) {
+  if (!SnapshotHostIsLittleEndian()) {
+    SimulationLog(simulation, "Snapshots are little-endian only\n");
+    return 0;
+  }
+
+  struct FWGLSnapshotHeader header;
+  SnapshotLayout(simulation, &header);
+  uint64_t at = 0;
+  if (!SnapshotEmitArray(sink, context, &at, 0, &header, sizeof(header))) {
+    return 0;
+  }
+
+  // The pool is in chunks, but they add up to one array
+  for (int c = 0; c < simulation->chunkCount; c++) {
+    int count = simulation->capacity - c * PARTICLE_CHUNK_SIZE;
+    if (count > PARTICLE_CHUNK_SIZE) {
+      count = PARTICLE_CHUNK_SIZE;
+    }
+    if (!SnapshotEmitArray(
+            sink, context, &at,
+            header.particlesOffset +
+                sizeof(struct Particle) * (uint64_t)c * PARTICLE_CHUNK_SIZE,
+            simulation->chunks[c], sizeof(struct Particle) * count)) {
+      return 0;
+    }
+  }
+
+  int ok =
+      SnapshotEmitArray(sink, context, &at, header.freeListOffset,
+                        simulation->freeList, sizeof(int) * header.freeCount) &&
+      SnapshotEmitArray(sink, context, &at, header.handlesOffset,
+                        simulation->handles,
+                        sizeof(struct ParticleHandleSlot) *
+                            header.handleCapacity) &&
+      SnapshotEmitArray(sink, context, &at, header.freeHandlesOffset,
+                        simulation->freeHandles,
+                        sizeof(int) * header.freeHandleCount);
+  for (int tier = 0; ok && tier < LOD_TIERS; tier++) {
+    ok = SnapshotEmitArray(sink, context, &at, header.lodOffsets[tier],
+                           simulation->lodLists[tier],
+                           sizeof(struct LodEntry) * header.lodCounts[tier]);
+  }
+
+  if (ok && simulation->smoke != NULL) {
+    struct FWGLSmokeGrid *smoke = simulation->smoke;
+    float *fields[] = {smoke->red, smoke->green, smoke->blue, smoke->velocityX,
+                       smoke->velocityY};
+    size_t fieldSize = sizeof(float) * SnapshotSmokeCells(&header);
+    for (int f = 0; ok && f < 5; f++) {
+      ok = SnapshotEmitArray(sink, context, &at,
+                             header.smokeOffset + f * fieldSize, fields[f],
+                             fieldSize);
+    }
+  }
+
+  // Pad out the end
+  return ok && SnapshotEmitArray(sink, context, &at, header.size, NULL, 0);
+}
+
+struct SnapshotBuffer {
+  char *data;
+  size_t size;
+  size_t used;
+};
+
+int SnapshotBufferSink(void *context, const void *data, size_t size) {
+  struct SnapshotBuffer *buffer = context;
+  if (buffer->used + size > buffer->size) {
+    return 0;
+  }
+  memcpy(buffer->data + buffer->used, data, size);
+  buffer->used += size;
+  return 1;
+}
+
+int SnapshotFileSink(void *context, const void *data, size_t size) {
+  return fwrite(data, 1, size, context) == size;
+}
+
+// Returns how much was written, or 0 if it didn't fit
+size_t SnapshotWrite(struct FWGLSimulation *simulation, void *buffer,
+                     size_t size) {
+  struct SnapshotBuffer sink = {buffer, size, 0};
+  if (!SnapshotEmit(simulation, SnapshotBufferSink, &sink)) {
+    return 0;
+  }
+  return sink.used;
+}
+
+// Snapshots are written next to where they're going and then renamed over
+// it, so a crash halfway through never leaves a torn one to resume from
+char *SnapshotTemporaryPath(const char *path) {
+  size_t length = strlen(path);
+  char *temporary = malloc(length + sizeof(".tmp"));
+  memcpy(temporary, path, length);
+  memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+  return temporary;
+}
+
+int SnapshotReplaceFile(const char *temporary, const char *path) {
+  if (rename(temporary, path) == 0) {
+    return 1;
+  }
+  // Windows won't rename over a file that's already there
+  remove(path);
+  return rename(temporary, path) == 0;
+}
+
+int SnapshotSave(struct FWGLSimulation *simulation, const char *path) {
+  char *temporary = SnapshotTemporaryPath(path);
+  FILE *file = fopen(temporary, "wb");
+  if (file == NULL) {
+    SimulationLog(simulation, "Couldn't open %s to save a snapshot\n",
+                  temporary);
+    free(temporary);
+    return 0;
+  }
+
+  int ok = SnapshotEmit(simulation, SnapshotFileSink, file);
+  ok = fclose(file) == 0 && ok;
+  ok = ok && SnapshotReplaceFile(temporary, path);
+  if (!ok) {
+    SimulationLog(simulation, "Couldn't write a snapshot to %s\n", path);
+    remove(temporary);
+  }
+  free(temporary);
+  return ok;
+}
+
+//
+// Writer
+//
+
+struct SnapshotData {
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+struct FWGLSnapshotWriter {
+  char *path;
+  char *temporary;
+  FWGLThread thread;
+  FWGLMutex lock;
+  FWGLCond wake;
+  int quit;
+
+  // Guarded by lock. Only the newest snapshot matters, so one waiting here is
+  // just replaced if the writer thread hasn't got to it yet.
+  struct SnapshotData pending;
+  int ready;
+
+  // Only touched by the frame loop
+  struct SnapshotData staging;
+
+  // Only touched by the writer thread
+  struct SnapshotData work;
+};
+
+void SnapshotWriterWrite(struct FWGLSnapshotWriter *writer) {
+  FILE *file = fopen(writer->temporary, "wb");
+  if (file == NULL) {
+    printf("Couldn't open %s to save a snapshot\n", writer->temporary);
+    return;
+  }
+
+  int ok = fwrite(writer->work.data, 1, writer->work.size, file) ==
+           writer->work.size;
+  ok = fclose(file) == 0 && ok;
+  ok = ok && SnapshotReplaceFile(writer->temporary, writer->path);
+  if (!ok) {
+    printf("Couldn't write a snapshot to %s\n", writer->path);
+    remove(writer->temporary);
+  }
+}
+
+int SnapshotWriterThread(void *arg) {
+  struct FWGLSnapshotWriter *writer = arg;
+
+  MutexLock(&(writer->lock));
+  while (1) {
+    while (!writer->ready && !writer->quit) {
+      CondWait(&(writer->wake), &(writer->lock));
+    }
+    if (!writer->ready) {
+      break;
+    }
+
+    struct SnapshotData data = writer->pending;
+    writer->pending = writer->work;
+    writer->work = data;
+    writer->ready = 0;
+    MutexUnlock(&(writer->lock));
+
+    SnapshotWriterWrite(writer);
+    MutexLock(&(writer->lock));
+  }
+  MutexUnlock(&(writer->lock));
+
+  return 0;
+}
+
+struct FWGLSnapshotWriter *SnapshotWriterOpen(const char *path) {
+  struct FWGLSnapshotWriter *writer =
+      calloc(1, sizeof(struct FWGLSnapshotWriter));
+  size_t length = strlen(path) + 1;
+  writer->path = malloc(length);
+  memcpy(writer->path, path, length);
+  writer->temporary = SnapshotTemporaryPath(path);
+  MutexInit(&(writer->lock));
+  CondInit(&(writer->wake));
+  if (!ThreadCreate(&(writer->thread), SnapshotWriterThread, writer)) {
+    printf("Couldn't start the snapshot writer\n");
+    CondDestroy(&(writer->wake));
+    MutexDestroy(&(writer->lock));
+    free(writer->temporary);
+    free(writer->path);
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+// Copy the simulation out and hand it to the writer thread, so the frame loop
+// only pays for a memcpy rather than the whole write
+void SnapshotWriterSave(struct FWGLSnapshotWriter *writer,
+                        struct FWGLSimulation *simulation) {
+  struct SnapshotData *staging = &(writer->staging);
+  size_t size = SnapshotSize(simulation);
+  if (size > staging->capacity) {
+    char *data = realloc(staging->data, size);
+    if (data == NULL) {
+      return;
+    }
+    staging->data = data;
+    staging->capacity = size;
+  }
+  staging->size = SnapshotWrite(simulation, staging->data, size);
+  if (staging->size == 0) {
+    return;
+  }
+
+  MutexLock(&(writer->lock));
+  struct SnapshotData pending = writer->pending;
+  writer->pending = *staging;
+  *staging = pending;
+  writer->ready = 1;
+  CondSignal(&(writer->wake));
+  MutexUnlock(&(writer->lock));
+}
+
+// Waits for the last snapshot handed over to be written
+void SnapshotWriterClose(struct FWGLSnapshotWriter *writer) {
+  if (writer == NULL) {
+    return;
+  }
+
+  MutexLock(&(writer->lock));
+  writer->quit = 1;
+  CondSignal(&(writer->wake));
+  MutexUnlock(&(writer->lock));
+  ThreadJoin(writer->thread);
+
+  free(writer->pending.data);
+  free(writer->staging.data);
+  free(writer->work.data);
+  CondDestroy(&(writer->wake));
+  MutexDestroy(&(writer->lock));
+  free(writer->temporary);
+  free(writer->path);
+  free(writer);
+}
+
+int SnapshotArrayFits(const struct FWGLSnapshotHeader *header, uint64_t offset,
+                      int32_t count, size_t elementSize) {
+  return count >= 0 && offset >= header->headerSize && offset % 8 == 0 &&
+         offset + elementSize * (uint64_t)count <= header->size;
+}
+
+// The header, if data holds a whole snapshot this build can read, or NULL.
+// Everything it points at stays in data, so it can be a mapped file.
+const struct FWGLSnapshotHeader *SnapshotView(const void *data, size_t size) {
+  const struct FWGLSnapshotHeader *header = data;
+  if (!SnapshotHostIsLittleEndian() || size < sizeof(*header) ||
+      (uintptr_t)data % 8 != 0 ||
+      memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SNAPSHOT_VERSION ||
+      header->headerSize != sizeof(*header) || header->size > size) {
+    return NULL;
+  }
+
+  if (header->capacity < 0 || header->capacity > header->maxParticles ||
+      header->maxParticles > (int32_t)PARTICLE_HANDLE_SLOT_MASK ||
+      header->freeCount > header->capacity ||
+      header->handleCapacity < header->capacity ||
+      header->handleCapacity > (int32_t)PARTICLE_HANDLE_SLOT_MASK ||
+      header->freeHandleCount > header->handleCapacity ||
+      header->smokeWidth < 0 || header->smokeHeight < 0) {
+    return NULL;
+  }
+
+  int fits =
+      SnapshotArrayFits(header, header->particlesOffset, header->capacity,
+                        sizeof(struct Particle)) &&
+      SnapshotArrayFits(header, header->freeListOffset, header->freeCount,
+                        sizeof(int)) &&
+      SnapshotArrayFits(header, header->handlesOffset, header->handleCapacity,
+                        sizeof(struct ParticleHandleSlot)) &&
+      SnapshotArrayFits(header, header->freeHandlesOffset,
+                        header->freeHandleCount, sizeof(int)) &&
+      SnapshotArrayFits(header, header->smokeOffset,
+                        SnapshotSmokeCells(header), 5 * sizeof(float));
+  for (int tier = 0; fits && tier < LOD_TIERS; tier++) {
+    fits = SnapshotArrayFits(header, header->lodOffsets[tier],
+                             header->lodCounts[tier], sizeof(struct LodEntry));
+  }
+  return fits ? header : NULL;
+}
+
+const struct Particle *
+SnapshotParticles(const struct FWGLSnapshotHeader *header) {
+  return (const struct Particle *)((const char *)header +
+                                   header->particlesOffset);
+}
+
+// Make sure nothing in the index arrays points outside the pool, or a bad
+// snapshot would crash the simulation rather than just fail to load
+int SnapshotIndicesValid(const struct FWGLSnapshotHeader *header) {
+  const char *base = (const char *)header;
+  const int *freeList = (const int *)(base + header->freeListOffset);
+  const struct ParticleHandleSlot *handles =
+      (const struct ParticleHandleSlot *)(base + header->handlesOffset);
+  const int *freeHandles = (const int *)(base + header->freeHandlesOffset);
+  const struct Particle *particles = SnapshotParticles(header);
+
+  for (int i = 0; i < header->freeCount; i++) {
+    if (freeList[i] < 0 || freeList[i] >= header->capacity) {
+      return 0;
+    }
+  }
+  for (int h = 0; h < header->handleCapacity; h++) {
+    if (handles[h].particle < -1 || handles[h].particle >= header->capacity) {
+      return 0;
+    }
+  }
+  for (int h = 0; h < header->freeHandleCount; h++) {
+    if (freeHandles[h] < 0 || freeHandles[h] >= header->handleCapacity) {
+      return 0;
+    }
+  }
+  for (int tier = 0; tier < LOD_TIERS; tier++) {
+    const struct LodEntry *lod =
+        (const struct LodEntry *)(base + header->lodOffsets[tier]);
+    for (int i = 0; i < header->lodCounts[tier]; i++) {
+      if (lod[i].particle < 0 || lod[i].particle >= header->capacity ||
+          (int)(lod[i].handle & PARTICLE_HANDLE_SLOT_MASK) >=
+              header->handleCapacity) {
+        return 0;
+      }
+    }
+  }
+  for (int i = 0; i < header->capacity; i++) {
+    const struct Particle *p = &(particles[i]);
+    if (!p->isAlive) {
+      continue;
+    }
+    if ((int)(p->handle & PARTICLE_HANDLE_SLOT_MASK) >=
+            header->handleCapacity ||
+        p->lodTier < 0 || p->lodTier >= LOD_TIERS) {
+      return 0;
+    }
+    if (p->lodSlot < 0 || p->lodSlot >= header->lodCounts[p->lodTier]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Replace the simulation's state with a snapshot's. Its log, jobs pool, smoke
+// grid and timeline are kept (the timeline carries on from where it was), and
+// the smoke is only restored if the grid is the same size as the one in the
+// snapshot.
+int SnapshotRestore(struct FWGLSimulation *simulation, const void *data,
+                    size_t size) {
+  const struct FWGLSnapshotHeader *header = SnapshotView(data, size);
+  if (header == NULL || !SnapshotIndicesValid(header)) {
+    SimulationLog(simulation, "Not a snapshot this version can restore\n");
+    return 0;
+  }
+  const char *base = data;
+
+  ParticlePoolFree(simulation);
+
+  simulation->maxParticles = header->maxParticles;
+  simulation->capacity = header->capacity;
+  simulation->liveParticles = header->liveParticles;
+  simulation->maxRockets = header->maxRockets;
+  simulation->liveRockets = header->liveRockets;
+
+  // Same shape as ParticlePoolGrow would have left it
+  int maxChunks =
+      (header->maxParticles + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+  simulation->chunks = malloc(sizeof(struct Particle *) * (maxChunks + 1));
+  simulation->chunkCount =
+      (header->capacity + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+  const struct Particle *particles = SnapshotParticles(header);
+  for (int c = 0; c < simulation->chunkCount; c++) {
+    simulation->chunks[c] =
+        calloc(PARTICLE_CHUNK_SIZE, sizeof(struct Particle));
+    int count = header->capacity - c * PARTICLE_CHUNK_SIZE;
+    if (count > PARTICLE_CHUNK_SIZE) {
+      count = PARTICLE_CHUNK_SIZE;
+    }
+    memcpy(simulation->chunks[c], particles + c * PARTICLE_CHUNK_SIZE,
+           sizeof(struct Particle) * count);
+  }
+
+  simulation->freeCount = header->freeCount;
+  simulation->freeList = malloc(sizeof(int) * (header->capacity + 1));
+  memcpy(simulation->freeList, base + header->freeListOffset,
+         sizeof(int) * header->freeCount);
+
+  simulation->handleCapacity = header->handleCapacity;
+  simulation->handles =
+      malloc(sizeof(struct ParticleHandleSlot) * (header->handleCapacity + 1));
+  memcpy(simulation->handles, base + header->handlesOffset,
+         sizeof(struct ParticleHandleSlot) * header->handleCapacity);
+  simulation->freeHandleCount = header->freeHandleCount;
+  simulation->freeHandles = malloc(sizeof(int) * (header->handleCapacity + 1));
+  memcpy(simulation->freeHandles, base + header->freeHandlesOffset,
+         sizeof(int) * header->freeHandleCount);
+
+  for (int tier = 0; tier < LOD_TIERS; tier++) {
+    int count = header->lodCounts[tier];
+    int capacity = 64;
+    while (capacity < count) {
+      capacity *= 2;
+    }
+    simulation->lodLists[tier] = malloc(sizeof(struct LodEntry) * capacity);
+    memcpy(simulation->lodLists[tier], base + header->lodOffsets[tier],
+           sizeof(struct LodEntry) * count);
+    simulation->lodCounts[tier] = count;
+    simulation->lodCapacities[tier] = capacity;
+    simulation->lodStale[tier] = header->lodStale[tier];
+  }
+
+  simulation->nextParticleId = header->nextParticleId;
+  simulation->tick = header->tick;
+  simulation->quietTime = header->quietTime;
+  simulation->timeSinceRocketCount = header->timeSinceRocketCount;
+  simulation->time = header->time;
+  simulation->randomState = header->randomState;
+  simulation->launcher = header->launcher;
+
+  struct FWGLSmokeGrid *smoke = simulation->smoke;
+  if (smoke != NULL) {
+    SmokeGridClear(smoke);
+    if (smoke->width == header->smokeWidth &&
+        smoke->height == header->smokeHeight) {
+      float *fields[] = {smoke->red, smoke->green, smoke->blue,
+                         smoke->velocityX, smoke->velocityY};
+      size_t fieldSize = sizeof(float) * SnapshotSmokeCells(header);
+      for (int f = 0; f < 5; f++) {
+        memcpy(fields[f], base + header->smokeOffset + f * fieldSize,
+               fieldSize);
+      }
+    } else if (header->smokeWidth > 0) {
+      SimulationLog(simulation,
+                    "Snapshot smoke is %dx%d but the grid is %dx%d, so it "
+                    "starts clear\n",
+                    header->smokeWidth, header->smokeHeight, smoke->width,
+                    smoke->height);
+    }
+  }
+
+  SimulationLog(simulation, "Restored a snapshot at %.2fs, %d particles\n",
+                simulation->time, simulation->liveParticles);
+  return 1;
+}
+
+// Whether a snapshot was taken of the same kind of show as the simulation is
+// set up for. Restoring puts back its ceilings and launcher too, so resuming
+// one saved without /finale, say, would quietly undo /finale for good.
+int SnapshotMatchesShow(struct FWGLSimulation *simulation,
+                        const struct FWGLSnapshotHeader *header) {
+  const struct FWGLLaunchScheduler *saved = &(header->launcher);
+  const struct FWGLLaunchScheduler *launcher = &(simulation->launcher);
+  if (header->maxParticles != simulation->maxParticles ||
+      header->maxRockets != simulation->maxRockets) {
+    SimulationLog(simulation,
+                  "Snapshot is for %d particles and %d rockets, not %d and "
+                  "%d, so starting afresh\n",
+                  header->maxParticles, header->maxRockets,
+                  simulation->maxParticles, simulation->maxRockets);
+    return 0;
+  }
+  if (saved->launchRate != launcher->launchRate ||
+      saved->salvoInterval != launcher->salvoInterval ||
+      saved->salvoSize != launcher->salvoSize ||
+      saved->finaleInterval != launcher->finaleInterval ||
+      saved->finaleDuration != launcher->finaleDuration ||
+      saved->finaleRate != launcher->finaleRate) {
+    SimulationLog(simulation, "Snapshot launches rockets differently, so "
+                              "starting afresh\n");
+    return 0;
+  }
+  return 1;
+}
+
+// Snapshots are flat, so this could just as well map the file. Reading it
+// keeps things the same on every platform, and it's only done at startup.
+// Unlike SnapshotRestore, it turns down a snapshot of a different show.
+int SnapshotLoad(struct FWGLSimulation *simulation, const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    SimulationLog(simulation, "Couldn't open snapshot %s\n", path);
+    return 0;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  // malloc is suitably aligned for the 8 byte fields
+  void *data = size > 0 ? malloc(size) : NULL;
+  int ok = data != NULL && fread(data, 1, size, file) == (size_t)size;
+  fclose(file);
+
+  const struct FWGLSnapshotHeader *header =
+      ok ? SnapshotView(data, size) : NULL;
+  ok = ok && (header == NULL || SnapshotMatchesShow(simulation, header)) &&
+       SnapshotRestore(simulation, data, size);
+  free(data);
+  return ok;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fireworks_gl_process.h"
+
+// Bumped whenever the layout below, or struct Particle, changes
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAGIC "FWGLSNAP"
+
+// A snapshot is this header followed by the simulation's arrays, exactly as
+// they are in memory, each starting on an 8 byte boundary. Everything is
+// little-endian with fixed sizes, so a snapshot can be mapped and read in
+// place (see SnapshotView) without parsing anything.
+//
+//     header | particles[capacity] | freeList[freeCount]
+//            | handles[handleCapacity] | freeHandles[freeHandleCount]
+//            | lodLists[tier][lodCounts[tier]] for each tier
+//            | smoke red, green, blue, velocityX, velocityY (if any)
+struct FWGLSnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  // Of the whole snapshot
+  uint64_t size;
+
+  int32_t maxParticles;
+  int32_t capacity;
+  int32_t liveParticles;
+  int32_t maxRockets;
+  int32_t liveRockets;
+  int32_t freeCount;
+  int32_t handleCapacity;
+  int32_t freeHandleCount;
+  int32_t lodCounts[LOD_TIERS];
+  int32_t lodStale[LOD_TIERS];
+
+  uint32_t nextParticleId;
+  uint32_t tick;
+  float quietTime;
+  float timeSinceRocketCount;
+  double time;
+  uint64_t randomState;
+  struct FWGLLaunchScheduler launcher;
+
+  // Zero if the simulation had no smoke grid
+  int32_t smokeWidth;
+  int32_t smokeHeight;
+  int32_t reserved[2];
+
+  // From the start of the snapshot
+  uint64_t particlesOffset;
+  uint64_t freeListOffset;
+  uint64_t handlesOffset;
+  uint64_t freeHandlesOffset;
+  uint64_t lodOffsets[LOD_TIERS];
+  uint64_t smokeOffset;
+};
+
+// Writes part of a snapshot somewhere, returning 0 if it couldn't
+typedef int (*SnapshotSink)(void *context, const void *data, size_t size);
+
+size_t SnapshotSize(struct FWGLSimulation *simulation);
+int SnapshotEmit(struct FWGLSimulation *simulation, SnapshotSink sink,
+                 void *context);
+size_t SnapshotWrite(struct FWGLSimulation *simulation, void *buffer,
+                     size_t size);
+int SnapshotSave(struct FWGLSimulation *simulation, const char *path);
+
+struct FWGLSnapshotWriter;
+
+struct FWGLSnapshotWriter *SnapshotWriterOpen(const char *path);
+void SnapshotWriterSave(struct FWGLSnapshotWriter *writer,
+                        struct FWGLSimulation *simulation);
+void SnapshotWriterClose(struct FWGLSnapshotWriter *writer);
+
+const struct FWGLSnapshotHeader *SnapshotView(const void *data, size_t size);
+const struct Particle *
+SnapshotParticles(const struct FWGLSnapshotHeader *header);
+int SnapshotRestore(struct FWGLSimulation *simulation, const void *data,
+                    size_t size);
+int SnapshotLoad(struct FWGLSimulation *simulation, const char *path);
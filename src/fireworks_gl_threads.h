@@ -0,0 +1,142 @@
+#pragma once
+#include <stdlib.h>
+
+// Just enough threads, mutexes and condition variables for the worker pool
+// and the background writers. C11's <threads.h> would do, but MinGW-w64 and
+// MSVC before 17.8 don't ship it, so this goes straight to Win32 or pthreads.
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <process.h>
+#include <windows.h>
+
+typedef HANDLE FWGLThread;
+typedef CRITICAL_SECTION FWGLMutex;
+typedef CONDITION_VARIABLE FWGLCond;
+#else
+#include <pthread.h>
+
+typedef pthread_t FWGLThread;
+typedef pthread_mutex_t FWGLMutex;
+typedef pthread_cond_t FWGLCond;
+#endif
+
+typedef int (*ThreadFunction)(void *arg);
+
+struct ThreadStart {
+  ThreadFunction function;
+  void *arg;
+};
+
+#ifdef _WIN32
+static inline unsigned __stdcall ThreadEntry(void *arg) {
+#else
+static inline void *ThreadEntry(void *arg) {
+#endif
+  struct ThreadStart start = *(struct ThreadStart *)arg;
+  free(arg);
+  start.function(start.arg);
+  return 0;
+}
+
+// Returns 0 if the thread couldn't be started
+static inline int ThreadCreate(FWGLThread *thread, ThreadFunction function,
+                               void *arg) {
+  struct ThreadStart *start = malloc(sizeof(struct ThreadStart));
+  start->function = function;
+  start->arg = arg;
+#ifdef _WIN32
+  *thread = (HANDLE)_beginthreadex(NULL, 0, ThreadEntry, start, 0, NULL);
+  if (*thread == 0) {
+#else
+  if (pthread_create(thread, NULL, ThreadEntry, start) != 0) {
+#endif
+    free(start);
+    return 0;
+  }
+  return 1;
+}
+
+static inline void ThreadJoin(FWGLThread thread) {
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+static inline void MutexInit(FWGLMutex *mutex) {
+#ifdef _WIN32
+  InitializeCriticalSection(mutex);
+#else
+  pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+static inline void MutexDestroy(FWGLMutex *mutex) {
+#ifdef _WIN32
+  DeleteCriticalSection(mutex);
+#else
+  pthread_mutex_destroy(mutex);
+#endif
+}
+
+static inline void MutexLock(FWGLMutex *mutex) {
+#ifdef _WIN32
+  EnterCriticalSection(mutex);
+#else
+  pthread_mutex_lock(mutex);
+#endif
+}
+
+static inline void MutexUnlock(FWGLMutex *mutex) {
+#ifdef _WIN32
+  LeaveCriticalSection(mutex);
+#else
+  pthread_mutex_unlock(mutex);
+#endif
+}
+
+static inline void CondInit(FWGLCond *cond) {
+#ifdef _WIN32
+  InitializeConditionVariable(cond);
+#else
+  pthread_cond_init(cond, NULL);
+#endif
+}
+
+// Win32 condition variables don't need destroying
+static inline void CondDestroy(FWGLCond *cond) {
+#ifdef _WIN32
+  (void)cond;
+#else
+  pthread_cond_destroy(cond);
+#endif
+}
+
+static inline void CondWait(FWGLCond *cond, FWGLMutex *mutex) {
+#ifdef _WIN32
+  SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+  pthread_cond_wait(cond, mutex);
+#endif
+}
+
+static inline void CondSignal(FWGLCond *cond) {
+#ifdef _WIN32
+  WakeConditionVariable(cond);
+#else
+  pthread_cond_signal(cond);
+#endif
+}
+
+static inline void CondBroadcast(FWGLCond *cond) {
+#ifdef _WIN32
+  WakeAllConditionVariable(cond);
+#else
+  pthread_cond_broadcast(cond);
+#endif
+}
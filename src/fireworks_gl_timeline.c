@@ -0,0 +1,255 @@
+#include "fireworks_gl_timeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A burst this big would be a bug in the timeline rather than a choice
+#define TIMELINE_MAX_CHILDREN 1000
+
+// Lets events at the same time keep the order they were written in, which
+// qsort doesn't promise
+struct TimelineSortEntry {
+  struct FWGLTimelineEvent event;
+  int order;
+};
+
+int CompareTimelineEntries(const void *a, const void *b) {
+  const struct TimelineSortEntry *x = a;
+  const struct TimelineSortEntry *y = b;
+  if (x->event.time != y->event.time) {
+    return x->event.time < y->event.time ? -1 : 1;
+  }
+  return x->order - y->order;
+}
+
+// Sorts the events by time, once, so the simulation only ever has to look at
+// the next one
+void TimelineSort(struct FWGLTimeline *timeline) {
+  struct TimelineSortEntry *entries =
+      malloc(sizeof(struct TimelineSortEntry) * (timeline->count + 1));
+  for (int i = 0; i < timeline->count; i++) {
+    entries[i].event = timeline->events[i];
+    entries[i].order = i;
+  }
+  qsort(entries, timeline->count, sizeof(struct TimelineSortEntry),
+        CompareTimelineEntries);
+  for (int i = 0; i < timeline->count; i++) {
+    timeline->events[i] = entries[i].event;
+  }
+  free(entries);
+}
+
+struct FWGLTimelineEvent *TimelineAppend(struct FWGLTimeline *timeline,
+                                         int *capacity) {
+  if (timeline->count == *capacity) {
+    *capacity = *capacity > 0 ? *capacity * 2 : 256;
+    timeline->events = realloc(timeline->events,
+                               sizeof(struct FWGLTimelineEvent) * *capacity);
+  }
+  return &(timeline->events[timeline->count++]);
+}
+
+int TimelineParseLine(struct FWGLTimeline *timeline, int *capacity,
+                      char *line) {
+  char *comment = strchr(line, '#');
+  if (comment != NULL) {
+    *comment = '\0';
+  }
+
+  char word[32];
+  if (sscanf(line, " %31s", word) != 1) {
+    return 1;
+  }
+  if (strcmp(word, "loop") == 0) {
+    return sscanf(line, " loop %f", &(timeline->period)) == 1 &&
+           timeline->period > 0;
+  }
+
+  struct FWGLTimelineEvent event;
+  char burst[32];
+  int splitter;
+  event.fuse = 0;
+  int fields = sscanf(line, "%f %f %f %f %f %f %f %f %31s %d %d %f",
+                      &(event.time), &(event.position[0]),
+                      &(event.position[1]), &(event.velocity[0]),
+                      &(event.velocity[1]), &(event.colour[0]),
+                      &(event.colour[1]), &(event.colour[2]), burst,
+                      &splitter, &(event.children), &(event.fuse));
+  if (fields < 11) {
+    return 0;
+  }
+
+  event.burst = BurstTemplateByName(burst);
+  if (event.burst < 0 || event.time < 0 || event.children < 0 ||
+      event.children > TIMELINE_MAX_CHILDREN || event.fuse < 0) {
+    return 0;
+  }
+  if (splitter) {
+    event.burst |= BURST_SPLITTER;
+  }
+
+  *TimelineAppend(timeline, capacity) = event;
+  return 1;
+}
+
+// Takes text apart in place. The name is only for error messages.
+int TimelineParse(struct FWGLTimeline *timeline, char *text, const char *name) {
+  memset(timeline, 0, sizeof(struct FWGLTimeline));
+  int capacity = 0;
+
+  int lineNumber = 1;
+  char *line = text;
+  while (line != NULL) {
+    char *next = strchr(line, '\n');
+    if (next != NULL) {
+      *next++ = '\0';
+    }
+
+    if (!TimelineParseLine(timeline, &capacity, line)) {
+      printf("%s:%d: can't make sense of this line\n", name, lineNumber);
+      TimelineFree(timeline);
+      return 0;
+    }
+    line = next;
+    lineNumber++;
+  }
+
+  TimelineSort(timeline);
+  if (timeline->period > 0 && timeline->count > 0 &&
+      timeline->events[timeline->count - 1].time >= timeline->period) {
+    printf("%s: loops before its last rocket goes up\n", name);
+    TimelineFree(timeline);
+    return 0;
+  }
+  return 1;
+}
+
+int TimelineLoad(struct FWGLTimeline *timeline, const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    printf("Couldn't open timeline %s\n", path);
+    return 0;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *text = malloc(size + 1);
+  size_t read = fread(text, 1, size, file);
+  fclose(file);
+  text[read] = '\0';
+
+  int ok = TimelineParse(timeline, text, path);
+  free(text);
+  return ok;
+}
+
+struct TimelinePhase {
+  float start;
+  float end;
+  // Rockets per second
+  float rate;
+  int minChildren;
+  int maxChildren;
+  float splitterChance;
+  // Pick from all of the templates rather than just the random one
+  int mixTemplates;
+};
+
+void TimelineGeneratePhase(struct FWGLTimeline *timeline, int *capacity,
+                           struct FWGLSimulation *random,
+                           const struct TimelinePhase *phase) {
+  double placement = RandDouble(random);
+  for (float time = phase->start; time < phase->end;
+       time += 1 / phase->rate) {
+    struct FWGLTimelineEvent *event = TimelineAppend(timeline, capacity);
+
+    // Spread out along a golden ratio sequence, like the launcher does
+    placement += GOLDEN_RATIO_FRACTION;
+    placement -= (int)placement;
+    event->time = time;
+    event->position[0] = (float)(0.1 + 0.8 * placement);
+    event->position[1] = -50;
+    event->velocity[0] = (float)RandIntRange(random, -60, 60);
+    event->velocity[1] = (float)RandIntRange(random, 280, 400);
+
+    float colour[4] = {0};
+    RandomBrightColour(random, colour);
+    event->colour[0] = colour[0];
+    event->colour[1] = colour[1];
+    event->colour[2] = colour[2];
+
+    event->burst = BURST_RANDOM;
+    event->children = 0;
+    event->fuse = 0;
+    if (phase->mixTemplates) {
+      event->burst = RandIntRange(random, BURST_RING, BURST_TEMPLATES);
+      if (RandDouble(random) < phase->splitterChance) {
+        event->burst |= BURST_SPLITTER;
+      }
+      event->children =
+          RandIntRange(random, phase->minChildren, phase->maxChildren);
+      event->fuse = RandIntRange(random, 18, 26) / 10.0f;
+    }
+  }
+}
+
+// sparse, steady or finale, each a minute long and looping. Returns 0 if
+// there's no profile called that.
+int TimelineGenerate(struct FWGLTimeline *timeline, const char *profile,
+                     unsigned long long seed) {
+  // Sparse is the classic look at about its usual pace. Steady is a busy show
+  // that never lets up, and finale is that building to a storm of rockets.
+  static const struct TimelinePhase sparse[] = {
+      {0, TIMELINE_PROFILE_PERIOD, 0.6f, 0, 0, 0, 0},
+  };
+  static const struct TimelinePhase steady[] = {
+      {0, TIMELINE_PROFILE_PERIOD, 8, 30, 60, 0.15f, 1},
+  };
+  static const struct TimelinePhase finale[] = {
+      {0, 40, 8, 30, 60, 0.15f, 1},
+      {40, 52, 30, 40, 80, 0.1f, 1},
+  };
+
+  const struct TimelinePhase *phases;
+  int phaseCount;
+  if (strcmp(profile, "sparse") == 0) {
+    phases = sparse;
+    phaseCount = sizeof(sparse) / sizeof(sparse[0]);
+  } else if (strcmp(profile, "steady") == 0) {
+    phases = steady;
+    phaseCount = sizeof(steady) / sizeof(steady[0]);
+  } else if (strcmp(profile, "finale") == 0) {
+    phases = finale;
+    phaseCount = sizeof(finale) / sizeof(finale[0]);
+  } else {
+    return 0;
+  }
+
+  memset(timeline, 0, sizeof(struct FWGLTimeline));
+  timeline->period = TIMELINE_PROFILE_PERIOD;
+  int capacity = 0;
+
+  // Only borrowed for its random numbers
+  struct FWGLSimulation random;
+  SimulationInit(&random, seed);
+  for (int i = 0; i < phaseCount; i++) {
+    TimelineGeneratePhase(timeline, &capacity, &random, &(phases[i]));
+  }
+  TimelineSort(timeline);
+  return 1;
+}
+
+// A built in profile if there's one with that name, otherwise a file
+int TimelineOpen(struct FWGLTimeline *timeline, const char *profileOrPath) {
+  if (TimelineGenerate(timeline, profileOrPath, TIMELINE_PROFILE_SEED)) {
+    return 1;
+  }
+  return TimelineLoad(timeline, profileOrPath);
+}
+
+void TimelineFree(struct FWGLTimeline *timeline) {
+  free(timeline->events);
+  timeline->events = NULL;
+  timeline->count = 0;
+}
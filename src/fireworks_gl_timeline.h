@@ -0,0 +1,24 @@
+#pragma once
+#include "fireworks_gl_process.h"
+
+// A timeline file has one rocket per line, in any order:
+//
+//     # time  x    y    vx   vy   r   g   b   burst  splitter children [fuse]
+//     0.5     0.5  -50  0    350  1   0.6 0   peony  0        40       2.2
+//
+// x is a fraction of the screen width and y is in pixels up from the bottom.
+// A negative red picks a random bright colour, and 0 children or fuse leaves
+// them random too. The burst is one of random, ring, peony, willow or palm.
+// A "loop <seconds>" line makes it start over every that many seconds.
+// Anything after a # is ignored.
+
+// Built in load profiles, for benchmarks that need the same work every time
+#define TIMELINE_PROFILE_PERIOD 60.0f
+#define TIMELINE_PROFILE_SEED 1
+
+int TimelineParse(struct FWGLTimeline *timeline, char *text, const char *name);
+int TimelineLoad(struct FWGLTimeline *timeline, const char *path);
+int TimelineGenerate(struct FWGLTimeline *timeline, const char *profile,
+                     unsigned long long seed);
+int TimelineOpen(struct FWGLTimeline *timeline, const char *profileOrPath);
+void TimelineFree(struct FWGLTimeline *timeline);
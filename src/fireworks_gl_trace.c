@@ -0,0 +1,573 @@
+#include "fireworks_gl_trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "fireworks_gl_threads.h"
+
+_Static_assert(sizeof(struct TraceFileHeader) == 16,
+               "trace header layout changed");
+_Static_assert(sizeof(struct TraceBlockHeader) == 16,
+               "trace block layout changed");
+_Static_assert(sizeof(struct TraceFrameHeader) == 56,
+               "trace frame layout changed");
+
+// Frames waiting for the writer thread. Any more than this and the frame loop
+// drops them rather than wait.
+#define TRACE_QUEUE_FRAMES 8
+
+// The most bytes a varint can take, and so a particle can take encoded
+#define TRACE_VARINT_MAX 5
+#define TRACE_PARTICLE_MAX ((3 + TRACE_FLOAT_COLUMNS) * TRACE_VARINT_MAX)
+
+#define TRACE_LZ_HASH_BITS 12
+#define TRACE_LZ_MIN_MATCH 4
+#define TRACE_LZ_MAX_OFFSET 65535
+
+//
+// LZ compression, in the same spirit as LZ4's block format: a token with the
+// literal and match lengths, the literals, then a 2 byte offset back to the
+// match. The last sequence is only literals.
+//
+
+size_t TraceCompressBound(size_t size) { return size + size / 255 + 16; }
+
+uint32_t TraceRead32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+unsigned char *TraceWriteLength(unsigned char *op, size_t length) {
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (unsigned char)length;
+  return op;
+}
+
+unsigned char *TraceWriteSequence(unsigned char *op,
+                                  const unsigned char *literals,
+                                  size_t literalLength, size_t offset,
+                                  size_t matchLength) {
+  unsigned char *token = op++;
+  *token = (unsigned char)((literalLength < 15 ? literalLength : 15) << 4);
+  if (literalLength >= 15) {
+    op = TraceWriteLength(op, literalLength - 15);
+  }
+  memcpy(op, literals, literalLength);
+  op += literalLength;
+
+  if (matchLength > 0) {
+    size_t extra = matchLength - TRACE_LZ_MIN_MATCH;
+    *token |= (unsigned char)(extra < 15 ? extra : 15);
+    *op++ = (unsigned char)(offset & 0xFF);
+    *op++ = (unsigned char)(offset >> 8);
+    if (extra >= 15) {
+      op = TraceWriteLength(op, extra - 15);
+    }
+  }
+  return op;
+}
+
+size_t TraceCompress(const unsigned char *in, size_t size, unsigned char *out) {
+  int table[1 << TRACE_LZ_HASH_BITS];
+  memset(table, 0xFF, sizeof(table));
+
+  unsigned char *op = out;
+  size_t anchor = 0;
+  size_t ip = 0;
+  while (ip + TRACE_LZ_MIN_MATCH <= size) {
+    uint32_t sequence = TraceRead32(in + ip);
+    uint32_t hash = (sequence * 2654435761u) >> (32 - TRACE_LZ_HASH_BITS);
+    int ref = table[hash];
+    table[hash] = (int)ip;
+
+    if (ref < 0 || ip - ref > TRACE_LZ_MAX_OFFSET ||
+        TraceRead32(in + ref) != sequence) {
+      ip++;
+      continue;
+    }
+
+    size_t length = TRACE_LZ_MIN_MATCH;
+    while (ip + length < size && in[ref + length] == in[ip + length]) {
+      length++;
+    }
+    op = TraceWriteSequence(op, in + anchor, ip - anchor, ip - ref, length);
+    ip += length;
+    anchor = ip;
+  }
+
+  op = TraceWriteSequence(op, in + anchor, size - anchor, 0, 0);
+  return op - out;
+}
+
+int TraceReadLength(const unsigned char **ip, const unsigned char *end,
+                    size_t *length) {
+  unsigned char byte;
+  do {
+    if (*ip >= end) {
+      return 0;
+    }
+    byte = *(*ip)++;
+    *length += byte;
+  } while (byte == 255);
+  return 1;
+}
+
+// Returns the decompressed size, or 0 if the input is broken
+size_t TraceDecompress(const unsigned char *in, size_t size,
+                       unsigned char *out, size_t outSize) {
+  const unsigned char *ip = in;
+  const unsigned char *end = in + size;
+  size_t op = 0;
+
+  while (ip < end) {
+    unsigned char token = *ip++;
+    size_t literalLength = token >> 4;
+    if (literalLength == 15 && !TraceReadLength(&ip, end, &literalLength)) {
+      return 0;
+    }
+    if (literalLength > (size_t)(end - ip) || literalLength > outSize - op) {
+      return 0;
+    }
+    memcpy(out + op, ip, literalLength);
+    ip += literalLength;
+    op += literalLength;
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      return 0;
+    }
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    size_t matchLength = token & 15;
+    if (matchLength == 15 && !TraceReadLength(&ip, end, &matchLength)) {
+      return 0;
+    }
+    matchLength += TRACE_LZ_MIN_MATCH;
+    if (offset == 0 || offset > op || matchLength > outSize - op) {
+      return 0;
+    }
+    // Byte by byte, because matches can overlap what they're copying
+    for (size_t i = 0; i < matchLength; i++, op++) {
+      out[op] = out[op - offset];
+    }
+  }
+
+  return op;
+}
+
+//
+// Columns
+//
+
+unsigned char *TraceWriteVarint(unsigned char *op, uint32_t value) {
+  while (value >= 0x80) {
+    *op++ = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  *op++ = (unsigned char)value;
+  return op;
+}
+
+int TraceReadVarint(const unsigned char **ip, const unsigned char *end,
+                    uint32_t *value) {
+  *value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (*ip >= end) {
+      return 0;
+    }
+    unsigned char byte = *(*ip)++;
+    *value |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+uint32_t TraceZigzag(int32_t value) {
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+int32_t TraceUnzigzag(uint32_t value) {
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// Make room for pool indices up to capacity, keeping what's there
+void TraceReferenceGrow(struct TraceReference *reference, int capacity) {
+  if (capacity <= reference->capacity) {
+    return;
+  }
+  int old = reference->capacity;
+  reference->ids = realloc(reference->ids, sizeof(uint32_t) * capacity);
+  reference->values = realloc(reference->values, sizeof(uint32_t) *
+                                                     TRACE_FLOAT_COLUMNS *
+                                                     capacity);
+  reference->alive = realloc(reference->alive, capacity);
+  memset(reference->ids + old, 0, sizeof(uint32_t) * (capacity - old));
+  memset(reference->values + TRACE_FLOAT_COLUMNS * old, 0,
+         sizeof(uint32_t) * TRACE_FLOAT_COLUMNS * (capacity - old));
+  memset(reference->alive + old, 0, capacity - old);
+  reference->capacity = capacity;
+}
+
+void TraceReferenceReset(struct TraceReference *reference, int capacity) {
+  TraceReferenceGrow(reference, capacity);
+  memset(reference->ids, 0, sizeof(uint32_t) * reference->capacity);
+  memset(reference->values, 0,
+         sizeof(uint32_t) * TRACE_FLOAT_COLUMNS * reference->capacity);
+  memset(reference->alive, 0, reference->capacity);
+}
+
+void TraceReferenceFree(struct TraceReference *reference) {
+  free(reference->ids);
+  free(reference->values);
+  free(reference->alive);
+  memset(reference, 0, sizeof(struct TraceReference));
+}
+
+// Remember this frame for the next one, and forget anything that died
+void TraceReferenceUpdate(struct TraceReference *reference,
+                          struct TraceFrame *frame) {
+  for (uint32_t p = 0; p < frame->header.particleCount; p++) {
+    struct TraceParticle *particle = &(frame->particles[p]);
+    reference->ids[particle->index] = particle->id;
+    memcpy(&(reference->values[TRACE_FLOAT_COLUMNS * particle->index]),
+           particle->values, sizeof(particle->values));
+    reference->alive[particle->index] = 2;
+  }
+
+  for (int i = 0; i < reference->capacity; i++) {
+    if (reference->alive[i] == 1) {
+      reference->ids[i] = 0;
+      memset(&(reference->values[TRACE_FLOAT_COLUMNS * i]), 0,
+             sizeof(uint32_t) * TRACE_FLOAT_COLUMNS);
+    }
+    reference->alive[i] = reference->alive[i] == 2;
+  }
+}
+
+// out needs room for the header and TRACE_PARTICLE_MAX bytes per particle
+size_t TraceEncodeFrame(struct TraceFrame *frame,
+                        struct TraceReference *reference, int keyframe,
+                        unsigned char *out) {
+  struct TraceFrameHeader *header = &(frame->header);
+  if (keyframe) {
+    TraceReferenceReset(reference, header->capacity);
+  } else {
+    TraceReferenceGrow(reference, header->capacity);
+  }
+
+  unsigned char *op = out;
+  memcpy(op, header, sizeof(*header));
+  op += sizeof(*header);
+
+  uint32_t count = header->particleCount;
+  struct TraceParticle *particles = frame->particles;
+  uint32_t last = 0;
+  for (uint32_t p = 0; p < count; p++) {
+    op = TraceWriteVarint(op, particles[p].index - last);
+    last = particles[p].index;
+  }
+  for (uint32_t p = 0; p < count; p++) {
+    uint32_t previous = reference->ids[particles[p].index];
+    op = TraceWriteVarint(op,
+                          TraceZigzag((int32_t)(particles[p].id - previous)));
+  }
+  for (uint32_t p = 0; p < count; p++) {
+    op = TraceWriteVarint(op, particles[p].type);
+  }
+  for (int column = 0; column < TRACE_FLOAT_COLUMNS; column++) {
+    for (uint32_t p = 0; p < count; p++) {
+      uint32_t bits;
+      memcpy(&bits, &(particles[p].values[column]), 4);
+      uint32_t previous =
+          reference->values[TRACE_FLOAT_COLUMNS * particles[p].index + column];
+      op = TraceWriteVarint(op, bits ^ previous);
+    }
+  }
+
+  TraceReferenceUpdate(reference, frame);
+  return op - out;
+}
+
+int TraceFrameReserve(struct TraceFrame *frame, int count) {
+  if (count > frame->particleCapacity) {
+    struct TraceParticle *particles =
+        realloc(frame->particles, sizeof(struct TraceParticle) * count);
+    if (particles == NULL) {
+      return 0;
+    }
+    frame->particles = particles;
+    frame->particleCapacity = count;
+  }
+  return 1;
+}
+
+void TraceFrameFree(struct TraceFrame *frame) {
+  free(frame->particles);
+  frame->particles = NULL;
+  frame->particleCapacity = 0;
+}
+
+// Returns 0 if the frame is broken, or it refers to a frame the reference
+// hasn't seen
+int TraceDecodeFrame(const unsigned char *in, size_t size,
+                     struct TraceReference *reference, int keyframe,
+                     struct TraceFrame *frame) {
+  const unsigned char *ip = in;
+  const unsigned char *end = in + size;
+  struct TraceFrameHeader *header = &(frame->header);
+  if (size < sizeof(*header)) {
+    return 0;
+  }
+  memcpy(header, ip, sizeof(*header));
+  ip += sizeof(*header);
+
+  uint32_t count = header->particleCount;
+  if (count > header->capacity ||
+      header->capacity > PARTICLE_HANDLE_SLOT_MASK ||
+      !TraceFrameReserve(frame, count)) {
+    return 0;
+  }
+  if (keyframe) {
+    TraceReferenceReset(reference, header->capacity);
+  } else {
+    TraceReferenceGrow(reference, header->capacity);
+  }
+
+  struct TraceParticle *particles = frame->particles;
+  uint32_t index = 0;
+  for (uint32_t p = 0; p < count; p++) {
+    uint32_t gap;
+    if (!TraceReadVarint(&ip, end, &gap) || index + gap >= header->capacity) {
+      return 0;
+    }
+    index += gap;
+    particles[p].index = index;
+  }
+  for (uint32_t p = 0; p < count; p++) {
+    uint32_t delta;
+    if (!TraceReadVarint(&ip, end, &delta)) {
+      return 0;
+    }
+    particles[p].id =
+        reference->ids[particles[p].index] + (uint32_t)TraceUnzigzag(delta);
+  }
+  for (uint32_t p = 0; p < count; p++) {
+    if (!TraceReadVarint(&ip, end, &(particles[p].type))) {
+      return 0;
+    }
+  }
+  for (int column = 0; column < TRACE_FLOAT_COLUMNS; column++) {
+    for (uint32_t p = 0; p < count; p++) {
+      uint32_t bits;
+      if (!TraceReadVarint(&ip, end, &bits)) {
+        return 0;
+      }
+      bits ^=
+          reference->values[TRACE_FLOAT_COLUMNS * particles[p].index + column];
+      memcpy(&(particles[p].values[column]), &bits, 4);
+    }
+  }
+
+  TraceReferenceUpdate(reference, frame);
+  return ip == end;
+}
+
+//
+// Writer
+//
+
+struct FWGLTraceWriter {
+  FILE *file;
+  FWGLThread thread;
+  FWGLMutex lock;
+  FWGLCond wake;
+  int quit;
+
+  // Guarded by lock
+  struct TraceFrame queue[TRACE_QUEUE_FRAMES];
+  int head;
+  int count;
+  uint32_t dropped;
+
+  // Only touched by the frame loop
+  struct TraceFrame staging;
+  uint32_t frames;
+
+  // Only touched by the writer thread
+  struct TraceFrame work;
+  struct TraceReference reference;
+  unsigned char *raw;
+  unsigned char *compressed;
+  size_t bufferSize;
+  uint32_t written;
+};
+
+void TraceWriterEncode(struct FWGLTraceWriter *writer) {
+  struct TraceFrame *frame = &(writer->work);
+  size_t rawBound = sizeof(struct TraceFrameHeader) +
+                    TRACE_PARTICLE_MAX * (size_t)frame->header.particleCount;
+  if (rawBound > writer->bufferSize) {
+    writer->bufferSize = rawBound;
+    writer->raw = realloc(writer->raw, rawBound);
+    writer->compressed =
+        realloc(writer->compressed, TraceCompressBound(rawBound));
+  }
+
+  struct TraceBlockHeader block;
+  block.frame = frame->header.frame;
+  block.keyframe = writer->written % TRACE_KEYFRAME_INTERVAL == 0;
+  block.rawSize = (uint32_t)TraceEncodeFrame(frame, &(writer->reference),
+                                             block.keyframe, writer->raw);
+  block.compressedSize =
+      (uint32_t)TraceCompress(writer->raw, block.rawSize, writer->compressed);
+
+  fwrite(&block, sizeof(block), 1, writer->file);
+  fwrite(writer->compressed, 1, block.compressedSize, writer->file);
+  writer->written++;
+}
+
+int TraceWriterThread(void *arg) {
+  struct FWGLTraceWriter *writer = arg;
+
+  MutexLock(&(writer->lock));
+  while (1) {
+    while (writer->count == 0 && !writer->quit) {
+      CondWait(&(writer->wake), &(writer->lock));
+    }
+    if (writer->count == 0) {
+      break;
+    }
+
+    // Swap buffers rather than copy, then encode without holding the lock
+    struct TraceFrame frame = writer->queue[writer->head];
+    writer->queue[writer->head] = writer->work;
+    writer->work = frame;
+    writer->head = (writer->head + 1) % TRACE_QUEUE_FRAMES;
+    writer->count--;
+    MutexUnlock(&(writer->lock));
+
+    TraceWriterEncode(writer);
+    MutexLock(&(writer->lock));
+  }
+  MutexUnlock(&(writer->lock));
+
+  return 0;
+}
+
+struct FWGLTraceWriter *TraceWriterOpen(const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    printf("Couldn't open %s to trace to\n", path);
+    return NULL;
+  }
+
+  struct TraceFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.keyframeInterval = TRACE_KEYFRAME_INTERVAL;
+  fwrite(&header, sizeof(header), 1, file);
+
+  struct FWGLTraceWriter *writer = calloc(1, sizeof(struct FWGLTraceWriter));
+  writer->file = file;
+  MutexInit(&(writer->lock));
+  CondInit(&(writer->wake));
+  if (!ThreadCreate(&(writer->thread), TraceWriterThread, writer)) {
+    printf("Couldn't start the trace writer\n");
+    CondDestroy(&(writer->wake));
+    MutexDestroy(&(writer->lock));
+    fclose(file);
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+// Copy out the live particles and queue them up for the writer thread. If it's
+// fallen behind, the frame is dropped rather than hold up the frame loop.
+void TraceWriterRecord(struct FWGLTraceWriter *writer,
+                       struct FWGLSimulation *simulation, float dSecs,
+                       float frameSeconds) {
+  struct TraceFrame *frame = &(writer->staging);
+  if (!TraceFrameReserve(frame, simulation->liveParticles)) {
+    return;
+  }
+
+  struct TraceFrameHeader *header = &(frame->header);
+  memset(header, 0, sizeof(*header));
+  header->frame = writer->frames++;
+  header->dSecs = dSecs;
+  header->frameSeconds = frameSeconds;
+  header->time = simulation->time;
+  header->spawned = simulation->nextParticleId;
+  header->evictions = simulation->evictions;
+  header->capacity = simulation->capacity;
+
+  uint32_t count = 0;
+  uint32_t room = (uint32_t)frame->particleCapacity;
+  for (int i = 0; i < simulation->capacity && count < room; i++) {
+    struct Particle *p = ParticleAt(simulation, i);
+    if (!p->isAlive) {
+      continue;
+    }
+    struct TraceParticle *particle = &(frame->particles[count++]);
+    particle->index = i;
+    particle->id = p->id;
+    particle->type = p->type;
+    particle->values[0] = p->remainingLife;
+    particle->values[1] = p->position[0];
+    particle->values[2] = p->position[1];
+    particle->values[3] = p->velocity[0];
+    particle->values[4] = p->velocity[1];
+    memcpy(&(particle->values[5]), p->colour, sizeof(p->colour));
+    header->typeCounts[p->type]++;
+  }
+  header->particleCount = count;
+
+  MutexLock(&(writer->lock));
+  header->dropped = writer->dropped;
+  if (writer->count == TRACE_QUEUE_FRAMES) {
+    writer->dropped++;
+  } else {
+    int tail = (writer->head + writer->count) % TRACE_QUEUE_FRAMES;
+    struct TraceFrame queued = writer->queue[tail];
+    writer->queue[tail] = *frame;
+    *frame = queued;
+    writer->count++;
+    CondSignal(&(writer->wake));
+  }
+  MutexUnlock(&(writer->lock));
+}
+
+// Waits for everything queued to be written
+void TraceWriterClose(struct FWGLTraceWriter *writer) {
+  if (writer == NULL) {
+    return;
+  }
+
+  MutexLock(&(writer->lock));
+  writer->quit = 1;
+  CondSignal(&(writer->wake));
+  MutexUnlock(&(writer->lock));
+  ThreadJoin(writer->thread);
+
+  fclose(writer->file);
+  for (int i = 0; i < TRACE_QUEUE_FRAMES; i++) {
+    TraceFrameFree(&(writer->queue[i]));
+  }
+  TraceFrameFree(&(writer->staging));
+  TraceFrameFree(&(writer->work));
+  TraceReferenceFree(&(writer->reference));
+  free(writer->raw);
+  free(writer->compressed);
+  CondDestroy(&(writer->wake));
+  MutexDestroy(&(writer->lock));
+  free(writer);
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fireworks_gl_process.h"
+
+// Bumped whenever the block or column layout changes
+#define TRACE_VERSION 1
+#define TRACE_MAGIC "FWGLTRCE"
+
+// Every this many frames is encoded on its own, so a reader can start there
+#define TRACE_KEYFRAME_INTERVAL 120
+
+// A trace is a TraceFileHeader, then one block per frame: a TraceBlockHeader
+// and that many LZ compressed bytes. Uncompressed, a frame is its
+// TraceFrameHeader and then each column in turn, every value a LEB128
+// varint:
+//     index   - gap from the last live particle's pool index
+//     id      - zigzag difference from the id at that index last frame
+//     type    - as is
+//     floats  - life, position x/y, velocity x/y, colour r/g/b/a, each as its
+//               bits XORed with the same value at that index last frame
+// "Last frame" is all zeroes at a keyframe, and for any index that wasn't
+// alive last frame. Positions and velocities are 2D, because z is always 0.
+struct TraceFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t keyframeInterval;
+};
+
+struct TraceBlockHeader {
+  uint32_t frame;
+  uint32_t keyframe;
+  uint32_t rawSize;
+  uint32_t compressedSize;
+};
+
+struct TraceFrameHeader {
+  uint32_t frame;
+  uint32_t particleCount;
+  float dSecs;
+  // Real time spent simulating and drawing the frame
+  float frameSeconds;
+  double time;
+  // Running totals
+  uint32_t spawned;
+  uint32_t evictions;
+  // Frames the writer thread couldn't keep up with
+  uint32_t dropped;
+  uint32_t capacity;
+  uint32_t typeCounts[3];
+  uint32_t reserved;
+};
+
+#define TRACE_FLOAT_COLUMNS 9
+
+// One live particle, as it's handed to the writer thread
+struct TraceParticle {
+  uint32_t index;
+  uint32_t id;
+  uint32_t type;
+  // life, position x/y, velocity x/y, colour r/g/b/a
+  float values[TRACE_FLOAT_COLUMNS];
+};
+
+struct TraceFrame {
+  struct TraceFrameHeader header;
+  struct TraceParticle *particles;
+  int particleCapacity;
+};
+
+// What both the encoder and decoder remember about the last frame
+struct TraceReference {
+  uint32_t *ids;
+  uint32_t *values;
+  unsigned char *alive;
+  int capacity;
+};
+
+struct FWGLTraceWriter;
+
+size_t TraceCompressBound(size_t size);
+size_t TraceCompress(const unsigned char *in, size_t size, unsigned char *out);
+size_t TraceDecompress(const unsigned char *in, size_t size,
+                       unsigned char *out, size_t outSize);
+
+void TraceReferenceReset(struct TraceReference *reference, int capacity);
+void TraceReferenceFree(struct TraceReference *reference);
+size_t TraceEncodeFrame(struct TraceFrame *frame,
+                        struct TraceReference *reference, int keyframe,
+                        unsigned char *out);
+int TraceDecodeFrame(const unsigned char *in, size_t size,
+                     struct TraceReference *reference, int keyframe,
+                     struct TraceFrame *frame);
+void TraceFrameFree(struct TraceFrame *frame);
+
+struct FWGLTraceWriter *TraceWriterOpen(const char *path);
+void TraceWriterRecord(struct FWGLTraceWriter *writer,
+                       struct FWGLSimulation *simulation, float dSecs,
+                       float frameSeconds);
+void TraceWriterClose(struct FWGLTraceWriter *writer);
@@ -0,0 +1,205 @@
+// Runs lots of independent simulations at once, one per core, with no window
+// or GL. Each one is seeded from /seed plus its index, so any of them can be
+// run again on its own and come out the same.
+//
+//     fwgl_batch <instances> <seconds> [/finale] [/smoke] [/seed <n>]
+//                [/size <width> <height>] [/threads <n>] [/timeline <name>]
+//
+// Prints a tab-separated line of statistics per instance, in order.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fireworks_gl_jobs.h"
+#include "fireworks_gl_process.h"
+#include "fireworks_gl_timeline.h"
+
+struct BatchOptions {
+  int instances;
+  float seconds;
+  int useFinale;
+  int useSmoke;
+  unsigned long long seed;
+  int width;
+  int height;
+  int threads;
+  // Shared by every instance, if set
+  const char *timelineName;
+  struct FWGLTimeline timeline;
+};
+
+struct BatchResult {
+  unsigned long long seed;
+  unsigned int ticks;
+  unsigned int spawned;
+  int peakParticles;
+  double meanParticles;
+  int peakRockets;
+  int peakCapacity;
+  double milliseconds;
+};
+
+struct Batch {
+  struct BatchOptions options;
+  struct BatchResult *results;
+};
+
+double BatchNow() {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void BatchRunInstance(struct Batch *batch, int instance) {
+  struct BatchOptions *options = &(batch->options);
+  struct BatchResult *result = &(batch->results[instance]);
+  double started = BatchNow();
+
+  // Same ceilings as the screensaver, and no jobs pool because every core is
+  // already busy with an instance of its own
+  struct FWGLSimulation simulation;
+  result->seed = options->seed + instance;
+  SimulationInit(&simulation, result->seed);
+  // Timelines aren't held back by maxRockets, so they need the finale's room
+  int busy = options->useFinale || options->timelineName != NULL;
+  simulation.maxRockets = options->useFinale ? 400 : 1;
+  ParticlePoolInit(&simulation, busy ? 200000 : 500);
+  if (options->useFinale) {
+    LaunchSchedulerFinale(&simulation);
+  }
+  if (options->timelineName != NULL) {
+    SimulationSetTimeline(&simulation, &(options->timeline));
+  }
+  if (options->useSmoke) {
+    simulation.smoke =
+        SmokeGridCreate(options->width, options->height, SMOKE_CELL_SIZE);
+  }
+
+  double liveTotal = 0;
+  int ticks = (int)(options->seconds * 60);
+  for (int tick = 0; tick < ticks; tick++) {
+    MoveParticles(&simulation, options->width, options->height, 1 / 60.0f);
+
+    liveTotal += simulation.liveParticles;
+    if (simulation.liveParticles > result->peakParticles) {
+      result->peakParticles = simulation.liveParticles;
+    }
+    if (simulation.liveRockets > result->peakRockets) {
+      result->peakRockets = simulation.liveRockets;
+    }
+    if (simulation.capacity > result->peakCapacity) {
+      result->peakCapacity = simulation.capacity;
+    }
+  }
+
+  result->ticks = simulation.tick;
+  result->spawned = simulation.nextParticleId;
+  result->meanParticles = ticks > 0 ? liveTotal / ticks : 0;
+  SimulationFree(&simulation);
+  result->milliseconds = 1000 * (BatchNow() - started);
+}
+
+void BatchRunInstances(void *context, int begin, int end) {
+  for (int instance = begin; instance < end; instance++) {
+    BatchRunInstance(context, instance);
+  }
+}
+
+void BatchPrintHelp() {
+  printf("Usage: fwgl_batch <instances> <seconds> [options]\n");
+  printf("  /finale - Run the finale show instead of one rocket at a time\n");
+  printf("  /smoke - Simulate haze as a smoke grid instead of particles\n");
+  printf("  /seed <n> - Instance i is seeded with n + i (default 1)\n");
+  printf("  /size <width> <height> - Screen size (default 1920 1080)\n");
+  printf("  /threads <n> - Instances to run at once (default one per core)\n");
+  printf("  /timeline <name> - Launch from a timeline file, or the sparse, "
+         "steady or finale profile\n");
+}
+
+int BatchParseArgs(struct BatchOptions *options, int argc, char *argv[]) {
+  if (argc < 3) {
+    return 0;
+  }
+
+  options->instances = atoi(argv[1]);
+  options->seconds = (float)atof(argv[2]);
+  options->useFinale = 0;
+  options->useSmoke = 0;
+  options->seed = 1;
+  options->width = 1920;
+  options->height = 1080;
+  options->threads = JobsDefaultThreadCount();
+  options->timelineName = NULL;
+  if (options->instances <= 0 || options->seconds <= 0) {
+    return 0;
+  }
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "/finale") == 0) {
+      options->useFinale = 1;
+    } else if (strcmp(argv[i], "/smoke") == 0) {
+      options->useSmoke = 1;
+    } else if (strcmp(argv[i], "/seed") == 0 && i + 1 < argc) {
+      options->seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "/size") == 0 && i + 2 < argc) {
+      options->width = atoi(argv[++i]);
+      options->height = atoi(argv[++i]);
+      if (options->width <= 0 || options->height <= 0) {
+        return 0;
+      }
+    } else if (strcmp(argv[i], "/threads") == 0 && i + 1 < argc) {
+      options->threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "/timeline") == 0 && i + 1 < argc) {
+      options->timelineName = argv[++i];
+      if (!TimelineOpen(&(options->timeline), options->timelineName)) {
+        return 0;
+      }
+    } else {
+      printf("Unrecognised argument: %s\n", argv[i]);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  struct Batch batch;
+  if (!BatchParseArgs(&(batch.options), argc, argv)) {
+    BatchPrintHelp();
+    return 1;
+  }
+  batch.results = calloc(batch.options.instances, sizeof(struct BatchResult));
+
+  // Instances are handed out one at a time, so a slow one doesn't hold up a
+  // whole range of others
+  double started = BatchNow();
+  struct FWGLJobs *jobs = JobsCreate(batch.options.threads);
+  JobsParallelFor(jobs, batch.options.instances, 1, BatchRunInstances, &batch);
+  int threads = JobsThreadCount(jobs);
+  JobsDestroy(jobs);
+  double elapsed = BatchNow() - started;
+
+  printf("instance\tseed\tticks\tspawned\tpeak_particles\tmean_particles\t"
+         "peak_rockets\tpeak_capacity\tms\n");
+  for (int i = 0; i < batch.options.instances; i++) {
+    struct BatchResult *result = &(batch.results[i]);
+    printf("%d\t%llu\t%u\t%u\t%d\t%.1f\t%d\t%d\t%.1f\n", i, result->seed,
+           result->ticks, result->spawned, result->peakParticles,
+           result->meanParticles, result->peakRockets, result->peakCapacity,
+           result->milliseconds);
+  }
+  fprintf(stderr,
+          "%d instances of %.1fs on %d threads in %.2fs (%.1f simulated "
+          "seconds per second)\n",
+          batch.options.instances, batch.options.seconds, threads, elapsed,
+          batch.options.instances * batch.options.seconds / elapsed);
+
+  if (batch.options.timelineName != NULL) {
+    TimelineFree(&(batch.options.timeline));
+  }
+  free(batch.results);
+  return 0;
+}
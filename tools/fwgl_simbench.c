@@ -0,0 +1,337 @@
+// Times MoveParticles on its own, with no window or GL, so simulation
+// performance can be tracked on any machine. Every combination of particle
+// ceiling and rocket count is run for the same simulated time at a fixed step.
+//
+//     fwgl_simbench [/particles <n,n,...>] [/rockets <n,n,...>]
+//                   [/seconds <s>] [/warmup <s>] [/dt <s>] [/finale]
+//                   [/timeline <name>] [/smoke] [/seed <n>]
+//                   [/size <width> <height>] [/json <file>]
+//
+// Prints a table, and writes the same numbers as JSON if asked to.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "fireworks_gl_jobs.h"
+#include "fireworks_gl_process.h"
+#include "fireworks_gl_timeline.h"
+
+// Bumped whenever the JSON changes shape
+#define SIMBENCH_VERSION 1
+#define SIMBENCH_MAX_VALUES 16
+
+struct SimbenchOptions {
+  int particles[SIMBENCH_MAX_VALUES];
+  int particleCount;
+  int rockets[SIMBENCH_MAX_VALUES];
+  int rocketCount;
+  float seconds;
+  float warmup;
+  float dt;
+  int useFinale;
+  int useSmoke;
+  unsigned long long seed;
+  int width;
+  int height;
+  const char *jsonPath;
+  const char *timelineName;
+  struct FWGLTimeline timeline;
+};
+
+struct SimbenchResult {
+  int maxParticles;
+  int maxRockets;
+  int steps;
+  double wallSeconds;
+  // Live particles summed over every step
+  double particleSteps;
+  double worstStepSeconds;
+  int peakParticles;
+  unsigned int spawned;
+  unsigned int evictions;
+  size_t peakBytes;
+};
+
+double SimbenchNow() {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Of the whole process so far, or 0 where that can't be found out
+long SimbenchPeakRssKiB() {
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
+
+void SimbenchRun(struct SimbenchOptions *options,
+                 struct SimbenchResult *result) {
+  struct FWGLSimulation simulation;
+  SimulationInit(&simulation, options->seed);
+  simulation.maxRockets = result->maxRockets;
+  ParticlePoolInit(&simulation, result->maxParticles);
+  if (options->useFinale) {
+    LaunchSchedulerFinale(&simulation);
+  }
+  if (options->timelineName != NULL) {
+    SimulationSetTimeline(&simulation, &(options->timeline));
+  }
+  if (options->useSmoke) {
+    simulation.smoke =
+        SmokeGridCreate(options->width, options->height, SMOKE_CELL_SIZE);
+    simulation.jobs = JobsCreate(JobsDefaultThreadCount());
+  }
+
+  // Untimed, so the sky is busy before measuring starts
+  int warmupSteps = (int)(options->warmup / options->dt + 0.5f);
+  for (int step = 0; step < warmupSteps; step++) {
+    MoveParticles(&simulation, options->width, options->height, options->dt);
+  }
+
+  unsigned int spawned = simulation.nextParticleId;
+  unsigned int evictions = simulation.evictions;
+  result->steps = (int)(options->seconds / options->dt + 0.5f);
+  double started = SimbenchNow();
+  for (int step = 0; step < result->steps; step++) {
+    double stepStarted = SimbenchNow();
+    MoveParticles(&simulation, options->width, options->height, options->dt);
+    double stepSeconds = SimbenchNow() - stepStarted;
+
+    if (stepSeconds > result->worstStepSeconds) {
+      result->worstStepSeconds = stepSeconds;
+    }
+    result->particleSteps += simulation.liveParticles;
+    if (simulation.liveParticles > result->peakParticles) {
+      result->peakParticles = simulation.liveParticles;
+    }
+    size_t bytes = SimulationBytes(&simulation);
+    if (bytes > result->peakBytes) {
+      result->peakBytes = bytes;
+    }
+  }
+  result->wallSeconds = SimbenchNow() - started;
+  result->spawned = simulation.nextParticleId - spawned;
+  result->evictions = simulation.evictions - evictions;
+
+  SimulationFree(&simulation);
+  JobsDestroy(simulation.jobs);
+}
+
+double SimbenchNanosPerParticleStep(struct SimbenchResult *result) {
+  return result->particleSteps > 0
+             ? 1e9 * result->wallSeconds / result->particleSteps
+             : 0;
+}
+
+void SimbenchPrintTable(struct SimbenchOptions *options,
+                        struct SimbenchResult *results, int count) {
+  printf("%10s %8s %8s %10s %10s %10s %10s %10s %10s\n", "particles",
+         "rockets", "steps", "ns/p/step", "mean_ms", "worst_ms", "spawns/s",
+         "evictions", "peak_MiB");
+  for (int i = 0; i < count; i++) {
+    struct SimbenchResult *result = &(results[i]);
+    printf("%10d %8d %8d %10.2f %10.3f %10.3f %10.0f %10u %10.1f\n",
+           result->maxParticles, result->maxRockets, result->steps,
+           SimbenchNanosPerParticleStep(result),
+           1000 * result->wallSeconds / result->steps,
+           1000 * result->worstStepSeconds,
+           result->spawned / options->seconds, result->evictions,
+           result->peakBytes / (1024.0 * 1024.0));
+  }
+  printf("Peak RSS %ld KiB\n", SimbenchPeakRssKiB());
+}
+
+int SimbenchWriteJson(struct SimbenchOptions *options,
+                      struct SimbenchResult *results, int count) {
+  FILE *file = fopen(options->jsonPath, "w");
+  if (file == NULL) {
+    printf("Couldn't open %s to write to\n", options->jsonPath);
+    return 0;
+  }
+
+  fprintf(file, "{\n");
+  fprintf(file, "  \"version\": %d,\n", SIMBENCH_VERSION);
+  fprintf(file, "  \"dt\": %.9g,\n", options->dt);
+  fprintf(file, "  \"seconds\": %.9g,\n", options->seconds);
+  fprintf(file, "  \"warmup\": %.9g,\n", options->warmup);
+  fprintf(file, "  \"seed\": %llu,\n", options->seed);
+  fprintf(file, "  \"width\": %d,\n", options->width);
+  fprintf(file, "  \"height\": %d,\n", options->height);
+  fprintf(file, "  \"finale\": %s,\n", options->useFinale ? "true" : "false");
+  fprintf(file, "  \"smoke\": %s,\n", options->useSmoke ? "true" : "false");
+  if (options->timelineName != NULL) {
+    // Timeline names are file names or profiles, so only " and \ need escaping
+    fprintf(file, "  \"timeline\": \"");
+    for (const char *c = options->timelineName; *c != '\0'; c++) {
+      if (*c == '"' || *c == '\\') {
+        fputc('\\', file);
+      }
+      fputc(*c, file);
+    }
+    fprintf(file, "\",\n");
+  } else {
+    fprintf(file, "  \"timeline\": null,\n");
+  }
+  fprintf(file, "  \"peak_rss_kib\": %ld,\n", SimbenchPeakRssKiB());
+  fprintf(file, "  \"runs\": [\n");
+  for (int i = 0; i < count; i++) {
+    struct SimbenchResult *result = &(results[i]);
+    fprintf(file,
+            "    {\"max_particles\": %d, \"max_rockets\": %d, \"steps\": %d, "
+            "\"wall_seconds\": %.6f, \"ns_per_particle_step\": %.3f, "
+            "\"mean_step_ms\": %.4f, \"worst_step_ms\": %.4f, "
+            "\"mean_particles\": %.1f, \"peak_particles\": %d, "
+            "\"spawns_per_second\": %.1f, \"evictions\": %u, "
+            "\"peak_bytes\": %zu}%s\n",
+            result->maxParticles, result->maxRockets, result->steps,
+            result->wallSeconds, SimbenchNanosPerParticleStep(result),
+            1000 * result->wallSeconds / result->steps,
+            1000 * result->worstStepSeconds,
+            result->particleSteps / result->steps, result->peakParticles,
+            result->spawned / options->seconds, result->evictions,
+            result->peakBytes, i + 1 < count ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  fclose(file);
+  return 1;
+}
+
+void SimbenchPrintHelp() {
+  printf("Usage: fwgl_simbench [options]\n");
+  printf("  /particles <n,n,...> - Particle ceilings to try (default "
+         "500,20000,200000)\n");
+  printf("  /rockets <n,n,...> - Rocket counts to try (default 1,50,400)\n");
+  printf("  /seconds <s> - Simulated time measured per run (default 20)\n");
+  printf("  /warmup <s> - Simulated time before measuring (default 2)\n");
+  printf("  /dt <s> - Fixed time step (default 1/60)\n");
+  printf("  /finale - Use the finale launcher, with rocket counts as its "
+         "ceiling\n");
+  printf("  /timeline <name> - Launch from a timeline file, or the sparse, "
+         "steady or finale profile\n");
+  printf("  /smoke - Simulate haze as a smoke grid instead of particles\n");
+  printf("  /seed <n> - Random seed for every run (default 1)\n");
+  printf("  /size <width> <height> - Screen size (default 1920 1080)\n");
+  printf("  /json <file> - Also write the results to file as JSON\n");
+}
+
+// A comma separated list of positive numbers, returning how many there were
+int SimbenchParseList(const char *text, int *values) {
+  int count = 0;
+  while (*text != '\0' && count < SIMBENCH_MAX_VALUES) {
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || value <= 0 || (*end != ',' && *end != '\0')) {
+      return 0;
+    }
+    values[count++] = (int)value;
+    text = *end == ',' ? end + 1 : end;
+  }
+  return *text == '\0' ? count : 0;
+}
+
+int SimbenchParseArgs(struct SimbenchOptions *options, int argc,
+                      char *argv[]) {
+  memset(options, 0, sizeof(struct SimbenchOptions));
+  options->particleCount = SimbenchParseList("500,20000,200000",
+                                             options->particles);
+  options->rocketCount = SimbenchParseList("1,50,400", options->rockets);
+  options->seconds = 20;
+  options->warmup = 2;
+  options->dt = 1 / 60.0f;
+  options->seed = 1;
+  options->width = 1920;
+  options->height = 1080;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "/particles") == 0 && i + 1 < argc) {
+      options->particleCount =
+          SimbenchParseList(argv[++i], options->particles);
+      if (options->particleCount == 0) {
+        return 0;
+      }
+    } else if (strcmp(argv[i], "/rockets") == 0 && i + 1 < argc) {
+      options->rocketCount = SimbenchParseList(argv[++i], options->rockets);
+      if (options->rocketCount == 0) {
+        return 0;
+      }
+    } else if (strcmp(argv[i], "/seconds") == 0 && i + 1 < argc) {
+      options->seconds = (float)atof(argv[++i]);
+    } else if (strcmp(argv[i], "/warmup") == 0 && i + 1 < argc) {
+      options->warmup = (float)atof(argv[++i]);
+    } else if (strcmp(argv[i], "/dt") == 0 && i + 1 < argc) {
+      options->dt = (float)atof(argv[++i]);
+    } else if (strcmp(argv[i], "/finale") == 0) {
+      options->useFinale = 1;
+    } else if (strcmp(argv[i], "/smoke") == 0) {
+      options->useSmoke = 1;
+    } else if (strcmp(argv[i], "/seed") == 0 && i + 1 < argc) {
+      options->seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "/size") == 0 && i + 2 < argc) {
+      options->width = atoi(argv[++i]);
+      options->height = atoi(argv[++i]);
+      if (options->width <= 0 || options->height <= 0) {
+        return 0;
+      }
+    } else if (strcmp(argv[i], "/json") == 0 && i + 1 < argc) {
+      options->jsonPath = argv[++i];
+    } else if (strcmp(argv[i], "/timeline") == 0 && i + 1 < argc) {
+      options->timelineName = argv[++i];
+      if (!TimelineOpen(&(options->timeline), options->timelineName)) {
+        return 0;
+      }
+    } else {
+      printf("Unrecognised argument: %s\n", argv[i]);
+      return 0;
+    }
+  }
+
+  return options->dt > 0 && options->seconds >= options->dt &&
+         options->warmup >= 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct SimbenchOptions options;
+  if (!SimbenchParseArgs(&options, argc, argv)) {
+    SimbenchPrintHelp();
+    return 1;
+  }
+
+  int count = options.particleCount * options.rocketCount;
+  struct SimbenchResult *results =
+      calloc(count, sizeof(struct SimbenchResult));
+  for (int p = 0; p < options.particleCount; p++) {
+    for (int r = 0; r < options.rocketCount; r++) {
+      struct SimbenchResult *result =
+          &(results[p * options.rocketCount + r]);
+      result->maxParticles = options.particles[p];
+      result->maxRockets = options.rockets[r];
+      SimbenchRun(&options, result);
+      fprintf(stderr, "%d particles, %d rockets: %.2fs\n",
+              result->maxParticles, result->maxRockets, result->wallSeconds);
+    }
+  }
+
+  SimbenchPrintTable(&options, results, count);
+  int ok = options.jsonPath == NULL ||
+           SimbenchWriteJson(&options, results, count);
+
+  TimelineFree(&(options.timeline));
+  free(results);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,253 @@
+// Reads a trace recorded with /trace. By default prints a tab-separated line
+// per frame, then a summary of the frames that took much longer than usual.
+//
+//     fwgl_trace <file> [/frame <n>]
+//
+// With /frame, dumps every live particle in frame n instead. That decodes from
+// the keyframe before it, so it doesn't need to read the whole trace.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fireworks_gl_trace.h"
+
+// Frames that took this many times the median are called out
+#define SPIKE_FACTOR 2.0f
+
+struct TraceReader {
+  FILE *file;
+  struct TraceFileHeader header;
+  struct TraceBlockHeader block;
+  struct TraceReference reference;
+  struct TraceFrame frame;
+  unsigned char *compressed;
+  unsigned char *raw;
+  size_t compressedCapacity;
+  size_t rawCapacity;
+  unsigned long long compressedTotal;
+  unsigned long long rawTotal;
+};
+
+int TraceReaderOpen(struct TraceReader *reader, const char *path) {
+  memset(reader, 0, sizeof(struct TraceReader));
+  reader->file = fopen(path, "rb");
+  if (reader->file == NULL) {
+    printf("Couldn't open %s\n", path);
+    return 0;
+  }
+
+  struct TraceFileHeader *header = &(reader->header);
+  if (fread(header, sizeof(*header), 1, reader->file) != 1 ||
+      memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != TRACE_VERSION) {
+    printf("%s isn't a trace this version can read\n", path);
+    fclose(reader->file);
+    return 0;
+  }
+  return 1;
+}
+
+void TraceReaderClose(struct TraceReader *reader) {
+  fclose(reader->file);
+  TraceReferenceFree(&(reader->reference));
+  TraceFrameFree(&(reader->frame));
+  free(reader->compressed);
+  free(reader->raw);
+}
+
+// Returns 1 with the next block header read, 0 at the end, or -1 if the trace
+// is broken (which is usual for the last block if it was still recording)
+int TraceReaderNextBlock(struct TraceReader *reader) {
+  size_t read = fread(&(reader->block), 1, sizeof(struct TraceBlockHeader),
+                      reader->file);
+  if (read == 0) {
+    return 0;
+  }
+  return read == sizeof(struct TraceBlockHeader) ? 1 : -1;
+}
+
+int TraceReaderSkipBlock(struct TraceReader *reader) {
+  return fseek(reader->file, reader->block.compressedSize, SEEK_CUR) == 0;
+}
+
+int TraceReaderDecodeBlock(struct TraceReader *reader) {
+  struct TraceBlockHeader *block = &(reader->block);
+  if (block->compressedSize > reader->compressedCapacity) {
+    reader->compressedCapacity = block->compressedSize;
+    reader->compressed = realloc(reader->compressed, block->compressedSize);
+  }
+  if (block->rawSize > reader->rawCapacity) {
+    reader->rawCapacity = block->rawSize;
+    reader->raw = realloc(reader->raw, block->rawSize);
+  }
+  if (fread(reader->compressed, 1, block->compressedSize, reader->file) !=
+          block->compressedSize ||
+      TraceDecompress(reader->compressed, block->compressedSize, reader->raw,
+                      block->rawSize) != block->rawSize) {
+    return 0;
+  }
+
+  reader->compressedTotal += block->compressedSize;
+  reader->rawTotal += block->rawSize;
+  return TraceDecodeFrame(reader->raw, block->rawSize, &(reader->reference),
+                          block->keyframe, &(reader->frame));
+}
+
+int CompareFloats(const void *a, const void *b) {
+  float x = *(const float *)a;
+  float y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+int TracePrintFrames(struct TraceReader *reader) {
+  int capacity = 0;
+  int frames = 0;
+  float *frameSeconds = NULL;
+  uint32_t *frameNumbers = NULL;
+  unsigned long long particles = 0;
+  struct TraceFrameHeader previous = {0};
+  int result;
+
+  printf("frame\ttime\tframe_ms\tlive\trockets\tsparks\thaze\tspawns_per_s\t"
+         "evictions_per_s\tdropped\n");
+  while ((result = TraceReaderNextBlock(reader)) == 1) {
+    if (!TraceReaderDecodeBlock(reader)) {
+      result = -1;
+      break;
+    }
+
+    struct TraceFrameHeader *header = &(reader->frame.header);
+    // Over the time since the last frame in the trace, in case the recorder
+    // dropped some in between
+    double spawns = 0;
+    double evictions = 0;
+    if (frames > 0 && header->time > previous.time) {
+      double elapsed = header->time - previous.time;
+      spawns = (header->spawned - previous.spawned) / elapsed;
+      evictions = (header->evictions - previous.evictions) / elapsed;
+    }
+    printf("%u\t%.3f\t%.2f\t%u\t%u\t%u\t%u\t%.0f\t%.0f\t%u\n", header->frame,
+           header->time, 1000 * header->frameSeconds, header->particleCount,
+           header->typeCounts[PT_SPARK_ROCKET], header->typeCounts[PT_SPARK],
+           header->typeCounts[PT_HAZE], spawns, evictions, header->dropped);
+
+    if (frames == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 1024;
+      frameSeconds = realloc(frameSeconds, sizeof(float) * capacity);
+      frameNumbers = realloc(frameNumbers, sizeof(uint32_t) * capacity);
+    }
+    frameSeconds[frames] = header->frameSeconds;
+    frameNumbers[frames] = header->frame;
+    previous = *header;
+    particles += header->particleCount;
+    frames++;
+  }
+  if (result < 0) {
+    fprintf(stderr, "Stopped at a broken block after %d frames\n", frames);
+  }
+  if (frames == 0) {
+    free(frameSeconds);
+    free(frameNumbers);
+    return result == 0;
+  }
+
+  float *sorted = malloc(sizeof(float) * frames);
+  memcpy(sorted, frameSeconds, sizeof(float) * frames);
+  qsort(sorted, frames, sizeof(float), CompareFloats);
+  float median = sorted[frames / 2];
+  float worst = sorted[frames - 1];
+  free(sorted);
+
+  fprintf(stderr,
+          "%d frames, median %.2fms, worst %.2fms, %u dropped by the "
+          "recorder, compressed to %.1f%% (%.1f bytes per particle)\n",
+          frames, 1000 * median, 1000 * worst, previous.dropped,
+          100.0 * reader->compressedTotal / reader->rawTotal,
+          (double)reader->compressedTotal /
+              (particles > 0 ? particles : 1));
+
+  int spikes = 0;
+  for (int i = 0; i < frames; i++) {
+    if (frameSeconds[i] > SPIKE_FACTOR * median && median > 0) {
+      if (spikes++ < 20) {
+        fprintf(stderr, "  Spike at frame %u: %.2fms\n", frameNumbers[i],
+                1000 * frameSeconds[i]);
+      }
+    }
+  }
+  if (spikes > 20) {
+    fprintf(stderr, "  ...and %d more\n", spikes - 20);
+  }
+  fprintf(stderr, "%d frames took over %.0fx the median\n", spikes,
+          SPIKE_FACTOR);
+
+  free(frameSeconds);
+  free(frameNumbers);
+  return result == 0;
+}
+
+int TracePrintParticles(struct TraceReader *reader, uint32_t frame) {
+  // Find the last keyframe at or before the frame, skipping the data
+  long start = -1;
+  while (TraceReaderNextBlock(reader) == 1) {
+    if (reader->block.frame > frame) {
+      break;
+    }
+    if (reader->block.keyframe) {
+      start = ftell(reader->file) - (long)sizeof(struct TraceBlockHeader);
+    }
+    if (!TraceReaderSkipBlock(reader)) {
+      break;
+    }
+  }
+  if (start < 0) {
+    printf("Frame %u isn't in the trace\n", frame);
+    return 0;
+  }
+
+  fseek(reader->file, start, SEEK_SET);
+  while (TraceReaderNextBlock(reader) == 1) {
+    if (!TraceReaderDecodeBlock(reader)) {
+      break;
+    }
+    if (reader->block.frame < frame) {
+      continue;
+    }
+    if (reader->block.frame > frame) {
+      // Dropped by the recorder
+      break;
+    }
+
+    struct TraceFrame *decoded = &(reader->frame);
+    printf("index\tid\ttype\tlife\tx\ty\tvx\tvy\tr\tg\tb\ta\n");
+    for (uint32_t p = 0; p < decoded->header.particleCount; p++) {
+      struct TraceParticle *particle = &(decoded->particles[p]);
+      printf("%u\t%u\t%u", particle->index, particle->id, particle->type);
+      for (int i = 0; i < TRACE_FLOAT_COLUMNS; i++) {
+        printf("\t%.9g", particle->values[i]);
+      }
+      printf("\n");
+    }
+    return 1;
+  }
+
+  printf("Frame %u isn't in the trace\n", frame);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2 && !(argc == 4 && strcmp(argv[2], "/frame") == 0)) {
+    printf("Usage: fwgl_trace <file> [/frame <n>]\n");
+    return 1;
+  }
+
+  struct TraceReader reader;
+  if (!TraceReaderOpen(&reader, argv[1])) {
+    return 1;
+  }
+  int ok = argc == 4 ? TracePrintParticles(&reader, atoi(argv[3]))
+                     : TracePrintFrames(&reader);
+  TraceReaderClose(&reader);
+  return ok ? 0 : 1;
+}